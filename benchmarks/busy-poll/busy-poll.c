@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "../../src/redilon.h"
+
+#define PORT "8101"
+#define ROUND_TRIPS 100000
+#define WARMUP 1000
+#define PAYLOAD_SIZE 64
+#define BUSY_POLL_US 50
+#define ECHO 1
+
+/**
+ * Ping-pong round trip latency over tcp loopback against an async server, with and without busy polling.
+ * The client spins too when busy polling, so each side needs a cpu of its own: with a single cpu online neither side
+ * spins and both runs should give the same numbers.
+ *
+ * usage: ./busy-poll.out [round_trips]
+ */
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void printResults(char *name, uint64_t *samples, int size)
+{
+    qsort(samples, size, sizeof(uint64_t), compareSamples);
+    uint64_t total = 0;
+    for (int i = 0; i < size; i++)
+        total += samples[i];
+    printf("%-12s avg %7.2fus  p50 %7.2fus  p99 %7.2fus  p99.9 %7.2fus\n", name,
+           total / (double)size / 1000,
+           samples[size / 2] / 1000.0,
+           samples[(int)(size * 0.99)] / 1000.0,
+           samples[(int)(size * 0.999)] / 1000.0);
+}
+
+/**
+ * handlers
+ */
+void echo(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    char *payload = redilon_getString(buffer);
+    redilon_Packet *packet = redilon_createPacket(op_code);
+    redilon_addString(packet->buffer, payload);
+    redilon_sendToClient(client_fd, packet, 1);
+    redilon_free(payload);
+}
+
+void onPong(int server_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    *(int *)args = 1;
+}
+
+void serve(int server_fd, int busy_poll_us)
+{
+    int epoll_fd;
+    redilon_AsyncServerConf conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.server_fd = server_fd;
+    conf.epoll_fd = &epoll_fd;
+    conf.max_clients = 10;
+    conf.requestHandler = echo;
+    conf.busy_poll_us = busy_poll_us;
+    redilon_acceptConnectionsAsync(&conf);
+}
+
+/**
+ * The client has no event loop, it spins reading the socket without blocking instead.
+ */
+int readSpinning(int fd, int busy_poll_us)
+{
+    int received = 0;
+    if (busy_poll_us == 0)
+        return redilon_read(fd, onPong, &received);
+    uint64_t deadline = nowNs() + busy_poll_us * 1000;
+    int res;
+    while ((res = redilon_read(fd, onPong, &received)) == 0 && !received && nowNs() < deadline)
+        ;
+    // nothing came while spinning, block until it does
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (res == 0 && !received && poll(&pfd, 1, -1) != -1)
+        res = redilon_read(fd, onPong, &received);
+    return res;
+}
+
+void bench(char *name, int busy_poll_us, int round_trips, uint64_t *samples)
+{
+    redilon_SocketOptions options;
+    redilon_getDefaultSocketOptions(&options);
+    options.busy_poll_us = busy_poll_us;
+    int server_fd = redilon_createTcpServerWithOptions(PORT, 10, &options);
+    if (server_fd == -1)
+    {
+        printf("%s: could not create the server\n", name);
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        serve(server_fd, busy_poll_us);
+        exit(0);
+    }
+    close(server_fd);
+
+    int fd = redilon_connectToTcpServerWithOptions(NULL, PORT, &options);
+    if (fd == -1)
+    {
+        printf("%s: could not connect\n", name);
+        kill(pid, SIGKILL);
+        return;
+    }
+    // like the server, don't spin with a single cpu
+    int spin_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? busy_poll_us : 0;
+    if (spin_us > 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    char payload[PAYLOAD_SIZE];
+    memset(payload, 'x', PAYLOAD_SIZE - 1);
+    payload[PAYLOAD_SIZE - 1] = '\0';
+    for (int i = 0; i < WARMUP + round_trips; i++)
+    {
+        uint64_t start = nowNs();
+        redilon_Packet *packet = redilon_createPacket(ECHO);
+        redilon_addString(packet->buffer, payload);
+        redilon_sendToServer(fd, packet, NULL, NULL);
+        readSpinning(fd, spin_us);
+        if (i >= WARMUP)
+            samples[i - WARMUP] = nowNs() - start;
+    }
+    printResults(name, samples, round_trips);
+    redilon_closeServerConn(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    int round_trips = argc > 1 ? atoi(argv[1]) : ROUND_TRIPS;
+    uint64_t *samples = malloc(sizeof(uint64_t) * round_trips);
+    if (samples == NULL || round_trips <= 0)
+        return 1;
+    printf("%d round trips of a %d bytes payload, %ld cpus online\n", round_trips, PAYLOAD_SIZE, sysconf(_SC_NPROCESSORS_ONLN));
+
+    bench("blocking", 0, round_trips, samples);
+    bench("busy poll", BUSY_POLL_US, round_trips, samples);
+
+    free(samples);
+    return 0;
+}
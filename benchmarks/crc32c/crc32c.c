@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../../src/redilon.h"
+
+// bytes run through each implementation per size
+#define TOTAL_BYTES (1ull << 30)
+// packets per batch in the batch rows
+#define BATCH_SIZE 16
+
+/**
+ * Throughput of each crc32c implementation, on its own and fused into the serialization of a checksummed packet,
+ * next to the plain serialization that only copies. Then the same for a checksummed batch of checksummed packets,
+ * which is sent through a socket pair to check that every packet of it arrives.
+ *
+ * usage: ./crc32c.out
+ */
+
+static const size_t sizes[] = {64, 1024, 64 * 1024, 1024 * 1024};
+static const int sizes_size = sizeof(sizes) / sizeof(sizes[0]);
+
+static const char *names[] = {"best", "portable", "sse4.2", "pclmul"};
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double toGBs(uint64_t bytes, uint64_t elapsed_ns)
+{
+    return bytes / (double)elapsed_ns;
+}
+
+double benchCrc(void *data, size_t size)
+{
+    uint64_t rounds = TOTAL_BYTES / size;
+    uint32_t crc = 0;
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < rounds; i++)
+        crc = redilon_crc32c(crc, data, size);
+    uint64_t elapsed = nowNs() - start;
+    // keeps the loop from being optimized away
+    if (crc == 0x12345678)
+        printf(" ");
+    return toGBs(rounds * size, elapsed);
+}
+
+double benchSerialize(redilon_Packet *packet)
+{
+    uint64_t rounds = TOTAL_BYTES / packet->buffer->size;
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < rounds; i++)
+        redilon_free(redilon_serializePacket(packet));
+    return toGBs(rounds * packet->buffer->size, nowNs() - start);
+}
+
+/**
+ * A checksummed batch of `BATCH_SIZE` checksummed packets carrying `size` bytes in total.
+ */
+redilon_Packet *createBatch(uint8_t *data, size_t size)
+{
+    redilon_Packet *batch = redilon_createBatch();
+    batch->checksum = 1;
+    for (int i = 0; i < BATCH_SIZE; i++)
+    {
+        redilon_Packet *packet = redilon_createPacket(i);
+        packet->checksum = 1;
+        redilon_reserveBuffer(packet->buffer, size / BATCH_SIZE);
+        memcpy(packet->buffer->stream, data + i * (size / BATCH_SIZE), size / BATCH_SIZE);
+        packet->buffer->size = size / BATCH_SIZE;
+        redilon_addPacketToBatch(batch, packet);
+        redilon_freePacket(packet);
+    }
+    return batch;
+}
+
+void countPacket(int fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    int *received = args;
+    if (op_code == *received)
+        (*received)++;
+}
+
+struct ReadBatchArgs
+{
+    int fd;
+    int received;
+};
+
+void *readBatch(void *_args)
+{
+    struct ReadBatchArgs *args = _args;
+    redilon_read(args->fd, countPacket, &args->received);
+    return NULL;
+}
+
+/**
+ * @returns the packets of `batch` that arrived in order at the other end of a socket pair.
+ */
+int sendBatch(redilon_Packet *batch)
+{
+    int fds[2];
+    pthread_t reader;
+    struct ReadBatchArgs args = {.received = 0};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        return 0;
+    args.fd = fds[1];
+    // the batch may not fit in the socket buffers, it is read while it is being sent
+    if (pthread_create(&reader, NULL, readBatch, &args) != 0)
+        return 0;
+    redilon_sendToServer(fds[0], batch, NULL, NULL);
+    pthread_join(reader, NULL);
+    close(fds[0]);
+    close(fds[1]);
+    return args.received;
+}
+
+void printHeader(char *title)
+{
+    printf("%-24s", title);
+    for (int i = 0; i < sizes_size; i++)
+        printf("%9zuB", sizes[i]);
+    printf("   (GB/s)\n");
+}
+
+int main()
+{
+    size_t max_size = sizes[sizes_size - 1];
+    uint8_t *data = malloc(max_size);
+    redilon_Packet *packets[sizeof(sizes) / sizeof(sizes[0])];
+    if (data == NULL)
+        return 1;
+    for (size_t i = 0; i < max_size; i++)
+        data[i] = rand();
+    for (int i = 0; i < sizes_size; i++)
+    {
+        packets[i] = redilon_createPacket(1);
+        redilon_reserveBuffer(packets[i]->buffer, sizes[i]);
+        memcpy(packets[i]->buffer->stream, data, sizes[i]);
+        packets[i]->buffer->size = sizes[i];
+    }
+
+    printHeader("crc32c");
+    for (int impl = REDILON_CRC32C_PORTABLE; impl <= REDILON_CRC32C_PCLMUL; impl++)
+    {
+        if (redilon_setCrc32cImpl(impl) == -1)
+        {
+            printf("%-24s not supported by this cpu\n", names[impl]);
+            continue;
+        }
+        printf("%-24s", names[impl]);
+        for (int i = 0; i < sizes_size; i++)
+            printf("%10.2f", benchCrc(data, sizes[i]));
+        printf("\n");
+    }
+
+    printf("\n");
+    printHeader("serialize");
+    printf("%-24s", "no checksum");
+    for (int i = 0; i < sizes_size; i++)
+        printf("%10.2f", benchSerialize(packets[i]));
+    printf("\n");
+    for (int impl = REDILON_CRC32C_PORTABLE; impl <= REDILON_CRC32C_PCLMUL; impl++)
+    {
+        if (redilon_setCrc32cImpl(impl) == -1)
+            continue;
+        char name[32];
+        snprintf(name, sizeof(name), "checksum %s", names[impl]);
+        printf("%-24s", name);
+        for (int i = 0; i < sizes_size; i++)
+        {
+            packets[i]->checksum = 1;
+            printf("%10.2f", benchSerialize(packets[i]));
+            packets[i]->checksum = 0;
+        }
+        printf("\n");
+    }
+
+    redilon_setCrc32cImpl(REDILON_CRC32C_BEST);
+    printf("%-24s", "checksum batch");
+    int delivered = 0;
+    for (int i = 0; i < sizes_size; i++)
+    {
+        redilon_Packet *batch = createBatch(data, sizes[i]);
+        printf("%10.2f", benchSerialize(batch));
+        redilon_freePacket(batch);
+        // `redilon_sendToServer` frees the batch
+        delivered += sendBatch(createBatch(data, sizes[i]));
+    }
+    printf("\n%d of %d packets of the batches delivered\n", delivered, sizes_size * BATCH_SIZE);
+
+    for (int i = 0; i < sizes_size; i++)
+        redilon_freePacket(packets[i]);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "../../src/redilon.h"
+
+#define PORT "8102"
+#define LIGHT_CLIENTS 16
+#define DURATION_MS 2000
+// a ping that takes longer than this is counted as starved
+#define PING_TIMEOUT_MS 1000
+// frames the greedy client writes at once
+#define GREEDY_BATCH 512
+// cpu time the server spends on each greedy frame
+#define WORK_NS 2000
+#define PING 1
+#define WORK 2
+
+/**
+ * One greedy client pipelines frames as fast as it can while light clients do ping-pongs, against an async server.
+ * Without a read budget the loop keeps reading the greedy connection as long as it has data, so the pings wait;
+ * with the default budget they are served in between.
+ *
+ * usage: ./fair-read.out
+ */
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void printResults(char *name, uint64_t *samples, int size, int starved)
+{
+    if (size == 0)
+    {
+        printf("%-12s no ping completed, %d starved\n", name, starved);
+        return;
+    }
+    qsort(samples, size, sizeof(uint64_t), compareSamples);
+    printf("%-12s %6d pings  p50 %9.2fus  p99 %9.2fus  max %9.2fus  %d starved\n", name, size,
+           samples[size / 2] / 1000.0,
+           samples[(int)(size * 0.99)] / 1000.0,
+           samples[size - 1] / 1000.0,
+           starved);
+}
+
+/**
+ * handlers
+ */
+void handle(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    if (op_code == PING)
+    {
+        redilon_sendToClient(client_fd, redilon_createPacket(PING), 1);
+        return;
+    }
+    uint64_t until = nowNs() + WORK_NS;
+    while (nowNs() < until)
+        ;
+}
+
+void onPong(int server_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+}
+
+void onConnectionClosed(int client_fd, void *args)
+{
+    redilon_closeClientConn(client_fd, -1);
+}
+
+void serve(int server_fd, uint32_t budget)
+{
+    int epoll_fd;
+    redilon_AsyncServerConf conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.server_fd = server_fd;
+    conf.epoll_fd = &epoll_fd;
+    conf.max_clients = LIGHT_CLIENTS + 1;
+    conf.requestHandler = handle;
+    conf.onConnectionClosed = onConnectionClosed;
+    conf.read_budget = budget;
+    conf.frame_budget = budget;
+    redilon_acceptConnectionsAsync(&conf);
+}
+
+atomic_int stop;
+
+void *runGreedy(void *args)
+{
+    int fd = *(int *)args;
+    redilon_Packet *packet = redilon_createPacket(WORK);
+    redilon_addUInt64(packet->buffer, 0);
+    int size = redilon_getPacketSize(packet);
+    void *frame = redilon_serializePacket(packet);
+    char *frames = malloc(size * GREEDY_BATCH);
+    for (int i = 0; i < GREEDY_BATCH; i++)
+        memcpy(frames + i * size, frame, size);
+    while (!atomic_load(&stop))
+        if (write(fd, frames, size * GREEDY_BATCH) == -1)
+            break;
+    free(frames);
+    redilon_free(frame);
+    redilon_freePacket(packet);
+    return NULL;
+}
+
+void bench(char *name, uint32_t budget, uint64_t *samples)
+{
+    int server_fd = redilon_createTcpServer(PORT, LIGHT_CLIENTS + 1);
+    if (server_fd == -1)
+    {
+        printf("%s: could not create the server\n", name);
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        serve(server_fd, budget);
+        exit(0);
+    }
+    close(server_fd);
+
+    int light[LIGHT_CLIENTS];
+    for (int i = 0; i < LIGHT_CLIENTS; i++)
+        light[i] = redilon_connectToTcpServer(NULL, PORT);
+    int greedy = redilon_connectToTcpServer(NULL, PORT);
+    atomic_store(&stop, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, runGreedy, &greedy);
+
+    int size = 0;
+    int starved = 0;
+    uint64_t end = nowNs() + (uint64_t)DURATION_MS * 1000000;
+    while (nowNs() < end)
+        for (int i = 0; i < LIGHT_CLIENTS; i++)
+        {
+            uint64_t start = nowNs();
+            redilon_sendToServer(light[i], redilon_createPacket(PING), NULL, NULL);
+            struct pollfd pfd = {.fd = light[i], .events = POLLIN};
+            if (poll(&pfd, 1, PING_TIMEOUT_MS) != 1)
+            {
+                starved++;
+                continue;
+            }
+            redilon_read(light[i], onPong, NULL);
+            samples[size++] = nowNs() - start;
+        }
+    printResults(name, samples, size, starved);
+
+    atomic_store(&stop, 1);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    // the server is gone, the write fails if it was blocked
+    shutdown(greedy, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    for (int i = 0; i < LIGHT_CLIENTS; i++)
+        redilon_closeServerConn(light[i]);
+    redilon_closeServerConn(greedy);
+}
+
+int main()
+{
+    // enough for a ping every microsecond
+    uint64_t *samples = malloc(sizeof(uint64_t) * DURATION_MS * 1000);
+    if (samples == NULL)
+        return 1;
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d light clients against a greedy one for %dms, %dns of work per greedy frame\n", LIGHT_CLIENTS, DURATION_MS, WORK_NS);
+
+    bench("unbounded", UINT32_MAX, samples);
+    bench("budget", 0, samples);
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../../src/redilon.h"
+
+#define PORT "8100"
+#define UNIX_PATH "@redilon-latency-bench"
+#define ROUND_TRIPS 100000
+#define WARMUP 1000
+#define PAYLOAD_SIZE 64
+#define ECHO 1
+
+/**
+ * Ping-pong round trip latency of a small packet over each transport, client and server run in different processes.
+ *
+ * usage: ./latency.out [round_trips]
+ */
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void printResults(char *name, uint64_t *samples, int size)
+{
+    qsort(samples, size, sizeof(uint64_t), compareSamples);
+    uint64_t total = 0;
+    for (int i = 0; i < size; i++)
+        total += samples[i];
+    printf("%-12s avg %7.2fus  p50 %7.2fus  p99 %7.2fus  p99.9 %7.2fus\n", name,
+           total / (double)size / 1000,
+           samples[size / 2] / 1000.0,
+           samples[(int)(size * 0.99)] / 1000.0,
+           samples[(int)(size * 0.999)] / 1000.0);
+}
+
+redilon_Packet *createPing()
+{
+    redilon_Packet *packet = redilon_createPacket(ECHO);
+    char payload[PAYLOAD_SIZE];
+    memset(payload, 'x', PAYLOAD_SIZE - 1);
+    payload[PAYLOAD_SIZE - 1] = '\0';
+    redilon_addString(packet->buffer, payload);
+    return packet;
+}
+
+/**
+ * handlers
+ */
+void echo(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    char *payload = redilon_getString(buffer);
+    redilon_Packet *packet = redilon_createPacket(op_code);
+    redilon_addString(packet->buffer, payload);
+    redilon_sendToClient(client_fd, packet, 1);
+    redilon_free(payload);
+}
+
+void onPong(int server_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+}
+
+/**
+ * sockets
+ */
+void serveSocket(int server_fd)
+{
+    redilon_OnDemandServerConf conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.server_fd = server_fd;
+    conf.requestHandler = echo;
+    redilon_acceptConnectionsOnDemand(&conf);
+}
+
+void benchSocket(char *name, int server_fd, int (*connectToServer)(), int round_trips, uint64_t *samples)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        serveSocket(server_fd);
+        exit(0);
+    }
+    close(server_fd);
+
+    int fd = connectToServer();
+    if (fd == -1)
+    {
+        printf("%s: could not connect\n", name);
+        kill(pid, SIGKILL);
+        return;
+    }
+    for (int i = 0; i < WARMUP + round_trips; i++)
+    {
+        uint64_t start = nowNs();
+        redilon_sendToServer(fd, createPing(), onPong, NULL);
+        if (i >= WARMUP)
+            samples[i - WARMUP] = nowNs() - start;
+    }
+    printResults(name, samples, round_trips);
+    redilon_closeServerConn(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+int connectTcp()
+{
+    return redilon_connectToTcpServer(NULL, PORT);
+}
+
+int connectUnix()
+{
+    return redilon_connectToUnixServer(UNIX_PATH);
+}
+
+/**
+ * shared memory
+ */
+void benchShm(char *name, int spin_us, int round_trips, uint64_t *samples)
+{
+    redilon_ShmChannel *channel = redilon_createShmChannel(1 << 20, spin_us);
+    if (channel == NULL)
+    {
+        printf("%s: could not create the channel\n", name);
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        redilon_ShmChannel *server = redilon_attachShmChannel(dup(redilon_getShmChannelFd(channel)), spin_us);
+        while (redilon_readShm(server, echo, NULL) != -1)
+            ;
+        exit(0);
+    }
+
+    for (int i = 0; i < WARMUP + round_trips; i++)
+    {
+        uint64_t start = nowNs();
+        redilon_Packet *packet = createPing();
+        redilon_sendShm(channel, packet);
+        redilon_freePacket(packet);
+        redilon_readShm(channel, onPong, NULL);
+        if (i >= WARMUP)
+            samples[i - WARMUP] = nowNs() - start;
+    }
+    printResults(name, samples, round_trips);
+    redilon_closeShmChannel(channel);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    int round_trips = argc > 1 ? atoi(argv[1]) : ROUND_TRIPS;
+    uint64_t *samples = malloc(sizeof(uint64_t) * round_trips);
+    if (samples == NULL || round_trips <= 0)
+        return 1;
+    printf("%d round trips of a %d bytes payload\n", round_trips, PAYLOAD_SIZE);
+
+    int server_fd = redilon_createTcpServer(PORT, 10);
+    if (server_fd == -1)
+        printf("tcp: could not create the server\n");
+    else
+        benchSocket("tcp", server_fd, connectTcp, round_trips, samples);
+
+    server_fd = redilon_createUnixServer(UNIX_PATH, 10);
+    if (server_fd == -1)
+        printf("unix: could not create the server\n");
+    else
+        benchSocket("unix", server_fd, connectUnix, round_trips, samples);
+
+    benchShm("shm", 0, round_trips, samples);
+    benchShm("shm (spin)", 50, round_trips, samples);
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,398 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "../../src/redilon.h"
+
+#define HEADER_SIZE 5
+#define CHECKSUM_FLAG 0x80000000
+#define TRAILER_SIZE 4
+// replies still missing after the last frame was sent are waited for this long since the last one arrived
+#define DRAIN_TIMEOUT_MS 1000
+
+/**
+ * Plays a capture (see `redilon_startCapture`) back against a server, each captured connection over its own client
+ * connection and at the time its frames arrived, and reports the throughput and the latency of the replies.
+ *
+ * The latency assumes the server answers each frame with exactly one frame, in order. Frames are sent without
+ * checksum trailers, whatever they had when captured.
+ *
+ * usage: ./replay.out <capture> <host> <port> [-x speed] [-n copies]
+ *   -x  plays it `speed` times faster, `0` sends every frame as fast as the server takes them. `1` by default
+ *   -n  opens `copies` client connections per captured connection. `1` by default
+ */
+
+typedef struct Client
+{
+    pthread_t thread;
+    uint8_t *capture;
+    // offsets of the records of its captured connection, in order
+    size_t *records;
+    int size;
+    char *host;
+    char *port;
+    double speed;
+    uint64_t start;
+    // send time of each frame, the replies are matched to them in order
+    uint64_t *sent_at;
+    int sent;
+    uint64_t *latencies;
+    int replied;
+    uint64_t sent_bytes;
+    // the most a frame went out after its time
+    uint64_t max_lag;
+    int failed;
+} Client;
+
+typedef struct RecordRef
+{
+    uint64_t conn_id;
+    size_t offset;
+} RecordRef;
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(uint64_t *)a;
+    uint64_t y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// by connection, and by position in the file within it
+int compareRefs(const void *a, const void *b)
+{
+    const RecordRef *x = a;
+    const RecordRef *y = b;
+    if (x->conn_id != y->conn_id)
+        return x->conn_id < y->conn_id ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+redilon_CaptureRecord readRecord(uint8_t *capture, size_t offset)
+{
+    redilon_CaptureRecord record;
+    memcpy(&record, capture + offset, sizeof(record));
+    return record;
+}
+
+/**
+ * Takes the replies in `data`, `header` keeps the bytes of a header split across reads and `skip` the bytes left
+ * of the body being skipped.
+ */
+void takeReplies(Client *client, uint8_t *data, size_t size, uint8_t *header, int *header_size, size_t *skip)
+{
+    while (size > 0)
+    {
+        if (*skip > 0)
+        {
+            size_t length = size < *skip ? size : *skip;
+            *skip -= length;
+            data += length;
+            size -= length;
+            continue;
+        }
+        size_t length = HEADER_SIZE - *header_size;
+        if (length > size)
+            length = size;
+        memcpy(header + *header_size, data, length);
+        *header_size += length;
+        data += length;
+        size -= length;
+        if (*header_size < HEADER_SIZE)
+            return;
+        *header_size = 0;
+
+        uint32_t body_size;
+        memcpy(&body_size, header + 1, sizeof(uint32_t));
+        *skip = (body_size & ~CHECKSUM_FLAG) + ((body_size & CHECKSUM_FLAG) ? TRAILER_SIZE : 0);
+        if (client->replied < client->sent)
+        {
+            client->latencies[client->replied] = nowNs() - client->sent_at[client->replied];
+            client->replied++;
+        }
+    }
+}
+
+void *replayConnection(void *_client)
+{
+    Client *client = _client;
+    int fd = redilon_connectToTcpServer(client->host, client->port);
+    if (fd == -1 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        client->failed = 1;
+        return NULL;
+    }
+
+    uint8_t in[1 << 16];
+    uint8_t header[HEADER_SIZE];
+    int header_size = 0;
+    size_t skip = 0;
+    // the frame being sent, `frame_header` and then the body straight from the capture
+    uint8_t frame_header[HEADER_SIZE];
+    uint8_t *body = NULL;
+    size_t frame_size = 0;
+    size_t written = 0;
+    int next = 0;
+    uint64_t last_reply = 0;
+
+    while (1)
+    {
+        uint64_t now = nowNs();
+        int writing = written < frame_size;
+        uint64_t due = 0;
+        if (!writing && next < client->size)
+        {
+            redilon_CaptureRecord record = readRecord(client->capture, client->records[next]);
+            due = client->start + (client->speed > 0 ? (uint64_t)(record.at_ns / client->speed) : 0);
+            if (due <= now)
+            {
+                if (now - due > client->max_lag)
+                    client->max_lag = now - due;
+                frame_header[0] = record.op_code;
+                memcpy(frame_header + 1, &record.size, sizeof(uint32_t));
+                body = client->capture + client->records[next] + sizeof(redilon_CaptureRecord);
+                frame_size = HEADER_SIZE + record.size;
+                written = 0;
+                writing = 1;
+                client->sent_at[client->sent] = now;
+                next++;
+            }
+        }
+        if (!writing && next == client->size)
+        {
+            if (client->replied == client->sent)
+                break;
+            if (last_reply == 0)
+                last_reply = now;
+            if (now - last_reply > (uint64_t)DRAIN_TIMEOUT_MS * 1000000)
+                break;
+        }
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN | (writing ? POLLOUT : 0)};
+        int timeout = 0;
+        if (writing)
+            timeout = -1;
+        else if (next < client->size)
+            timeout = (due - now + 999999) / 1000000;
+        else
+            timeout = DRAIN_TIMEOUT_MS;
+        if (poll(&pfd, 1, timeout) == -1 && errno != EINTR)
+            break;
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t received = recv(fd, in, sizeof(in), 0);
+            if (received == 0 || (received == -1 && errno != EAGAIN && errno != EINTR))
+                break;
+            if (received > 0)
+            {
+                takeReplies(client, in, received, header, &header_size, &skip);
+                last_reply = nowNs();
+            }
+        }
+        if (writing && (pfd.revents & POLLOUT))
+        {
+            struct iovec iov[2];
+            int iov_size = 0;
+            if (written < HEADER_SIZE)
+                iov[iov_size++] = (struct iovec){.iov_base = frame_header + written, .iov_len = HEADER_SIZE - written};
+            size_t body_written = written > HEADER_SIZE ? written - HEADER_SIZE : 0;
+            if (frame_size > HEADER_SIZE)
+                iov[iov_size++] = (struct iovec){.iov_base = body + body_written, .iov_len = frame_size - HEADER_SIZE - body_written};
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iov_size};
+            ssize_t res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (res == -1 && errno != EAGAIN && errno != EINTR)
+                break;
+            if (res > 0)
+            {
+                written += res;
+                client->sent_bytes += res;
+                if (written == frame_size)
+                    client->sent++;
+            }
+        }
+    }
+    redilon_closeServerConn(fd);
+    return NULL;
+}
+
+void printResults(Client *clients, int clients_size, uint64_t elapsed, double speed)
+{
+    uint64_t sent = 0, replied = 0, bytes = 0, max_lag = 0;
+    int failed = 0;
+    for (int i = 0; i < clients_size; i++)
+    {
+        sent += clients[i].sent;
+        replied += clients[i].replied;
+        bytes += clients[i].sent_bytes;
+        failed += clients[i].failed;
+        if (clients[i].max_lag > max_lag)
+            max_lag = clients[i].max_lag;
+    }
+    double seconds = elapsed / 1e9;
+    printf("%d connections (%d failed to connect), %.2fs\n", clients_size, failed, seconds);
+    printf("sent     %lu frames  %.0f frames/s  %.2f MB/s\n", sent, sent / seconds, bytes / seconds / 1e6);
+    printf("replies  %lu  %.0f replies/s\n", replied, replied / seconds);
+    if (speed > 0)
+        printf("lag      max %.2fms behind the captured timing\n", max_lag / 1e6);
+    if (replied == 0)
+        return;
+
+    uint64_t *samples = malloc(sizeof(uint64_t) * replied);
+    if (samples == NULL)
+        return;
+    uint64_t size = 0, total = 0;
+    for (int i = 0; i < clients_size; i++)
+        for (int j = 0; j < clients[i].replied; j++)
+        {
+            samples[size++] = clients[i].latencies[j];
+            total += clients[i].latencies[j];
+        }
+    qsort(samples, size, sizeof(uint64_t), compareSamples);
+    printf("latency  avg %.2fus  p50 %.2fus  p99 %.2fus  p99.9 %.2fus  max %.2fus\n",
+           total / (double)size / 1000,
+           samples[size / 2] / 1000.0,
+           samples[(uint64_t)(size * 0.99)] / 1000.0,
+           samples[(uint64_t)(size * 0.999)] / 1000.0,
+           samples[size - 1] / 1000.0);
+    free(samples);
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1;
+    int copies = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:n:")) != -1)
+    {
+        if (opt == 'x')
+            speed = atof(optarg);
+        else if (opt == 'n')
+            copies = atoi(optarg);
+        else
+            return 1;
+    }
+    if (argc - optind != 3 || speed < 0 || copies <= 0)
+    {
+        printf("usage: %s <capture> <host> <port> [-x speed] [-n copies]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(redilon_CaptureHeader))
+    {
+        printf("could not open %s\n", argv[optind]);
+        return 1;
+    }
+    uint8_t *capture = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    redilon_CaptureHeader header;
+    if (capture == MAP_FAILED)
+        return 1;
+    memcpy(&header, capture, sizeof(header));
+    if (memcmp(header.magic, REDILON_CAPTURE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        printf("%s is not a capture\n", argv[optind]);
+        return 1;
+    }
+
+    // a capture still being written has no count yet, its records are walked until the zeroed tail
+    RecordRef *refs = malloc(sizeof(RecordRef) * (header.frames > 0 ? header.frames : 1));
+    uint64_t capacity = header.frames > 0 ? header.frames : 1;
+    uint64_t frames = 0;
+    size_t offset = sizeof(redilon_CaptureHeader);
+    while (refs != NULL && offset + sizeof(redilon_CaptureRecord) <= (size_t)st.st_size)
+    {
+        redilon_CaptureRecord record = readRecord(capture, offset);
+        if (record.conn_id == 0 || offset + sizeof(record) + record.size > (size_t)st.st_size)
+            break;
+        if (frames == capacity)
+        {
+            capacity *= 2;
+            refs = realloc(refs, sizeof(RecordRef) * capacity);
+            if (refs == NULL)
+                break;
+        }
+        refs[frames++] = (RecordRef){.conn_id = record.conn_id, .offset = offset};
+        offset += sizeof(record) + record.size;
+    }
+    if (refs == NULL)
+        return 1;
+    qsort(refs, frames, sizeof(RecordRef), compareRefs);
+
+    int connections = 0;
+    for (uint64_t i = 0; i < frames; i++)
+        if (i == 0 || refs[i].conn_id != refs[i - 1].conn_id)
+            connections++;
+    printf("%lu frames from %d connections (%lu dropped while capturing), %.1fx speed\n", frames, connections,
+           header.dropped, speed);
+
+    Client *clients = calloc(connections * copies, sizeof(Client));
+    size_t *records = malloc(sizeof(size_t) * (frames > 0 ? frames : 1));
+    if (clients == NULL || records == NULL)
+        return 1;
+    for (uint64_t i = 0; i < frames; i++)
+        records[i] = refs[i].offset;
+    int clients_size = 0;
+    for (uint64_t i = 0; i < frames;)
+    {
+        uint64_t end = i;
+        while (end < frames && refs[end].conn_id == refs[i].conn_id)
+            end++;
+        for (int j = 0; j < copies; j++)
+        {
+            Client *client = &clients[clients_size++];
+            client->capture = capture;
+            client->records = records + i;
+            client->size = end - i;
+            client->host = argv[optind + 1];
+            client->port = argv[optind + 2];
+            client->speed = speed;
+            client->sent_at = malloc(sizeof(uint64_t) * client->size);
+            client->latencies = malloc(sizeof(uint64_t) * client->size);
+            if (client->sent_at == NULL || client->latencies == NULL)
+                return 1;
+        }
+        i = end;
+    }
+    free(refs);
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < clients_size; i++)
+    {
+        clients[i].start = start;
+        if (pthread_create(&clients[i].thread, NULL, replayConnection, &clients[i]) != 0)
+        {
+            printf("could not start the thread of connection %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < clients_size; i++)
+        pthread_join(clients[i].thread, NULL);
+    printResults(clients, clients_size, nowNs() - start, speed);
+
+    for (int i = 0; i < clients_size; i++)
+    {
+        free(clients[i].sent_at);
+        free(clients[i].latencies);
+    }
+    free(clients);
+    free(records);
+    munmap(capture, st.st_size);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "../../src/redilon.h"
+
+#define TCP_PORT "8103"
+#define UDP_PORT "8104"
+#define METRICS 1000000
+// metrics sent before giving the receiver a moment, udp has no flow control and loopback drops what doesn't fit
+#define BURST 4096
+#define METRIC 1
+#define REPORT 2
+
+/**
+ * Fire-and-forget metrics, a uint64 each, sent to an async tcp server one write per packet and to a udp socket
+ * packed into datagrams that go out 64 at a time. The receivers count what they got and report it at the end.
+ *
+ * usage: ./udp.out
+ */
+
+uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t received;
+
+/**
+ * handlers
+ */
+void handle(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    if (op_code == METRIC)
+    {
+        received++;
+        return;
+    }
+    redilon_Packet *packet = redilon_createPacket(REPORT);
+    redilon_addUInt64(packet->buffer, received);
+    redilon_sendToClient(client_fd, packet, 1);
+}
+
+void onReport(int server_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+{
+    *(uint64_t *)args = redilon_getUInt64(buffer);
+}
+
+void onConnectionClosed(int client_fd, void *args)
+{
+    redilon_closeClientConn(client_fd, -1);
+}
+
+void printResults(char *name, uint64_t elapsed_ns, uint64_t count)
+{
+    printf("%-4s %8lu of %d metrics in %8.2fms  %10.0f packets/s\n", name, count, METRICS, elapsed_ns / 1000000.0,
+           count * 1000000000.0 / elapsed_ns);
+}
+
+redilon_Packet *createMetric(uint64_t value)
+{
+    redilon_Packet *packet = redilon_createPacket(METRIC);
+    redilon_addUInt64(packet->buffer, value);
+    return packet;
+}
+
+void benchTcp()
+{
+    int server_fd = redilon_createTcpServer(TCP_PORT, 1);
+    if (server_fd == -1)
+    {
+        printf("tcp: could not create the server\n");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int epoll_fd;
+        redilon_AsyncServerConf conf;
+        memset(&conf, 0, sizeof(conf));
+        conf.server_fd = server_fd;
+        conf.epoll_fd = &epoll_fd;
+        conf.max_clients = 1;
+        conf.requestHandler = handle;
+        conf.onConnectionClosed = onConnectionClosed;
+        redilon_acceptConnectionsAsync(&conf);
+        exit(0);
+    }
+    close(server_fd);
+
+    int fd = redilon_connectToTcpServer(NULL, TCP_PORT);
+    uint64_t count = 0;
+    uint64_t start = nowNs();
+    for (int i = 0; i < METRICS; i++)
+        redilon_sendToServer(fd, createMetric(i), NULL, NULL);
+    redilon_sendToServer(fd, redilon_createPacket(REPORT), onReport, &count);
+    printResults("tcp", nowNs() - start, count);
+
+    redilon_closeServerConn(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+void benchUdp()
+{
+    redilon_UdpSocket *server = redilon_createUdpServer(UDP_PORT, 0);
+    if (server == NULL)
+    {
+        printf("udp: could not create the server\n");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        while (redilon_readDatagrams(server, handle, NULL) != -1)
+            ;
+        exit(0);
+    }
+
+    redilon_UdpSocket *client = redilon_connectToUdpServer("localhost", UDP_PORT, 0);
+    // the report may be lost too
+    struct timeval timeout = {.tv_sec = 2};
+    setsockopt(redilon_getUdpSocketFd(client), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint64_t count = 0;
+    uint64_t start = nowNs();
+    for (int i = 0; i < METRICS; i++)
+    {
+        redilon_Packet *packet = createMetric(i);
+        redilon_sendDatagram(client, packet, NULL, 0);
+        redilon_freePacket(packet);
+        if (i % BURST == BURST - 1)
+        {
+            redilon_flushDatagrams(client);
+            sched_yield();
+        }
+    }
+    redilon_Packet *report = redilon_createPacket(REPORT);
+    redilon_sendDatagram(client, report, NULL, 0);
+    redilon_freePacket(report);
+    redilon_flushDatagrams(client);
+    redilon_readDatagrams(client, onReport, &count);
+    printResults("udp", nowNs() - start, count);
+
+    redilon_closeUdpSocket(client);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    redilon_closeUdpSocket(server);
+}
+
+int main()
+{
+    signal(SIGPIPE, SIG_IGN);
+    benchTcp();
+    benchUdp();
+    return 0;
+}
@@ -51,7 +51,7 @@ struct HandleMessageArgs
     int *msg_history_size;
 };
 
-void handleIncomingMessage(uint8_t client_fd, uint8_t operation, redilon_Buffer *buffer, void *args)
+void handleIncomingMessage(int client_fd, uint8_t operation, redilon_Buffer *buffer, void *args)
 {
     struct HandleMessageArgs *my_args = args;
 
@@ -80,7 +80,7 @@ void getIncomingMessages(struct HandleMessageArgs *args)
     redilon_closeServerConn(my_args->server_fd);
 }
 
-void handleJoin(uint8_t client_fd, uint8_t operation, redilon_Buffer *buffer, void *args)
+void handleJoin(int client_fd, uint8_t operation, redilon_Buffer *buffer, void *args)
 {
     if (operation == JOIN_SUCCESS)
         *((int *)args) = 0;
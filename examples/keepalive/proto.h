@@ -54,4 +54,11 @@ void decode_message(redilon_Buffer *buffer, struct Message *message)
     message->msg = redilon_getString(buffer);
 }
 
+// the decoded strings are ours, the library doesn't keep track of them
+void free_message(struct Message *message)
+{
+    free(message->name);
+    free(message->msg);
+}
+
 #endif
\ No newline at end of file
@@ -12,6 +12,7 @@
 #define PORT "8000"
 #define MAX_CLIENTS 100
 #define ADMIN_NAME "ADMIN"
+#define CHAT_TOPIC "chat"
 
 typedef struct Client
 {
@@ -23,6 +24,7 @@ typedef struct Client
 struct ConnectionArgs
 {
     int epoll_fd;
+    redilon_AsyncServerConf *conf;
     int clients_size;
     struct Client **clients;
 };
@@ -93,24 +95,18 @@ int addClient(int fd, char *ip, char *name, Client **clients, int *size)
     return 0;
 }
 
-void broadcastMessage(Message *message, Client **clients, int size)
+/**
+ * sends the message to everyone in the chat but `sender_fd`, the library only serializes it once.
+ */
+void broadcastMessage(redilon_AsyncServerConf *conf, Message *message, int sender_fd)
 {
     redilon_Packet *packet_message = encode_message(message->name, message->msg);
     if (packet_message == NULL)
         return;
-
-    // send to all clients
-    for (int i = 0; i < size; i++)
-    {
-        // but not to the sender
-        if (!strcmp(clients[i]->name, message->name))
-            continue;
-        redilon_sendToClient(clients[i]->fd, packet_message, 0);
-    }
-    free(packet_message);
+    redilon_publish(conf, CHAT_TOPIC, packet_message, sender_fd, 1);
 };
 
-void handleRequest(uint8_t client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+void handleRequest(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
 {
     char ip[INET6_ADDRSTRLEN];
     getClientIp(client_fd, ip);
@@ -122,10 +118,12 @@ void handleRequest(uint8_t client_fd, uint8_t op_code, redilon_Buffer *buffer, v
     case PUBLISH_MESSAGE:
         Message pubMsg;
         decode_message(buffer, &pubMsg);
-        if (!strcmp(pubMsg.msg, ""))
-            break;
-        broadcastMessage(&pubMsg, my_args->clients, my_args->clients_size);
-        printf("new message sent\n");
+        if (pubMsg.msg != NULL && strcmp(pubMsg.msg, ""))
+        {
+            broadcastMessage(my_args->conf, &pubMsg, client_fd);
+            printf("new message sent\n");
+        }
+        free_message(&pubMsg);
         break;
     case JOIN:
         struct Join join;
@@ -138,14 +136,17 @@ void handleRequest(uint8_t client_fd, uint8_t op_code, redilon_Buffer *buffer, v
         redilon_sendToClient(client_fd, packet_join, 1);
 
         if (added == -1)
+            free(join.name);
+        if (added == -1 || redilon_subscribe(my_args->conf, client_fd, CHAT_TOPIC) == -1)
             break;
 
         // the client was added, tell the chat
         Message message;
         message.name = ADMIN_NAME;
         message.msg = concatenateStrings(join.name, " has just popped in");
-        // the -1 is to not send it to the user that hast just joined
-        broadcastMessage(&message, my_args->clients, my_args->clients_size - 1);
+        // not to the user that has just joined
+        broadcastMessage(my_args->conf, &message, client_fd);
+        free(message.msg);
         printf("new peer joined\n");
 
         break;
@@ -176,8 +177,11 @@ void onConnectionClosed(int client_fd, void *args)
     struct Message message;
     message.name = ADMIN_NAME;
     message.msg = concatenateStrings(client->name, " has left the chat");
-    broadcastMessage(&message, my_args->clients, my_args->clients_size);
+    // the connection is closing, it does not get it
+    broadcastMessage(my_args->conf, &message, -1);
+    free(message.msg);
 
+    free(client->name);
     free(client);
 }
 
@@ -215,6 +219,9 @@ int main()
     args.clients = clients;
 
     redilon_AsyncServerConf conf;
+    args.conf = &conf;
+    // fields that are not set default to zero
+    memset(&conf, 0, sizeof(conf));
     conf.server_fd = server_fd;
     conf.epoll_fd = &epoll_fd;
     conf.max_clients = MAX_CLIENTS;
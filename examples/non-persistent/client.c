@@ -10,7 +10,7 @@
 #define HOST NULL
 #define PORT "8000"
 
-void handleResourceResponse(uint8_t client_fd, uint8_t status, redilon_Buffer *buffer, void *args)
+void handleResourceResponse(int client_fd, uint8_t status, redilon_Buffer *buffer, void *args)
 {
     if (status == SUCCESS)
     {
@@ -45,5 +45,9 @@ int main()
         return 1;
     }
     printf("module: %s\ndesc: %s \nload: [%d]\n", resources->module, resources->description, resources->load);
+    // the strings from `redilon_getString` are ours to free
+    free(resources->module);
+    free(resources->description);
+    free(resources);
     return 0;
 }
\ No newline at end of file
@@ -27,7 +27,7 @@ struct ConnectionArgs
     int epoll_fd;
 };
 
-void handleRequest(uint8_t client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
+void handleRequest(int client_fd, uint8_t op_code, redilon_Buffer *buffer, void *args)
 {
     char ip[INET6_ADDRSTRLEN];
     getClientIp(client_fd, ip);
@@ -89,6 +89,8 @@ int main()
     args.epoll_fd = epoll_fd;
 
     redilon_AsyncServerConf conf;
+    // fields that are not set default to zero
+    memset(&conf, 0, sizeof(conf));
     conf.server_fd = server_fd;
     conf.epoll_fd = &epoll_fd;
     conf.max_clients = MAX_CLIENTS;
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "errno.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/socket.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// how long the wait has to stay over the shed target when `shed_interval_ms` is not set
+#define DEFAULT_SHED_INTERVAL_MS 100
+
+// private fns
+static uint32_t squareRoot(uint32_t value)
+{
+    uint32_t root = 0;
+    uint32_t bit = 1u << 30;
+    while (bit > value)
+        bit >>= 2;
+    while (bit != 0)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+    return root;
+}
+
+/**
+ * CoDel control law, the frames are shed closer together the longer the queue stays over the target.
+ */
+static int64_t nextShedAt(int64_t from_us, int64_t interval_us, uint32_t count)
+{
+    return from_us + interval_us / squareRoot(count);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Writes a busy frame to `frame`, which must have room for `BUSY_FRAME_SIZE` bytes.
+ *
+ * @param op_code of the request that was turned away, `-1` for a whole connection.
+ * @returns the size of the frame.
+ */
+size_t writeBusyFrame(uint8_t *frame, int op_code)
+{
+    uint32_t body_size = op_code == -1 ? 0 : sizeof(uint8_t);
+    frame[0] = REDILON_BUSY_OP_CODE;
+    memcpy(frame + sizeof(uint8_t), &body_size, sizeof(uint32_t));
+    if (body_size > 0)
+        frame[FRAME_HEADER_SIZE] = op_code;
+    return FRAME_HEADER_SIZE + body_size;
+}
+
+/**
+ * Turns away a connection that was just accepted and closes it. Either it gets a busy frame, if the socket takes it
+ * right away, or it is reset.
+ */
+void rejectConnection(int fd, int reset)
+{
+    if (reset)
+    {
+        // closing with a zero linger time sends a RST instead of a FIN
+        struct linger linger = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+    else
+    {
+        uint8_t frame[BUSY_FRAME_SIZE];
+        size_t size = writeBusyFrame(frame, -1);
+        // a new socket always has room for it, if it doesn't we won't wait
+        send(fd, frame, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(fd);
+}
+
+/**
+ * CoDel (RFC 8289) on a worker queue, called as the worker takes each frame.
+ *
+ * @param waited_us time the frame spent in the queue.
+ * @returns `1` if the frame has to be shed.
+ */
+int shouldShed(ShedState *state, int64_t waited_us, int64_t now_us, redilon_AsyncServerConf *conf)
+{
+    int64_t interval_us = (int64_t)(conf->shed_interval_ms > 0 ? conf->shed_interval_ms : DEFAULT_SHED_INTERVAL_MS) * 1000;
+    if (waited_us < conf->shed_target_us)
+    {
+        state->above_since = 0;
+        state->shedding = 0;
+        return 0;
+    }
+    if (state->above_since == 0)
+    {
+        state->above_since = now_us;
+        return 0;
+    }
+    if (!state->shedding)
+    {
+        // a single burst drains on its own, only a queue that stays over the target for a whole interval is shed
+        if (now_us - state->above_since < interval_us)
+            return 0;
+        state->shedding = 1;
+        // it stopped shedding a moment ago, the load is still there so pick up close to the rate it had
+        if (state->shed_count > 2 && now_us - state->next_shed_at < 8 * interval_us)
+            state->shed_count -= 2;
+        else
+            state->shed_count = 1;
+        state->next_shed_at = nextShedAt(now_us, interval_us, state->shed_count);
+        return 1;
+    }
+    if (now_us < state->next_shed_at)
+        return 0;
+    state->shed_count++;
+    state->next_shed_at = nextShedAt(state->next_shed_at, interval_us, state->shed_count);
+    return 1;
+}
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "errno.h"
+#include "sched.h"
+#include "pthread.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// private fns
+static int fillCpuSet(cpu_set_t *set, int *cpus, int cpus_size)
+{
+    CPU_ZERO(set);
+    for (int i = 0; i < cpus_size; i++)
+    {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        CPU_SET(cpus[i], set);
+    }
+    return 0;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Pins the calling thread to `cpus`. Call it before allocating the thread buffers, so their pages
+ * are first touched, and placed, in the local numa node.
+ *
+ * @returns `-1` on error, `0` if `cpus_size` is `0` and there is nothing to do.
+ */
+int pinCurrentThread(int *cpus, int cpus_size)
+{
+    if (cpus_size <= 0)
+        return 0;
+    cpu_set_t set;
+    if (fillCpuSet(&set, cpus, cpus_size) == -1)
+        return -1;
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (res != 0)
+    {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the threads created with `attr` start already pinned to `cpus`, so nothing they allocate lands on another node.
+ *
+ * @returns `-1` on error, `0` if `cpus_size` is `0` and there is nothing to do.
+ */
+int setAttrCpus(pthread_attr_t *attr, int *cpus, int cpus_size)
+{
+    if (cpus_size <= 0)
+        return 0;
+    cpu_set_t set;
+    if (fillCpuSet(&set, cpus, cpus_size) == -1)
+        return -1;
+    int res = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (res != 0)
+    {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Touches every page of `memory` so the kernel backs it now, in the numa node of the calling thread.
+ */
+void touchPages(void *memory, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += 4096)
+        ((volatile char *)memory)[offset] = 0;
+}
@@ -0,0 +1,1413 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdio.h"
+#include "errno.h"
+#include "string.h"
+#include "sys/socket.h"
+#include "sys/epoll.h"
+#include "sys/uio.h"
+#include "sys/sendfile.h"
+#include "sys/eventfd.h"
+#include "signal.h"
+#include "time.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "unistd.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// max connections accepted per event loop iteration when `accept_budget` is not set
+#define DEFAULT_ACCEPT_BUDGET 64
+// max chunks handed to a single sendmsg(2) call, IOV_MAX on linux
+#define FLUSH_MAX_IOV 1024
+// size of the buffer shared by all the connections of a loop to read into
+#define READ_BUFFER_SIZE (64 * 1024)
+// bytes and frames read from a connection per loop iteration when `read_budget` and `frame_budget` are not set
+#define DEFAULT_READ_BUDGET (256 * 1024)
+#define DEFAULT_FRAME_BUDGET 256
+
+// loop running in the current thread, lets the send and close functions find the connection state
+static __thread AsyncLoop *currentLoop = NULL;
+
+// private fns
+static int64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t nowMs()
+{
+    return nowUs() / 1000;
+}
+
+static void freeOutChunk(OutChunk *chunk)
+{
+    if (chunk->file_fd != -1)
+        close(chunk->file_fd);
+    if (chunk->shared != NULL)
+        releaseSharedFrame(chunk->shared);
+    else
+        memFree(chunk->data);
+    memFree(chunk);
+}
+
+static void freeOutbound(Connection *conn)
+{
+    OutChunk *chunk = conn->out_head;
+    while (chunk != NULL)
+    {
+        OutChunk *next = chunk->next;
+        freeOutChunk(chunk);
+        chunk = next;
+    }
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_size = 0;
+    conn->out_memory = 0;
+}
+
+static void freeConnection(AsyncLoop *loop, Connection *conn)
+{
+    freeOutbound(conn);
+    unsubscribeAll(loop, conn);
+    memFree(conn->body);
+    memFree(conn->unread);
+    loop->connections[conn->fd] = NULL;
+    loop->connections_count--;
+    memFree(conn);
+}
+
+/**
+ * Creates the state of a newly accepted client.
+ *
+ * @returns the connection or `NULL` on error.
+ */
+static Connection *addConnection(AsyncLoop *loop, int fd)
+{
+    if (fd >= loop->connections_size)
+    {
+        int size = loop->connections_size * 2 > fd ? loop->connections_size * 2 : fd + 1;
+        Connection **temp = memRealloc(loop->connections, size * sizeof(Connection *));
+        if (temp == NULL)
+            return NULL;
+        memset(temp + loop->connections_size, 0, (size - loop->connections_size) * sizeof(Connection *));
+        loop->connections = temp;
+        loop->connections_size = size;
+    }
+    // the fd was closed behind our back and the kernel reused it
+    if (loop->connections[fd] != NULL)
+        freeConnection(loop, loop->connections[fd]);
+
+    Connection *conn = memCalloc(1, sizeof(Connection));
+    if (conn == NULL)
+        return NULL;
+    conn->fd = fd;
+    conn->id = newConnectionId();
+    loop->connections[fd] = conn;
+    loop->connections_count++;
+    return conn;
+}
+
+static void freeLoop(AsyncLoop *loop)
+{
+    for (int fd = 0; fd < loop->connections_size; fd++)
+    {
+        if (loop->connections[fd] == NULL)
+            continue;
+        close(fd);
+        freeConnection(loop, loop->connections[fd]);
+    }
+    freeTopics(loop);
+    freeCache(loop);
+    memFree(loop->connections);
+    memFree(loop->pending_flushes);
+    memFree(loop->ready);
+    memFree(loop->read_buffer);
+}
+
+/**
+ * Registers or unregisters `EPOLLOUT`, we only care about it while there is data that the socket did not take.
+ */
+static int waitWritable(AsyncLoop *loop, Connection *conn, int writable)
+{
+    if (conn->waiting_writable == writable)
+        return 0;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET | (writable ? EPOLLOUT : 0);
+    event.data.fd = conn->fd;
+    conn->waiting_writable = writable;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * Drops the `sent` bytes from the front of the outbound queue.
+ */
+static void consumeOutbound(Connection *conn, size_t sent)
+{
+    conn->out_size -= sent;
+    while (sent > 0)
+    {
+        OutChunk *chunk = conn->out_head;
+        size_t left = chunk->size - chunk->sent;
+        if (sent < left)
+        {
+            chunk->sent += sent;
+            break;
+        }
+        sent -= left;
+        conn->out_head = chunk->next;
+        if (chunk->file_fd == -1)
+            conn->out_memory -= chunk->size;
+        TRACE_END("send queue", chunk->queued_at, conn->fd, -1);
+        freeOutChunk(chunk);
+    }
+    if (conn->out_head == NULL)
+        conn->out_tail = NULL;
+}
+
+/**
+ * Writes as much of the outbound queue as the socket takes.
+ *
+ * All the queued chunks go out in a single `sendmsg`, so frames queued during the same iteration share segments.
+ * When the queue does not fit in one call the previous ones are flagged with `MSG_MORE` so the kernel holds partial segments.
+ * File chunks are moved by the kernel with `sendfile`, they never get to user space.
+ *
+ * @returns `-1` if the connection failed.
+ */
+static int flushConnection(AsyncLoop *loop, Connection *conn)
+{
+    struct iovec iov[FLUSH_MAX_IOV];
+    uint64_t trace_start = TRACE_START();
+    while (conn->out_head != NULL)
+    {
+        OutChunk *chunk = conn->out_head;
+        ssize_t sent;
+        if (chunk->file_fd != -1)
+        {
+            off_t offset = chunk->file_offset + chunk->sent;
+            sent = sendfile(conn->fd, chunk->file_fd, &offset, chunk->size - chunk->sent);
+            // the file is shorter than the size announced in the header, the stream can't be recovered
+            if (sent == 0)
+            {
+                TRACE_END("flush", trace_start, conn->fd, -1);
+                return -1;
+            }
+        }
+        else
+        {
+            int iov_size = 0;
+            for (; chunk != NULL && chunk->file_fd == -1 && iov_size < FLUSH_MAX_IOV; chunk = chunk->next)
+            {
+                iov[iov_size].iov_base = chunk->data + chunk->sent;
+                iov[iov_size].iov_len = chunk->size - chunk->sent;
+                iov_size++;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_size;
+            sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (chunk != NULL ? MSG_MORE : 0));
+        }
+
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            TRACE_END("flush", trace_start, conn->fd, -1);
+            // the socket buffer is full, we'll be back when it has room
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return waitWritable(loop, conn, 1);
+            return -1;
+        }
+        consumeOutbound(conn, sent);
+    }
+    TRACE_END("flush", trace_start, conn->fd, -1);
+    return waitWritable(loop, conn, 0);
+}
+
+static void resumeIfDrained(AsyncLoop *loop, Connection *conn);
+
+/**
+ * Flushes the connection and, if the user already closed it, closes it once there is nothing left to write.
+ */
+static void flushAndClose(AsyncLoop *loop, Connection *conn)
+{
+    // there is no point in keeping what's left, shut the socket down so the read side reports the closed connection
+    if (flushConnection(loop, conn) == -1)
+    {
+        freeOutbound(conn);
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    resumeIfDrained(loop, conn);
+    if (conn->closing && conn->out_head == NULL)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        freeConnection(loop, conn);
+    }
+}
+
+static void flushPending(AsyncLoop *loop)
+{
+    for (int i = 0; i < loop->pending_flushes_size; i++)
+    {
+        int fd = loop->pending_flushes[i];
+        Connection *conn = fd < loop->connections_size ? loop->connections[fd] : NULL;
+        if (conn == NULL || !conn->pending_flush)
+            continue;
+        conn->pending_flush = 0;
+        flushAndClose(loop, conn);
+    }
+    loop->pending_flushes_size = 0;
+}
+
+static uint32_t getChunkSize(redilon_AsyncServerConf *conf)
+{
+    return conf->chunk_size > 0 ? conf->chunk_size : DEFAULT_CHUNK_SIZE;
+}
+
+/**
+ * @returns the bytes held by the connection, what `max_connection_memory` limits.
+ */
+static size_t getConnectionMemory(AsyncLoop *loop, Connection *conn)
+{
+    size_t body = conn->body == NULL ? 0 : conn->streaming ? getChunkSize(loop->conf) : conn->body_size;
+    return conn->out_memory + body;
+}
+
+/**
+ * @returns `0` if a frame with a body of `body_size` bytes has to be refused to keep the connection under
+ * `max_connection_memory`.
+ */
+static int fitsConnection(AsyncLoop *loop, Connection *conn, uint32_t body_size)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    if (conf->max_connection_memory == 0)
+        return 1;
+    // the connection gets paused before it reads more, but that can't make room for a frame that doesn't fit by itself
+    if (conf->memory_policy == REDILON_MEMORY_PAUSE)
+        return body_size <= conf->max_connection_memory;
+    return getConnectionMemory(loop, conn) + body_size <= conf->max_connection_memory;
+}
+
+/**
+ * @returns `1` if the connection is over `max_connection_memory` and has to stop being read.
+ */
+static int shouldPause(AsyncLoop *loop, Connection *conn)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    return conf->max_connection_memory > 0 && conf->memory_policy == REDILON_MEMORY_PAUSE &&
+           getConnectionMemory(loop, conn) > conf->max_connection_memory;
+}
+
+/**
+ * @returns `1` if the frame has to be handled by a worker.
+ */
+static int shouldOffload(AsyncLoop *loop, Connection *conn, uint8_t op_code)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    if (loop->workers_size == 0)
+        return 0;
+    // while a worker is busy with the connection, the frames that follow wait for it so the replies keep their order
+    if (conn->in_flight > 0 || conf->shouldOffload == NULL)
+        return 1;
+    return conf->shouldOffload(op_code, conf->handlersArgs);
+}
+
+static int dispatchFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *stream, uint32_t size, int owned);
+
+/**
+ * Answers a frame that was turned away with a busy frame, after the replies the workers still owe the connection.
+ *
+ * @returns `-1` if there is no memory.
+ */
+static int rejectFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code)
+{
+    if (conn->in_flight > 0)
+        return offloadRejected(loop, conn, op_code);
+    uint8_t *frame = memAlloc(BUSY_FRAME_SIZE);
+    if (frame == NULL)
+        return -1;
+    size_t size = writeBusyFrame(frame, op_code);
+    if (queueToConnection(conn, frame, size) == -1)
+    {
+        memFree(frame);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Turns away a frame that doesn't fit in `max_connection_memory` or the memory budget, as `memory_policy` says.
+ *
+ * @returns `-1` if there is no memory for the busy frame.
+ */
+static int refuseFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code)
+{
+    if (loop->conf->memory_policy != REDILON_MEMORY_CLOSE)
+        return rejectFrame(loop, conn, op_code);
+    closeLoopConnection(conn);
+    return 0;
+}
+
+/**
+ * Refuses the frame being started, the rest of its body is skipped as it arrives instead of being buffered.
+ *
+ * @param size bytes of the body that already arrived.
+ * @returns the amount of them used or `-1` if there is no memory for the busy frame.
+ */
+static ssize_t skipFrame(AsyncLoop *loop, Connection *conn, uint32_t body_size, size_t size)
+{
+    if (refuseFrame(loop, conn, conn->op_code) == -1)
+        return -1;
+    if (size >= body_size)
+        return body_size;
+    conn->discarding = body_size - size;
+    return size;
+}
+
+/**
+ * Dispatches each packet of a batch as if it had come in a frame of its own, they point into `stream`.
+ *
+ * @returns `-1` if the batch is malformed or there is no memory to offload one of its packets.
+ */
+static int dispatchBatchFrame(AsyncLoop *loop, Connection *conn, void *stream, uint32_t size, int owned)
+{
+    uint32_t offset = 0;
+    uint8_t op_code;
+    redilon_Buffer buffer;
+    int res;
+    while (!conn->closing && (res = nextBatchPacket(stream, size, &offset, &op_code, &buffer)) == 1)
+        if (dispatchFrame(loop, conn, op_code, buffer.stream, buffer.size, 0) == -1)
+        {
+            res = -1;
+            break;
+        }
+    if (owned)
+        memFree(stream);
+    // the stream can't be trusted anymore
+    if (res == -1 && errno == EPROTO)
+        closeLoopConnection(conn);
+    return res == -1 ? -1 : 0;
+}
+
+/**
+ * Calls the handler of a frame, or hands it to a worker.
+ *
+ * @param owned `stream` was allocated for this frame, it gets freed (or handed to the worker) here.
+ * @returns `-1` if there is no memory to offload it or it is a malformed batch.
+ */
+static int dispatchFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *stream, uint32_t size, int owned)
+{
+    if (op_code == REDILON_BATCH_OP_CODE)
+        return dispatchBatchFrame(loop, conn, stream, size, owned);
+    conn->frames_read++;
+    uint32_t cache_ttl_ms = getCacheTtl(loop, op_code);
+    // with a worker busy with the connection, the cached reply would overtake its replies
+    if (cache_ttl_ms > 0 && conn->in_flight == 0 && serveFromCache(loop, conn, op_code, stream, size))
+    {
+        if (owned)
+            memFree(stream);
+        return 0;
+    }
+    if (shouldOffload(loop, conn, op_code))
+    {
+        // turned away before copying the body, the handler never sees it
+        if (loop->conf->max_in_flight > 0 && atomic_load(&loop->in_flight) >= loop->conf->max_in_flight)
+        {
+            if (owned)
+                memFree(stream);
+            return rejectFrame(loop, conn, op_code);
+        }
+        // the read buffer gets reused by the next read, the worker needs its own copy
+        void *body = stream;
+        if (!owned && size > 0)
+        {
+            body = budgetAlloc(size);
+            if (body == NULL)
+                return refuseFrame(loop, conn, op_code);
+            memcpy(body, stream, size);
+        }
+        else if (!owned)
+            body = NULL;
+        if (offloadFrame(loop, conn, op_code, body, size, cache_ttl_ms) == -1)
+        {
+            memFree(body);
+            return -1;
+        }
+        return 0;
+    }
+
+    redilon_Buffer buffer;
+    buffer.size = size;
+    buffer.offset = 0;
+    buffer.capacity = size;
+    buffer.index = NULL;
+    buffer.allocated = NULL;
+    buffer.stream = stream;
+    // only what the handler sends to this connection is the reply, not what gets published to it meanwhile
+    ReplyCapture capture;
+    memset(&capture, 0, sizeof(capture));
+    conn->capture = cache_ttl_ms > 0 ? &capture : NULL;
+    uint64_t trace_start = TRACE_START();
+    loop->conf->requestHandler(conn->fd, op_code, &buffer, loop->conf->handlersArgs);
+    TRACE_END("handler", trace_start, conn->fd, op_code);
+    conn->capture = NULL;
+    if (cache_ttl_ms > 0)
+        cacheCapturedReply(loop, conn, &capture, op_code, stream, size, cache_ttl_ms);
+    if (owned)
+        memFree(stream);
+    return 0;
+}
+
+/**
+ * Dispatches a frame whose body arrived whole, checking its trailer first if it has one.
+ *
+ * @param size of the body, including the trailer.
+ * @returns `-1` if there is no memory to offload it or it is a malformed batch.
+ */
+static int dispatchChecked(AsyncLoop *loop, Connection *conn, void *body, uint32_t size, int owned)
+{
+    if (conn->checksum)
+    {
+        size -= FRAME_TRAILER_SIZE;
+        // the stream can't be trusted anymore
+        if (checkFrame(conn->op_code, body, size) == -1)
+        {
+            if (owned)
+                memFree(body);
+            closeLoopConnection(conn);
+            return 0;
+        }
+    }
+    captureFrame(conn->id, conn->op_code, body, size);
+    return dispatchFrame(loop, conn, conn->op_code, body, size, owned);
+}
+
+/**
+ * Dispatches the frame whose body was completed in `conn->body`.
+ *
+ * @returns `-1` if there is no memory to offload it.
+ */
+static int finishBody(AsyncLoop *loop, Connection *conn)
+{
+    void *body = conn->body;
+    conn->body = NULL;
+    return dispatchChecked(loop, conn, body, conn->body_size, 1);
+}
+
+static void deliverChunk(AsyncLoop *loop, Connection *conn, void *chunk, uint32_t size)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    conf->onChunk(conn->fd, conn->op_code, chunk, size, conn->stream_offset, conn->body_size, conf->handlersArgs);
+    conn->stream_offset += size;
+    if (conn->stream_offset < conn->body_size)
+        return;
+    conn->streaming = 0;
+    memFree(conn->body);
+    conn->body = NULL;
+}
+
+/**
+ * Starts a frame whose header was just read, `data` holds the bytes that came after it.
+ *
+ * @returns the amount of bytes of `data` used or `-1` if there is no memory for the body or to offload it.
+ */
+static ssize_t startFrame(AsyncLoop *loop, Connection *conn, uint8_t *header, void *data, size_t size)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    uint32_t body_size;
+    memcpy(&conn->op_code, header, sizeof(uint8_t));
+    memcpy(&body_size, header + sizeof(uint8_t), sizeof(uint32_t));
+    conn->checksum = (body_size & FRAME_CHECKSUM_FLAG) != 0;
+    body_size &= ~FRAME_CHECKSUM_FLAG;
+
+    // batches are never streamed, their packets are handled one by one. Nor the checksummed frames, nobody can see
+    // them before the trailer is checked
+    if (conf->onChunk != NULL && body_size > conf->stream_threshold && conn->op_code != REDILON_BATCH_OP_CODE &&
+        !conn->checksum)
+    {
+        // we only hold one chunk at a time
+        conn->body = budgetAlloc(getChunkSize(conf));
+        if (conn->body == NULL)
+            return skipFrame(loop, conn, body_size, size);
+        conn->streaming = 1;
+        conn->body_size = body_size;
+        conn->body_received = 0;
+        conn->stream_offset = 0;
+        return 0;
+    }
+    if (conn->checksum)
+        body_size += FRAME_TRAILER_SIZE;
+    if (!fitsConnection(loop, conn, body_size))
+        return skipFrame(loop, conn, body_size, size);
+    // the frame arrived whole, no need to copy it anywhere
+    if (size >= body_size)
+    {
+        if (dispatchChecked(loop, conn, data, body_size, 0) == -1)
+            return -1;
+        return body_size;
+    }
+    conn->body = budgetAlloc(body_size);
+    if (conn->body == NULL)
+        return skipFrame(loop, conn, body_size, size);
+    conn->body_size = body_size;
+    conn->body_received = size;
+    memcpy(conn->body, data, size);
+    return size;
+}
+
+/**
+ * Pauses a connection in the middle of a read, keeping the `size` bytes of `data` that were not consumed yet.
+ *
+ * @returns `-1` if there is no memory to keep them, the connection goes on.
+ */
+static int pauseInput(Connection *conn, void *data, size_t size)
+{
+    void *unread = memAlloc(size);
+    if (unread == NULL)
+        return -1;
+    memcpy(unread, data, size);
+    conn->unread = unread;
+    conn->unread_size = size;
+    conn->paused = 1;
+    return 0;
+}
+
+/**
+ * @returns the amount of bytes of `data` used.
+ */
+static size_t consumeStream(AsyncLoop *loop, Connection *conn, void *data, size_t size)
+{
+    uint32_t left = conn->body_size - conn->stream_offset;
+    uint32_t chunk_size = getChunkSize(loop->conf) < left ? getChunkSize(loop->conf) : left;
+    // a whole chunk is already here, pass it without copying
+    if (conn->body_received == 0 && size >= chunk_size)
+    {
+        deliverChunk(loop, conn, data, chunk_size);
+        return chunk_size;
+    }
+    size_t used = chunk_size - conn->body_received < size ? chunk_size - conn->body_received : size;
+    memcpy(conn->body + conn->body_received, data, used);
+    conn->body_received += used;
+    if (conn->body_received == chunk_size)
+    {
+        conn->body_received = 0;
+        deliverChunk(loop, conn, conn->body, chunk_size);
+    }
+    return used;
+}
+
+/**
+ * Feeds the bytes read from a connection to the frame parser, calling the handlers for every frame they complete.
+ *
+ * @returns `-1` if there is no memory left to hold a frame.
+ */
+static int consumeInput(AsyncLoop *loop, Connection *conn, void *data, size_t size)
+{
+    while (size > 0 && !conn->closing)
+    {
+        // the replies to a single read can take the connection over its memory, it stops in between frames
+        if (shouldPause(loop, conn) && pauseInput(conn, data, size) == 0)
+            return 0;
+        ssize_t used;
+        if (conn->streaming)
+            used = consumeStream(loop, conn, data, size);
+        else if (conn->body != NULL)
+        {
+            used = conn->body_size - conn->body_received < size ? conn->body_size - conn->body_received : size;
+            memcpy(conn->body + conn->body_received, data, used);
+            conn->body_received += used;
+            if (conn->body_received == conn->body_size && finishBody(loop, conn) == -1)
+                return -1;
+        }
+        else if (conn->discarding > 0)
+        {
+            used = conn->discarding < size ? conn->discarding : size;
+            conn->discarding -= used;
+        }
+        // the header was split between reads
+        else if (conn->header_received > 0 || size < FRAME_HEADER_SIZE)
+        {
+            used = FRAME_HEADER_SIZE - conn->header_received < size ? FRAME_HEADER_SIZE - conn->header_received : size;
+            memcpy(conn->header + conn->header_received, data, used);
+            conn->header_received += used;
+            if (conn->header_received == FRAME_HEADER_SIZE)
+            {
+                conn->header_received = 0;
+                if (startFrame(loop, conn, conn->header, NULL, 0) == -1)
+                    return -1;
+            }
+        }
+        else
+        {
+            used = startFrame(loop, conn, data, data + FRAME_HEADER_SIZE, size - FRAME_HEADER_SIZE);
+            if (used == -1)
+                return -1;
+            used += FRAME_HEADER_SIZE;
+        }
+        data += used;
+        size -= used;
+    }
+    return 0;
+}
+
+/**
+ * Consumes what was left unread when the connection got paused, it may get paused again.
+ *
+ * @returns `-1` if there is no memory left to hold a frame.
+ */
+static int consumeUnread(AsyncLoop *loop, Connection *conn)
+{
+    void *unread = conn->unread;
+    size_t size = conn->unread_size;
+    conn->unread = NULL;
+    conn->unread_size = 0;
+    int res = consumeInput(loop, conn, unread, size);
+    memFree(unread);
+    return res;
+}
+
+/**
+ * Lists a connection that ran out of budget, it gets read again in the next loop iteration.
+ *
+ * @returns `-1` on error
+ */
+static int listReady(AsyncLoop *loop, Connection *conn)
+{
+    if (loop->ready_size == loop->ready_capacity)
+    {
+        int capacity = loop->ready_capacity == 0 ? 64 : loop->ready_capacity * 2;
+        int *temp = memRealloc(loop->ready, capacity * sizeof(int));
+        if (temp == NULL)
+            return -1;
+        loop->ready = temp;
+        loop->ready_capacity = capacity;
+    }
+    loop->ready[loop->ready_size++] = conn->fd;
+    conn->ready = 1;
+    return 0;
+}
+
+/**
+ * Reads what's available in the connection up to its budget, the clients are edge-triggered so if there is
+ * more left the connection is listed as ready.
+ *
+ * @returns `-1` if the connection was closed by the peer or failed.
+ */
+static int readAvailable(AsyncLoop *loop, Connection *conn)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    uint32_t read_budget = conf->read_budget > 0 ? conf->read_budget : DEFAULT_READ_BUDGET;
+    uint32_t frame_budget = conf->frame_budget > 0 ? conf->frame_budget : DEFAULT_FRAME_BUDGET;
+    uint32_t bytes_read = 0;
+    conn->frames_read = 0;
+    if (conn->paused)
+        return 0;
+    if (conn->unread != NULL && consumeUnread(loop, conn) == -1)
+        return -1;
+    while (!conn->closing && !conn->paused)
+    {
+        // it picks up from here once its outbound queue drains
+        if (shouldPause(loop, conn))
+        {
+            conn->paused = 1;
+            return 0;
+        }
+        if (bytes_read >= read_budget || conn->frames_read >= frame_budget)
+        {
+            // without a slot in the ready list, it keeps reading rather than losing the edge
+            if (listReady(loop, conn) == 0)
+                return 0;
+            read_budget = UINT32_MAX;
+            frame_budget = UINT32_MAX;
+        }
+        void *dst = loop->read_buffer;
+        size_t size = read_budget - bytes_read < READ_BUFFER_SIZE ? read_budget - bytes_read : READ_BUFFER_SIZE;
+        // the rest of a big body goes straight to its place
+        int direct = conn->body != NULL && !conn->streaming && conn->body_size - conn->body_received >= READ_BUFFER_SIZE;
+        if (direct)
+        {
+            dst = conn->body + conn->body_received;
+            // still within the budget, but at least a read buffer's worth so the tail of the turn isn't a trickle
+            size_t left = read_budget - bytes_read > READ_BUFFER_SIZE ? read_budget - bytes_read : READ_BUFFER_SIZE;
+            size = conn->body_size - conn->body_received;
+            if (size > left)
+                size = left;
+        }
+
+        ssize_t res = recv(conn->fd, dst, size, 0);
+        if (res == 0)
+            return -1;
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        bytes_read += res;
+
+        if (!direct)
+        {
+            if (consumeInput(loop, conn, dst, res) == -1)
+                return -1;
+            continue;
+        }
+        conn->body_received += res;
+        if (conn->body_received == conn->body_size && finishBody(loop, conn) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int readConnection(AsyncLoop *loop, Connection *conn)
+{
+    uint64_t trace_start = TRACE_START();
+    int res = readAvailable(loop, conn);
+    TRACE_END("read", trace_start, conn->fd, -1);
+    return res;
+}
+
+/**
+ * Reads a connection paused over `max_connection_memory` again, once its outbound queue is down to half of it.
+ */
+static void resumeIfDrained(AsyncLoop *loop, Connection *conn)
+{
+    size_t limit = loop->conf->max_connection_memory;
+    if (!conn->paused || conn->closing || (conn->out_memory > 0 && getConnectionMemory(loop, conn) > limit / 2))
+        return;
+    conn->paused = 0;
+    // it is edge-triggered, epoll won't report what was left unread. Without a slot it waits for the next data
+    if (!conn->ready)
+        listReady(loop, conn);
+}
+
+/**
+ * Lists the connection to be flushed at the end of the loop iteration.
+ *
+ * @returns `-1` on error
+ */
+static int scheduleFlush(AsyncLoop *loop, Connection *conn)
+{
+    // a connection waiting for EPOLLOUT gets flushed when the socket becomes writable
+    if (conn->pending_flush || conn->waiting_writable)
+        return 0;
+    if (loop->pending_flushes_size == loop->pending_flushes_capacity)
+    {
+        int capacity = loop->pending_flushes_capacity == 0 ? 64 : loop->pending_flushes_capacity * 2;
+        int *temp = memRealloc(loop->pending_flushes, capacity * sizeof(int));
+        if (temp == NULL)
+            return -1;
+        loop->pending_flushes = temp;
+        loop->pending_flushes_capacity = capacity;
+    }
+    loop->pending_flushes[loop->pending_flushes_size++] = conn->fd;
+    conn->pending_flush = 1;
+    return 0;
+}
+
+/**
+ * Reads the connections that ran out of budget before this iteration, in the order they did. The ones that run out
+ * again go back to the end of the list.
+ */
+static void readReady(AsyncLoop *loop, int ready_size)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    for (int i = 0; i < ready_size; i++)
+    {
+        int fd = loop->ready[i];
+        Connection *conn = getLoopConnection(fd);
+        // closed, or its fd reused, since it was listed
+        if (conn == NULL || !conn->ready)
+            continue;
+        conn->ready = 0;
+        if (conn->closing || loop->draining)
+            continue;
+        if (readConnection(loop, conn) == -1 && conf->onConnectionClosed != NULL)
+            conf->onConnectionClosed(fd, conf->handlersArgs);
+    }
+    loop->ready_size -= ready_size;
+    memmove(loop->ready, loop->ready + ready_size, loop->ready_size * sizeof(int));
+}
+
+/**
+ * Accepts at most `accept_budget` pending connections, so that an accept storm can't starve the connected clients.
+ *
+ * @returns `1` if the budget ran out and there may still be connections waiting in the backlog, `0` otherwise.
+ */
+static int acceptClientsAsync(AsyncLoop *loop, int *reserve_fd)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    int budget = conf->accept_budget > 0 ? conf->accept_budget : DEFAULT_ACCEPT_BUDGET;
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+
+    for (int accepted = 0; accepted < budget; accepted++)
+    {
+        int client = acceptClient(conf->server_fd, SOCK_NONBLOCK, reserve_fd);
+        if (client == -1)
+        {
+            // the connection was shed or aborted by the peer, try the next one
+            if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO ||
+                ((errno == EMFILE || errno == ENFILE) && *reserve_fd != -1))
+                continue;
+            // either we processed all of the connections or retrying right away won't help (ENOBUFS, ENOMEM...)
+            return 0;
+        }
+        // over the limit, turned away before it costs us anything else
+        if (conf->max_connections > 0 && loop->connections_count >= conf->max_connections)
+        {
+            rejectConnection(client, conf->reject_with_reset);
+            continue;
+        }
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client;
+        if (addConnection(loop, client) == NULL)
+        {
+            close(client);
+            continue;
+        }
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client, &event) == -1)
+        {
+            freeConnection(loop, loop->connections[client]);
+            close(client);
+            continue;
+        }
+        if (conf->onNewConnection != NULL)
+            conf->onNewConnection(client, conf->handlersArgs);
+    }
+    return 1;
+}
+
+/**
+ * Stops accepting and reading, from now on the loop only writes what's left in the outbound queues.
+ */
+static void startDraining(AsyncLoop *loop)
+{
+    loop->draining = 1;
+    loop->drain_deadline = nowMs() + loop->drain_timeout_ms;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->conf->server_fd, NULL);
+}
+
+/**
+ * @returns `1` once every outbound queue is empty and the workers are done, or the drain deadline has passed.
+ */
+static int isDrained(AsyncLoop *loop)
+{
+    if (nowMs() >= loop->drain_deadline)
+        return 1;
+    for (int fd = 0; fd < loop->connections_size; fd++)
+    {
+        Connection *conn = loop->connections[fd];
+        if (conn != NULL && (conn->out_head != NULL || conn->in_flight > 0))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @returns the epoll_wait timeout for the next iteration.
+ */
+static int getWaitTimeout(AsyncLoop *loop, int accept_pending)
+{
+    if (loop->draining)
+    {
+        int64_t left = loop->drain_deadline - nowMs();
+        return left > 0 ? left : 0;
+    }
+    return accept_pending || loop->ready_size > 0 ? 0 : -1;
+}
+
+/**
+ * epoll_wait(2) that, with `busy_poll_us` set, spins on it before blocking.
+ */
+static int waitEvents(AsyncLoop *loop, struct epoll_event *events, int timeout)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    if (loop->busy_poll_us > 0 && timeout != 0)
+    {
+        int64_t deadline = nowUs() + loop->busy_poll_us;
+        do
+        {
+            int number_fds = epoll_wait(loop->epoll_fd, events, conf->max_clients, 0);
+            if (number_fds != 0)
+                return number_fds;
+            cpuRelax();
+        } while (nowUs() < deadline);
+    }
+    return epoll_wait(loop->epoll_fd, events, conf->max_clients, timeout);
+}
+
+/**
+ * Applies what the workers and other threads did on the connections, in the order they posted it.
+ */
+static void applyCompletions(AsyncLoop *loop)
+{
+    // from now on, a new completion wakes the loop up again
+    atomic_store(&loop->wake_pending, 0);
+    Completion *completion;
+    while ((completion = popCompletion(loop)) != NULL)
+    {
+        if (completion->kind == COMPLETION_PUBLISH)
+        {
+            // the subscribers share the frame
+            publishShared(loop, completion->topic, completion->data, completion->size, completion->fd);
+            completion->data = NULL;
+            freeCompletion(completion);
+            continue;
+        }
+        if (completion->kind == COMPLETION_CACHE || completion->kind == COMPLETION_INVALIDATE)
+        {
+            if (completion->kind == COMPLETION_INVALIDATE)
+                invalidateCache(loop, completion->op_code, completion->key, completion->key_size);
+            // invalidated while the worker was building it
+            else if (completion->cache_generation == loop->cache.generation)
+            {
+                insertCacheEntry(loop, completion->op_code, completion->key, completion->key_size, completion->data,
+                                 completion->size, completion->ttl_ms);
+                completion->data = NULL;
+            }
+            freeCompletion(completion);
+            continue;
+        }
+        Connection *conn = getLoopConnection(completion->fd);
+        // the connection the worker replied to is gone, maybe its fd already belongs to another client
+        if (conn != NULL && completion->conn_id != 0 && conn->id != completion->conn_id)
+            conn = NULL;
+        if (conn != NULL && completion->kind == COMPLETION_DONE)
+            conn->in_flight--;
+
+        int applied = 0;
+        if (conn != NULL && !conn->closing)
+        {
+            if (completion->kind == COMPLETION_DATA)
+                applied = queueToConnection(conn, completion->data, completion->size) == 0;
+            else if (completion->kind == COMPLETION_FILE)
+                applied = queueFileToConnection(conn, completion->data, completion->size, completion->file_fd,
+                                                completion->file_offset, completion->file_size) == 0;
+            else if (completion->kind == COMPLETION_CLOSE)
+                closeLoopConnection(conn);
+            else if (completion->kind == COMPLETION_SUBSCRIBE)
+                subscribeConnection(loop, conn, completion->topic);
+            else if (completion->kind == COMPLETION_UNSUBSCRIBE)
+                unsubscribeConnection(loop, conn, completion->topic);
+        }
+        // the queue took ownership of the data
+        if (applied)
+        {
+            completion->data = NULL;
+            completion->file_fd = -1;
+        }
+        freeCompletion(completion);
+    }
+}
+
+static void appendOutChunk(Connection *conn, OutChunk *chunk)
+{
+    if (conn->out_tail == NULL)
+        conn->out_head = chunk;
+    else
+        conn->out_tail->next = chunk;
+    conn->out_tail = chunk;
+    conn->out_size += chunk->size;
+    if (chunk->file_fd == -1)
+        conn->out_memory += chunk->size;
+}
+
+/**
+ * Creates the epoll instance of the loop with the listener and the wake up eventfd in it, its buffers and workers.
+ * Whatever it got before failing is left in `loop` and `events` for `closeLoop`.
+ *
+ * @returns `-1` if there is an error.
+ */
+static int openLoop(AsyncLoop *loop, struct epoll_event **events)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+        return -1;
+
+    *conf->epoll_fd = loop->epoll_fd;
+
+    if (setNonBlocking(conf->server_fd) == -1)
+        return -1;
+    // the kernel completes the handshake but won't wake us up until the client actually sends data
+    if (conf->defer_accept_secs > 0 &&
+        setsockopt(conf->server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &conf->defer_accept_secs, sizeof(int)) == -1)
+        return -1;
+    // among the listeners sharing the port (`reuse_port`), new connections go to the one of the cpu that got them
+    if (conf->incoming_cpu && conf->loop_cpus_size > 0 &&
+        setsockopt(conf->server_fd, SOL_SOCKET, SO_INCOMING_CPU, &conf->loop_cpus[0], sizeof(int)) == -1)
+        return -1;
+    // the listener is edge-triggered
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.data.fd = conf->server_fd;
+    event.events = EPOLLIN | EPOLLET;
+    // when several loops share the listener, wake up only one of them per connection instead of all of them
+    if (conf->exclusive_accept)
+        event.events |= EPOLLEXCLUSIVE;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conf->server_fd, &event) == -1)
+        return -1;
+
+    // lets other threads (or signal handlers) wake the loop up
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd == -1)
+        return -1;
+    event.data.fd = loop->wake_fd;
+    event.events = EPOLLIN;
+    // creates an array of size max_clients
+    *events = memCalloc(conf->max_clients, sizeof(event));
+    if (*events == NULL || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event) == -1)
+        return -1;
+
+    // with a single cpu spinning only delays the peer we are waiting for
+    loop->busy_poll_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? conf->busy_poll_us : 0;
+    loop->read_buffer = memAlloc(READ_BUFFER_SIZE);
+    if (loop->read_buffer == NULL)
+        return -1;
+    touchPages(loop->read_buffer, READ_BUFFER_SIZE);
+    initMpscQueue(&loop->completions);
+    if (conf->workers > 0 && startWorkers(loop, conf->workers) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Frees what `openLoop` got and closes the connections left, the workers must be stopped already.
+ */
+static void closeLoop(AsyncLoop *loop, struct epoll_event *events)
+{
+    freeLoop(loop);
+    memFree(events);
+    if (loop->wake_fd != -1)
+        close(loop->wake_fd);
+    if (loop->epoll_fd != -1)
+        close(loop->epoll_fd);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns the loop running in this thread or `NULL`.
+ */
+AsyncLoop *getCurrentLoop()
+{
+    return currentLoop;
+}
+
+/**
+ * @returns the state of `fd` if it is a client of the loop running in this thread, `NULL` otherwise.
+ */
+Connection *getLoopConnection(int fd)
+{
+    if (currentLoop == NULL || fd < 0 || fd >= currentLoop->connections_size)
+        return NULL;
+    return currentLoop->connections[fd];
+}
+
+/**
+ * Appends `data` to the connection outbound queue, it will be written at the end of the loop iteration.
+ * The queue takes ownership of `data`.
+ *
+ * @returns `-1` on error
+ */
+int queueToConnection(Connection *conn, void *data, size_t size)
+{
+    OutChunk *chunk = memAlloc(sizeof(OutChunk));
+    if (chunk == NULL)
+        return -1;
+    chunk->next = NULL;
+    chunk->data = data;
+    chunk->file_fd = -1;
+    chunk->size = size;
+    chunk->sent = 0;
+    chunk->queued_at = TRACE_START();
+    chunk->shared = NULL;
+    if (scheduleFlush(currentLoop, conn) == -1)
+    {
+        memFree(chunk);
+        return -1;
+    }
+    appendOutChunk(conn, chunk);
+    return 0;
+}
+
+/**
+ * Appends a frame shared with other connections to the outbound queue, the queue takes a reference to it.
+ *
+ * @returns `-1` on error
+ */
+int queueSharedToConnection(Connection *conn, SharedFrame *frame, size_t size)
+{
+    if (queueToConnection(conn, frame->data, size) == -1)
+        return -1;
+    conn->out_tail->shared = frame;
+    frame->refs++;
+    return 0;
+}
+
+/**
+ * Queues a frame whose body is `size` bytes of `file_fd` starting at `offset`, both parts get queued or none.
+ * The queue takes ownership of `header` and `file_fd`.
+ *
+ * @returns `-1` on error
+ */
+int queueFileToConnection(Connection *conn, void *header, size_t header_size, int file_fd, off_t offset, size_t size)
+{
+    OutChunk *header_chunk = memAlloc(sizeof(OutChunk));
+    OutChunk *file_chunk = memAlloc(sizeof(OutChunk));
+    if (header_chunk == NULL || file_chunk == NULL || scheduleFlush(currentLoop, conn) == -1)
+    {
+        memFree(header_chunk);
+        memFree(file_chunk);
+        return -1;
+    }
+    memset(header_chunk, 0, sizeof(OutChunk));
+    header_chunk->data = header;
+    header_chunk->file_fd = -1;
+    header_chunk->size = header_size;
+    header_chunk->queued_at = TRACE_START();
+    memset(file_chunk, 0, sizeof(OutChunk));
+    file_chunk->file_fd = file_fd;
+    file_chunk->file_offset = offset;
+    file_chunk->size = size;
+    appendOutChunk(conn, header_chunk);
+    appendOutChunk(conn, file_chunk);
+    return 0;
+}
+
+/**
+ * Closes a client of the loop running in this thread. The socket is closed at the end of the loop iteration,
+ * or later if it still has queued data, so the state is never freed under the feet of a handler.
+ */
+void closeLoopConnection(Connection *conn)
+{
+    if (conn->closing)
+        return;
+    conn->closing = 1;
+    // without a slot in the pending flushes, we close it right away
+    if (scheduleFlush(currentLoop, conn) == -1)
+        flushAndClose(currentLoop, conn);
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * accept connections using an async non blocking io mechanism with epoll
+ *
+ * packets sent with `redilon_sendToClient` from the handlers are queued and written together at the end of each loop iteration.
+ *
+ * @returns `0` when stopped with `redilon_stopAsyncServer` or `-1` if there is an error
+ */
+int redilon_acceptConnectionsAsync(redilon_AsyncServerConf *conf)
+{
+    // before allocating anything, so the loop state is placed in the numa node of its cpus
+    if (pinCurrentThread(conf->loop_cpus, conf->loop_cpus_size) == -1)
+        return -1;
+    AsyncLoop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.conf = conf;
+    loop.epoll_fd = -1;
+    loop.wake_fd = -1;
+    struct epoll_event *events = NULL;
+    if (openLoop(&loop, &events) == -1)
+    {
+        int err = errno;
+        closeLoop(&loop, events);
+        errno = err;
+        return -1;
+    }
+    int wake_fd = loop.wake_fd;
+    currentLoop = &loop;
+    conf->state = &loop;
+
+    int status = -1;
+    int reserve_fd = openReserveFd();
+    // set when the accept budget ran out, the listener is edge-triggered so we won't get notified again
+    int accept_pending = 0;
+    for (;;)
+    {
+        uint64_t trace_start = TRACE_START();
+        int number_fds = waitEvents(&loop, events, getWaitTimeout(&loop, accept_pending));
+        TRACE_END("epoll_wait", trace_start, loop.epoll_fd, -1);
+        if (number_fds == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // the ones listed while handling these events already had their turn in this iteration
+        int ready_size = loop.ready_size;
+        for (int i = 0; i < number_fds; i++)
+        {
+            int fd = events[i].data.fd;
+            // server socket, connections get accepted once the clients of this batch have been served
+            if (fd == conf->server_fd)
+            {
+                accept_pending = !loop.draining;
+                continue;
+            }
+            if (fd == wake_fd)
+            {
+                uint64_t value;
+                // reset it before taking the completions, a thread posting now wakes us up again
+                while (read(wake_fd, &value, sizeof(value)) == -1 && errno == EINTR)
+                    ;
+                applyCompletions(&loop);
+                if (loop.stop_requested && !loop.draining)
+                {
+                    startDraining(&loop);
+                    accept_pending = 0;
+                }
+                continue;
+            }
+            // it may have been closed by a handler earlier in this batch
+            Connection *conn = getLoopConnection(fd);
+            if (conn == NULL)
+                continue;
+            if (events[i].events & EPOLLOUT)
+            {
+                conn->pending_flush = 0;
+                flushAndClose(&loop, conn);
+                conn = getLoopConnection(fd);
+            }
+            // the user already closed it or we are stopping, we are just writing what's left.
+            // A ready connection is read in its turn
+            if (conn == NULL || conn->closing || loop.draining || conn->ready)
+                continue;
+            if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                continue;
+            // handle client
+            int result = readConnection(&loop, conn);
+            if (result == -1)
+            {
+                if (conf->onConnectionClosed != NULL)
+                    conf->onConnectionClosed(fd, conf->handlersArgs);
+            }
+        }
+
+        if (ready_size > 0)
+            readReady(&loop, ready_size);
+
+        if (accept_pending)
+            accept_pending = acceptClientsAsync(&loop, &reserve_fd);
+
+        // everything the handlers sent in this iteration
+        flushPending(&loop);
+
+        if (loop.draining && isDrained(&loop))
+        {
+            status = 0;
+            break;
+        }
+    };
+
+    int err = errno;
+    conf->state = NULL;
+    // waits for the handlers that are running, nothing they post gets written anymore
+    stopWorkers(&loop);
+    Completion *completion;
+    while ((completion = popCompletion(&loop)) != NULL)
+        freeCompletion(completion);
+    currentLoop = NULL;
+    closeLoop(&loop, events);
+    if (reserve_fd != -1)
+        close(reserve_fd);
+    errno = err;
+    return status;
+};
+
+/**
+ * Stops a running async server gracefully: it stops accepting and reading, writes what's left in the outbound queues
+ * for at most `drain_timeout_ms`, closes the connections and `redilon_acceptConnectionsAsync` returns `0`.
+ *
+ * The listening socket is left open, so it can be handed to another process (see `redilon_handOffListener`).
+ * It is safe to call from a signal handler or from another thread.
+ *
+ * @returns `-1` if the server is not running.
+ */
+int redilon_stopAsyncServer(redilon_AsyncServerConf *conf, int drain_timeout_ms)
+{
+    AsyncLoop *loop = conf->state;
+    if (loop == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    loop->drain_timeout_ms = drain_timeout_ms;
+    loop->stop_requested = 1;
+    uint64_t value = 1;
+    return write(loop->wake_fd, &value, sizeof(value)) == -1 ? -1 : 0;
+}
+
+/**
+ * Sends a packet to a client of a running async server from any thread, e.g a background thread pushing notifications.
+ * The serialized packet is pushed to a lock-free queue and written by the loop thread, so it never interleaves
+ * with the frames sent by the handlers or by other threads.
+ *
+ * From the loop thread or its workers it is the same as `redilon_sendToClient`.
+ *
+ * @note the server must be running, stop your senders before calling `redilon_stopAsyncServer`.
+ * @returns the frame size or `-1` if there is an error.
+ */
+int redilon_postToClient(redilon_AsyncServerConf *conf, int client_fd, redilon_Packet *packet, int should_free)
+{
+    AsyncLoop *loop = conf->state;
+    if (loop == NULL || currentLoop == loop || getCurrentWorkerJob() != NULL)
+    {
+        if (loop != NULL)
+            return redilon_sendToClient(client_fd, packet, should_free);
+        if (should_free)
+            redilon_freePacket(packet);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int size = redilon_getPacketSize(packet);
+    void *serializedPacket = serializeFrame(packet);
+    if (should_free)
+        redilon_freePacket(packet);
+    Completion *completion = createCompletion(COMPLETION_DATA, client_fd, 0);
+    if (serializedPacket == NULL || completion == NULL)
+    {
+        memFree(serializedPacket);
+        memFree(completion);
+        return -1;
+    }
+    completion->data = serializedPacket;
+    completion->size = size;
+    pushCompletion(loop, completion);
+    return size;
+}
+
+/**
+ * From a handler of an async server, the bytes a client holds: the body of the frame being received plus its
+ * outbound queue, what `max_connection_memory` limits.
+ *
+ * @returns `-1` with `EBADF` if `client_fd` is not a client of the loop running in this thread.
+ */
+ssize_t redilon_getConnectionMemory(int client_fd)
+{
+    Connection *conn = getLoopConnection(client_fd);
+    if (conn == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return getConnectionMemory(currentLoop, conn);
+}
@@ -0,0 +1,397 @@
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "time.h"
+#include "stdatomic.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// bytes the cache may take when `cache_size` is not set
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define INITIAL_CACHE_BUCKETS 64
+
+// private fns
+static int64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t mixHash(uint64_t hash, uint64_t value)
+{
+    hash ^= value * 0x9E3779B97F4A7C15ULL;
+    hash = (hash << 31) | (hash >> 33);
+    return hash * 0xBF58476D1CE4E5B9ULL;
+}
+
+/**
+ * Hashes the payload 8 bytes at a time, requests are hashed on every frame of a cached op code so it has to be cheap.
+ */
+static uint64_t hashRequest(uint8_t op_code, void *payload, uint32_t size)
+{
+    uint64_t hash = mixHash(size, op_code);
+    uint8_t *bytes = payload;
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(uint64_t));
+        hash = mixHash(hash, word);
+    }
+    uint64_t tail = 0;
+    if (size > i)
+        memcpy(&tail, bytes + i, size - i);
+    hash = mixHash(hash, tail);
+    return hash ^ (hash >> 29);
+}
+
+static size_t getEntrySize(CacheEntry *entry)
+{
+    return sizeof(CacheEntry) + entry->key_size + sizeof(SharedFrame) + entry->frame_size;
+}
+
+static CacheEntry *findEntry(ResponseCache *cache, uint8_t op_code, void *key, uint32_t key_size, uint64_t hash)
+{
+    if (cache->buckets_capacity == 0)
+        return NULL;
+    for (CacheEntry *entry = cache->buckets[hash & (cache->buckets_capacity - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && entry->op_code == op_code && entry->key_size == key_size &&
+            (key_size == 0 || memcmp(entry->key, key, key_size) == 0))
+            return entry;
+    return NULL;
+}
+
+static void removeEntry(ResponseCache *cache, CacheEntry *entry)
+{
+    CacheEntry **bucket = &cache->buckets[entry->hash & (cache->buckets_capacity - 1)];
+    while (*bucket != entry)
+        bucket = &(*bucket)->next;
+    *bucket = entry->next;
+    // the last entry takes its place in the clock
+    CacheEntry *last = cache->entries[--cache->entries_size];
+    cache->entries[entry->index] = last;
+    last->index = entry->index;
+    if (cache->hand >= cache->entries_size)
+        cache->hand = 0;
+
+    cache->size -= getEntrySize(entry);
+    atomic_store_explicit(&cache->stats_entries, cache->entries_size, memory_order_relaxed);
+    atomic_store_explicit(&cache->stats_size, cache->size, memory_order_relaxed);
+    // connections may still have it queued
+    releaseSharedFrame(entry->frame);
+    memFree(entry->key);
+    memFree(entry);
+}
+
+/**
+ * Evicts entries until `size` more bytes fit. The clock hand skips, once, the entries hit since it last went by,
+ * and takes the expired ones no matter what.
+ */
+static void makeRoom(ResponseCache *cache, size_t size)
+{
+    int64_t now = nowMs();
+    while (cache->entries_size > 0 && cache->size + size > cache->max_size)
+    {
+        CacheEntry *entry = cache->entries[cache->hand];
+        if (entry->referenced && entry->expires_at > now)
+        {
+            entry->referenced = 0;
+            cache->hand = (cache->hand + 1) % cache->entries_size;
+            continue;
+        }
+        removeEntry(cache, entry);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+}
+
+static int growBuckets(ResponseCache *cache)
+{
+    uint32_t capacity = cache->buckets_capacity == 0 ? INITIAL_CACHE_BUCKETS : cache->buckets_capacity * 2;
+    CacheEntry **buckets = memCalloc(capacity, sizeof(CacheEntry *));
+    if (buckets == NULL)
+        return -1;
+    for (uint32_t i = 0; i < cache->entries_size; i++)
+    {
+        CacheEntry *entry = cache->entries[i];
+        CacheEntry **bucket = &buckets[entry->hash & (capacity - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    memFree(cache->buckets);
+    cache->buckets = buckets;
+    cache->buckets_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @returns `-1` if there is no memory.
+ */
+static int growEntries(ResponseCache *cache)
+{
+    if (cache->entries_size == cache->entries_capacity)
+    {
+        uint32_t capacity = cache->entries_capacity == 0 ? INITIAL_CACHE_BUCKETS : cache->entries_capacity * 2;
+        CacheEntry **temp = memRealloc(cache->entries, capacity * sizeof(CacheEntry *));
+        if (temp == NULL)
+            return -1;
+        cache->entries = temp;
+        cache->entries_capacity = capacity;
+    }
+    // at most one entry per bucket on average
+    if (cache->entries_size >= cache->buckets_capacity && growBuckets(cache) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * Invalidates from the loop thread, or asks the loop to do it from any other thread.
+ *
+ * @returns `-1` on error
+ */
+static int requestInvalidation(redilon_AsyncServerConf *conf, int op_code, void *key, uint32_t key_size)
+{
+    AsyncLoop *loop = conf->state;
+    if (loop == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (getCurrentLoop() == loop)
+    {
+        invalidateCache(loop, op_code, key, key_size);
+        return 0;
+    }
+    Completion *completion = createCompletion(COMPLETION_INVALIDATE, -1, 0);
+    if (completion == NULL)
+        return -1;
+    completion->op_code = op_code;
+    if (key != NULL)
+    {
+        completion->key = memAlloc(key_size > 0 ? key_size : 1);
+        if (completion->key == NULL)
+        {
+            freeCompletion(completion);
+            return -1;
+        }
+        memcpy(completion->key, key, key_size);
+        completion->key_size = key_size;
+    }
+    pushCompletion(loop, completion);
+    return 0;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns how long the replies to `op_code` are cached, `0` if they are not.
+ */
+uint32_t getCacheTtl(AsyncLoop *loop, uint8_t op_code)
+{
+    redilon_AsyncServerConf *conf = loop->conf;
+    if (conf->cacheTtl == NULL)
+        return 0;
+    return conf->cacheTtl(op_code, conf->handlersArgs);
+}
+
+/**
+ * Queues the cached reply to the request, if there is one, skipping the handler.
+ *
+ * @returns `1` if the request was served from the cache.
+ */
+int serveFromCache(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *payload, uint32_t size)
+{
+    ResponseCache *cache = &loop->cache;
+    CacheEntry *entry = findEntry(cache, op_code, payload, size, hashRequest(op_code, payload, size));
+    if (entry != NULL && entry->expires_at <= nowMs())
+    {
+        removeEntry(cache, entry);
+        entry = NULL;
+    }
+    if (entry == NULL || queueSharedToConnection(conn, entry->frame, entry->frame_size) == -1)
+    {
+        atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    entry->referenced = 1;
+    atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+    return 1;
+}
+
+/**
+ * Appends a reply of a handler to the ones captured to be cached.
+ */
+void captureReply(ReplyCapture *capture, void *data, size_t size)
+{
+    if (capture->failed)
+        return;
+    SharedFrame *frame = budgetRealloc(capture->frame, sizeof(SharedFrame) + capture->size + size);
+    if (frame == NULL)
+    {
+        capture->failed = 1;
+        return;
+    }
+    memcpy(frame->data + capture->size, data, size);
+    capture->frame = frame;
+    capture->size += size;
+}
+
+/**
+ * Caches the replies the handler sent to the connection while it ran inline, taking them from `capture`.
+ * Replies with files, or to a connection the handler closed, are not cached.
+ */
+void cacheCapturedReply(AsyncLoop *loop, Connection *conn, ReplyCapture *capture, uint8_t op_code, void *payload, uint32_t size, uint32_t ttl_ms)
+{
+    SharedFrame *frame = capture->frame;
+    capture->frame = NULL;
+    if (frame == NULL || capture->failed || conn->closing)
+    {
+        memFree(frame);
+        return;
+    }
+    frame->refs = 1;
+    insertCacheEntry(loop, op_code, payload, size, frame, capture->size, ttl_ms);
+}
+
+/**
+ * Caches `frame` as the reply to the request, replacing the one it may already have.
+ * Takes the caller reference of `frame`, `key` is copied.
+ */
+void insertCacheEntry(AsyncLoop *loop, uint8_t op_code, void *key, uint32_t key_size, SharedFrame *frame, size_t size, uint32_t ttl_ms)
+{
+    ResponseCache *cache = &loop->cache;
+    if (cache->max_size == 0)
+        cache->max_size = loop->conf->cache_size > 0 ? loop->conf->cache_size : DEFAULT_CACHE_SIZE;
+    uint64_t hash = hashRequest(op_code, key, key_size);
+    CacheEntry *old = findEntry(cache, op_code, key, key_size, hash);
+    if (old != NULL)
+        removeEntry(cache, old);
+
+    size_t entry_size = sizeof(CacheEntry) + key_size + sizeof(SharedFrame) + size;
+    CacheEntry *entry = entry_size <= cache->max_size ? memAlloc(sizeof(CacheEntry)) : NULL;
+    void *key_copy = entry != NULL ? memAlloc(key_size > 0 ? key_size : 1) : NULL;
+    if (key_copy == NULL)
+    {
+        memFree(entry);
+        releaseSharedFrame(frame);
+        return;
+    }
+    makeRoom(cache, entry_size);
+    if (growEntries(cache) == -1)
+    {
+        memFree(key_copy);
+        memFree(entry);
+        releaseSharedFrame(frame);
+        return;
+    }
+    if (key_size > 0)
+        memcpy(key_copy, key, key_size);
+    entry->hash = hash;
+    entry->op_code = op_code;
+    entry->key = key_copy;
+    entry->key_size = key_size;
+    entry->frame = frame;
+    entry->frame_size = size;
+    entry->expires_at = nowMs() + ttl_ms;
+    entry->referenced = 0;
+    entry->index = cache->entries_size;
+    cache->entries[cache->entries_size++] = entry;
+    CacheEntry **bucket = &cache->buckets[hash & (cache->buckets_capacity - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->size += entry_size;
+    atomic_store_explicit(&cache->stats_entries, cache->entries_size, memory_order_relaxed);
+    atomic_store_explicit(&cache->stats_size, cache->size, memory_order_relaxed);
+}
+
+/**
+ * Drops the cached reply to the request in `key` or, if `key` is `NULL`, all the replies of `op_code` (`-1` all of them).
+ */
+void invalidateCache(AsyncLoop *loop, int op_code, void *key, uint32_t key_size)
+{
+    ResponseCache *cache = &loop->cache;
+    // replies captured by the workers until now may be stale
+    cache->generation++;
+    if (key != NULL)
+    {
+        CacheEntry *entry = findEntry(cache, op_code, key, key_size, hashRequest(op_code, key, key_size));
+        if (entry != NULL)
+            removeEntry(cache, entry);
+        return;
+    }
+    for (uint32_t i = 0; i < cache->entries_size;)
+    {
+        CacheEntry *entry = cache->entries[i];
+        // the last one takes its place
+        if (op_code == -1 || entry->op_code == op_code)
+            removeEntry(cache, entry);
+        else
+            i++;
+    }
+}
+
+void freeCache(AsyncLoop *loop)
+{
+    invalidateCache(loop, -1, NULL, 0);
+    memFree(loop->cache.entries);
+    memFree(loop->cache.buckets);
+    memset(&loop->cache, 0, sizeof(ResponseCache));
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Drops the cached replies of `op_code` of a running async server, `-1` drops all of them.
+ * Call it when the data behind them changes.
+ *
+ * Safe to call from any thread, from outside the loop thread it is applied by the loop later on.
+ *
+ * @returns `-1` on error
+ */
+int redilon_invalidateCache(redilon_AsyncServerConf *conf, int op_code)
+{
+    return requestInvalidation(conf, op_code, NULL, 0);
+}
+
+/**
+ * Drops the cached reply to a single request, `request` is the packet the client sends.
+ *
+ * Safe to call from any thread, from outside the loop thread it is applied by the loop later on.
+ *
+ * @returns `-1` on error
+ */
+int redilon_invalidateCachedRequest(redilon_AsyncServerConf *conf, redilon_Packet *request)
+{
+    return requestInvalidation(conf, request->op_code, request->buffer->stream, request->buffer->size);
+}
+
+/**
+ * Fills `stats` with the cache counters of a running async server, the hit rate is `hits / (hits + misses)`.
+ * Safe to call from any thread.
+ *
+ * @returns `-1` if the server is not running.
+ */
+int redilon_getCacheStats(redilon_AsyncServerConf *conf, redilon_CacheStats *stats)
+{
+    AsyncLoop *loop = conf->state;
+    if (loop == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ResponseCache *cache = &loop->cache;
+    stats->hits = atomic_load_explicit(&cache->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&cache->misses, memory_order_relaxed);
+    stats->evictions = atomic_load_explicit(&cache->evictions, memory_order_relaxed);
+    stats->entries = atomic_load_explicit(&cache->stats_entries, memory_order_relaxed);
+    stats->size = atomic_load_explicit(&cache->stats_size, memory_order_relaxed);
+    return 0;
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "errno.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sched.h"
+#include "pthread.h"
+#include "sys/mman.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+/**
+ * A capture file being written. The readers of every thread reserve their record with an atomic add and copy it
+ * straight into the mapping, so capturing takes no locks nor syscalls.
+ */
+typedef struct Capture
+{
+    int fd;
+    // the header, followed by room for `capacity` bytes of records
+    uint8_t *data;
+    size_t capacity;
+    uint64_t start_ns;
+    // next free byte after the header, it goes past `capacity` once a record didn't fit
+    _Atomic uint64_t pos;
+    // where the first record that didn't fit would have gone, the ones after it don't fit either
+    _Atomic uint64_t full_at;
+    _Atomic uint64_t frames;
+    _Atomic uint64_t dropped;
+} Capture;
+
+static _Atomic(Capture *) current = NULL;
+// readers inside `captureFrame`, a capture is not unmapped until they are out
+static atomic_int writers = 0;
+// serializes start and stop
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// private fns
+static uint64_t nowNs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void writeRecord(Capture *capture, uint64_t conn_id, uint8_t op_code, void *body, uint32_t size)
+{
+    size_t record_size = sizeof(redilon_CaptureRecord) + size;
+    uint64_t pos = atomic_fetch_add_explicit(&capture->pos, record_size, memory_order_relaxed);
+    if (pos + record_size > capture->capacity)
+    {
+        uint64_t full_at = atomic_load_explicit(&capture->full_at, memory_order_relaxed);
+        while (pos < full_at && !atomic_compare_exchange_weak_explicit(&capture->full_at, &full_at, pos,
+                                                                       memory_order_relaxed, memory_order_relaxed))
+            ;
+        atomic_fetch_add_explicit(&capture->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    redilon_CaptureRecord record;
+    record.at_ns = nowNs(CLOCK_MONOTONIC) - capture->start_ns;
+    record.conn_id = conn_id;
+    record.op_code = op_code;
+    record.size = size;
+    uint8_t *dst = capture->data + sizeof(redilon_CaptureHeader) + pos;
+    memcpy(dst, &record, sizeof(redilon_CaptureRecord));
+    if (size > 0)
+        memcpy(dst + sizeof(redilon_CaptureRecord), body, size);
+    atomic_fetch_add_explicit(&capture->frames, 1, memory_order_relaxed);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns `1` while `redilon_startCapture` is running, for the callers that have to work out what they capture.
+ */
+int isCapturing()
+{
+    return atomic_load_explicit(&current, memory_order_relaxed) != NULL;
+}
+
+/**
+ * Appends a frame that was just received to the capture file, if `redilon_startCapture` is running.
+ */
+void captureFrame(uint64_t conn_id, uint8_t op_code, void *body, uint32_t size)
+{
+    // the common case, a single relaxed load
+    if (!isCapturing())
+        return;
+    atomic_fetch_add(&writers, 1);
+    Capture *capture = atomic_load(&current);
+    if (capture != NULL)
+        writeRecord(capture, conn_id, op_code, body, size);
+    atomic_fetch_sub(&writers, 1);
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Starts appending every frame the servers receive, and the ones read with `redilon_read`, to a binary log in
+ * `path`: a `redilon_CaptureHeader` followed by a `redilon_CaptureRecord` and the body of each frame, with the time
+ * it arrived and the connection it came from. Play it back with [benchmarks/replay](../benchmarks/replay/).
+ *
+ * The file is memory mapped, a frame is captured with a copy and no syscalls. Streamed frames are not captured,
+ * nor the ones turned away before being read whole.
+ *
+ * @param max_size bytes of records the file may take, the frames that don't fit are counted as dropped.
+ * @returns `-1` if there is an error, with `EBUSY` if a capture is already running.
+ */
+int redilon_startCapture(char *path, size_t max_size)
+{
+    pthread_mutex_lock(&capture_lock);
+    if (atomic_load(&current) != NULL)
+    {
+        pthread_mutex_unlock(&capture_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    Capture *capture = memCalloc(1, sizeof(Capture));
+    int fd = capture != NULL ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    size_t length = sizeof(redilon_CaptureHeader) + max_size;
+    // the file is sparse, the pages are only backed as the records get written
+    void *data = fd != -1 && ftruncate(fd, length) == 0 ? mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                                        : MAP_FAILED;
+    if (data == MAP_FAILED)
+    {
+        int err = errno;
+        if (fd != -1)
+            close(fd);
+        memFree(capture);
+        pthread_mutex_unlock(&capture_lock);
+        errno = err;
+        return -1;
+    }
+    redilon_CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REDILON_CAPTURE_MAGIC, sizeof(header.magic));
+    header.started_at = nowNs(CLOCK_REALTIME);
+    memcpy(data, &header, sizeof(header));
+    capture->fd = fd;
+    capture->data = data;
+    capture->capacity = max_size;
+    capture->start_ns = nowNs(CLOCK_MONOTONIC);
+    atomic_init(&capture->full_at, UINT64_MAX);
+    atomic_store(&current, capture);
+    pthread_mutex_unlock(&capture_lock);
+    return 0;
+}
+
+/**
+ * Stops the capture, waiting for the frames being written, and trims the file to the records it holds.
+ *
+ * @returns `-1` if there is an error, with `EINVAL` if no capture is running.
+ */
+int redilon_stopCapture()
+{
+    pthread_mutex_lock(&capture_lock);
+    Capture *capture = atomic_exchange(&current, NULL);
+    if (capture == NULL)
+    {
+        pthread_mutex_unlock(&capture_lock);
+        errno = EINVAL;
+        return -1;
+    }
+    while (atomic_load(&writers) > 0)
+        sched_yield();
+
+    uint64_t pos = atomic_load(&capture->pos);
+    uint64_t full_at = atomic_load(&capture->full_at);
+    size_t length = sizeof(redilon_CaptureHeader) + (pos < full_at ? pos : full_at);
+    redilon_CaptureHeader header;
+    memcpy(&header, capture->data, sizeof(header));
+    header.frames = atomic_load(&capture->frames);
+    header.dropped = atomic_load(&capture->dropped);
+    memcpy(capture->data, &header, sizeof(header));
+    munmap(capture->data, sizeof(redilon_CaptureHeader) + capture->capacity);
+    int res = ftruncate(capture->fd, length);
+    if (close(capture->fd) == -1)
+        res = -1;
+    memFree(capture);
+    pthread_mutex_unlock(&capture_lock);
+    return res;
+}
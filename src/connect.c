@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "errno.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "netdb.h"
+#include "poll.h"
+#include "pthread.h"
+#include "sys/socket.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// hosts kept by the resolver cache, the least recently resolved one makes room for a new one
+#define RESOLVER_CACHE_SIZE 64
+// addresses kept per host
+#define MAX_HOST_ADDRESSES 16
+// time given to a connection attempt before racing the next address, as recommended by RFC 8305
+#define CONNECTION_ATTEMPT_DELAY_MS 250
+
+typedef struct ResolvedAddress
+{
+    int family;
+    socklen_t addr_len;
+    struct sockaddr_storage addr;
+} ResolvedAddress;
+
+typedef struct ResolvedHost
+{
+    // `NULL` for the local host
+    char *host;
+    char *port;
+    int64_t expires_at;
+    ResolvedAddress addresses[MAX_HOST_ADDRESSES];
+    int addresses_size;
+} ResolvedHost;
+
+static ResolvedHost resolverCache[RESOLVER_CACHE_SIZE];
+static pthread_mutex_t resolverLock = PTHREAD_MUTEX_INITIALIZER;
+
+// private fns
+static int64_t nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int isSameHost(ResolvedHost *entry, char *host, char *port)
+{
+    if (entry->port == NULL || strcmp(entry->port, port) != 0)
+        return 0;
+    if (entry->host == NULL || host == NULL)
+        return entry->host == host;
+    return strcmp(entry->host, host) == 0;
+}
+
+static void clearEntry(ResolvedHost *entry)
+{
+    memFree(entry->host);
+    memFree(entry->port);
+    memset(entry, 0, sizeof(ResolvedHost));
+}
+
+/**
+ * Copies the cached addresses of `host` if they have not expired.
+ *
+ * @returns the amount of addresses copied, `0` if they are not cached.
+ */
+static int getCachedAddresses(char *host, char *port, ResolvedAddress *addresses)
+{
+    int size = 0;
+    int64_t now = nowMs();
+    pthread_mutex_lock(&resolverLock);
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++)
+    {
+        ResolvedHost *entry = &resolverCache[i];
+        if (!isSameHost(entry, host, port))
+            continue;
+        if (entry->expires_at <= now)
+            clearEntry(entry);
+        else
+        {
+            size = entry->addresses_size;
+            memcpy(addresses, entry->addresses, size * sizeof(ResolvedAddress));
+        }
+        break;
+    }
+    pthread_mutex_unlock(&resolverLock);
+    return size;
+}
+
+static void cacheAddresses(char *host, char *port, ResolvedAddress *addresses, int size, int ttl_secs)
+{
+    int64_t now = nowMs();
+    pthread_mutex_lock(&resolverLock);
+    ResolvedHost *slot = &resolverCache[0];
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++)
+    {
+        ResolvedHost *entry = &resolverCache[i];
+        // another thread resolved it meanwhile, or a free slot
+        if (isSameHost(entry, host, port) || entry->port == NULL)
+        {
+            slot = entry;
+            break;
+        }
+        if (entry->expires_at < slot->expires_at)
+            slot = entry;
+    }
+    clearEntry(slot);
+    slot->host = host != NULL ? memStrdup(host) : NULL;
+    slot->port = memStrdup(port);
+    if (slot->port != NULL && (host == NULL || slot->host != NULL))
+    {
+        slot->expires_at = now + (int64_t)ttl_secs * 1000;
+        slot->addresses_size = size;
+        memcpy(slot->addresses, addresses, size * sizeof(ResolvedAddress));
+    }
+    else
+        clearEntry(slot);
+    pthread_mutex_unlock(&resolverLock);
+}
+
+static void forgetAddresses(char *host, char *port)
+{
+    pthread_mutex_lock(&resolverLock);
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++)
+        if (isSameHost(&resolverCache[i], host, port))
+            clearEntry(&resolverCache[i]);
+    pthread_mutex_unlock(&resolverLock);
+}
+
+/**
+ * Resolves `host` and orders its addresses alternating families (RFC 8305 section 4), so an unreachable family
+ * only costs a connection attempt delay before the other one gets its turn.
+ *
+ * @returns the amount of addresses or `-1` on error.
+ */
+static int resolveHost(char *host, char *port, ResolvedAddress *addresses)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrInfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, port, &hints, &addrInfo);
+    if (status != 0)
+    {
+        errno = status == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    // getaddrinfo already sorted them by preference (RFC 6724), keep that order within each family
+    struct addrinfo *families[2][MAX_HOST_ADDRESSES];
+    int families_size[2] = {0, 0};
+    for (struct addrinfo *addr = addrInfo; addr != NULL; addr = addr->ai_next)
+    {
+        int family = addr->ai_family != addrInfo->ai_family;
+        if (families_size[family] < MAX_HOST_ADDRESSES && addr->ai_addrlen <= sizeof(struct sockaddr_storage))
+            families[family][families_size[family]++] = addr;
+    }
+    int size = 0;
+    for (int i = 0; i < families_size[0] || i < families_size[1]; i++)
+        for (int family = 0; family < 2; family++)
+        {
+            if (i >= families_size[family] || size == MAX_HOST_ADDRESSES)
+                continue;
+            struct addrinfo *addr = families[family][i];
+            addresses[size].family = addr->ai_family;
+            addresses[size].addr_len = addr->ai_addrlen;
+            memcpy(&addresses[size].addr, addr->ai_addr, addr->ai_addrlen);
+            size++;
+        }
+    freeaddrinfo(addrInfo);
+    if (size == 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    return size;
+}
+
+/**
+ * Starts a non-blocking connect to `address`.
+ *
+ * @returns the socket, `-1` if the attempt failed right away. `*connected` is set if it didn't have to wait.
+ */
+static int startAttempt(ResolvedAddress *address, redilon_SocketOptions *options, int *connected)
+{
+    int fd = socket(address->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    if (applySocketOptions(fd, options) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    *connected = connect(fd, (struct sockaddr *)&address->addr, address->addr_len) == 0;
+    if (!*connected && errno != EINPROGRESS)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Races connections to `addresses` (Happy Eyeballs, RFC 8305): a new attempt starts every
+ * `CONNECTION_ATTEMPT_DELAY_MS`, or as soon as the previous one fails, and the first one to connect wins.
+ *
+ * @returns the connected socket, in blocking mode, or `-1` on error.
+ */
+static int raceConnections(ResolvedAddress *addresses, int size, redilon_SocketOptions *options)
+{
+    struct pollfd attempts[MAX_HOST_ADDRESSES];
+    int attempts_size = 0;
+    int next = 0;
+    int winner = -1;
+    int err = ECONNREFUSED;
+    int64_t deadline = options->connect_timeout_ms > 0 ? nowMs() + options->connect_timeout_ms : -1;
+    int64_t next_attempt_at = nowMs();
+
+    while (winner == -1 && (next < size || attempts_size > 0))
+    {
+        int64_t now = nowMs();
+        if (deadline != -1 && now >= deadline)
+        {
+            err = ETIMEDOUT;
+            break;
+        }
+        if (next < size && now >= next_attempt_at)
+        {
+            int connected;
+            int fd = startAttempt(&addresses[next++], options, &connected);
+            if (fd == -1)
+            {
+                // no reason to wait for it, give the next one its turn right away
+                err = errno;
+                continue;
+            }
+            if (connected)
+            {
+                winner = fd;
+                break;
+            }
+            attempts[attempts_size].fd = fd;
+            attempts[attempts_size].events = POLLOUT;
+            attempts_size++;
+            next_attempt_at = now + CONNECTION_ATTEMPT_DELAY_MS;
+        }
+
+        int64_t timeout = -1;
+        if (next < size)
+            timeout = next_attempt_at - now;
+        if (deadline != -1 && (timeout == -1 || deadline - now < timeout))
+            timeout = deadline - now;
+        int ready = poll(attempts, attempts_size, timeout);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            err = errno;
+            break;
+        }
+        for (int i = 0; i < attempts_size && ready > 0; i++)
+        {
+            if (attempts[i].revents == 0)
+                continue;
+            ready--;
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &so_error, &len) == -1)
+                so_error = errno;
+            if (so_error == 0)
+            {
+                winner = attempts[i].fd;
+                attempts[i] = attempts[--attempts_size];
+                break;
+            }
+            err = so_error;
+            close(attempts[i].fd);
+            attempts[i--] = attempts[--attempts_size];
+            // a failure doesn't have to wait for the attempt delay
+            next_attempt_at = now;
+        }
+    }
+
+    // the losers
+    for (int i = 0; i < attempts_size; i++)
+        close(attempts[i].fd);
+    if (winner == -1)
+    {
+        errno = err;
+        return -1;
+    }
+    int flags = fcntl(winner, F_GETFL, 0);
+    if (flags == -1 || fcntl(winner, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        close(winner);
+        return -1;
+    }
+    return winner;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Connects to `host`, resolving it through the cache when `options->resolve_ttl_secs` is set.
+ *
+ * @returns the connected socket or `-1` on error.
+ */
+int connectToHost(char *host, char *port, redilon_SocketOptions *options)
+{
+    ResolvedAddress addresses[MAX_HOST_ADDRESSES];
+    int cached = 0;
+    int size = 0;
+    if (options->resolve_ttl_secs > 0)
+        size = getCachedAddresses(host, port, addresses);
+    if (size > 0)
+        cached = 1;
+    else
+    {
+        size = resolveHost(host, port, addresses);
+        if (size == -1)
+            return -1;
+        if (options->resolve_ttl_secs > 0)
+            cacheAddresses(host, port, addresses, size, options->resolve_ttl_secs);
+    }
+
+    int fd = raceConnections(addresses, size, options);
+    // the host may have moved, resolve it again next time
+    if (fd == -1 && cached)
+    {
+        int err = errno;
+        forgetAddresses(host, port);
+        errno = err;
+    }
+    return fd;
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Empties the resolver cache, the next connection to each host resolves it again.
+ */
+void redilon_flushResolverCache()
+{
+    pthread_mutex_lock(&resolverLock);
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++)
+        clearEntry(&resolverCache[i]);
+    pthread_mutex_unlock(&resolverLock);
+}
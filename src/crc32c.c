@@ -0,0 +1,344 @@
+#include "stdlib.h"
+#include "stdint.h"
+#include "errno.h"
+#include "string.h"
+#include "pthread.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+#if defined(__x86_64__)
+#include "immintrin.h"
+#define HAS_X86_CRC 1
+#endif
+
+// Castagnoli polynomial, bit reflected
+#define CRC32C_POLY 0x82f63b78
+// bytes per stream of the three way interleaved crc, big blocks first and small ones for what's left
+#define LONG_BLOCK 8192
+#define SHORT_BLOCK 256
+
+typedef uint32_t (*CrcFn)(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size);
+
+typedef struct CrcImpl
+{
+    CrcFn compute;
+    // copies `src` to `dst` in the same pass
+    CrcFn copy;
+} CrcImpl;
+
+static uint32_t table[8][256];
+static CrcImpl impls[REDILON_CRC32C_PCLMUL + 1];
+static CrcImpl *current = NULL;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+
+// private fns
+
+/**
+ * Multiplies two polynomials modulo the crc one, in the reflected representation (bit 31 is x^0).
+ */
+static uint32_t multModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            product ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/**
+ * @returns x^n modulo the crc polynomial.
+ */
+static uint32_t xPowModP(uint64_t n)
+{
+    uint32_t power = 1u << 31;
+    uint32_t square = 1u << 30;
+    while (n > 0)
+    {
+        if (n & 1)
+            power = multModP(square, power);
+        square = multModP(square, square);
+        n >>= 1;
+    }
+    return power;
+}
+
+/**
+ * Slicing by 8: eight table lookups per 8 bytes instead of a dependent one per byte.
+ */
+static inline __attribute__((always_inline)) uint32_t crcPortableBody(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size, int copy)
+{
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        if (copy)
+        {
+            memcpy(dst, &word, 8);
+            dst += 8;
+        }
+        // little endian, the first byte is the low one
+        uint32_t low = (uint32_t)word ^ crc;
+        uint32_t high = word >> 32;
+        crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+              table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+        src += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+    {
+        if (copy)
+            *dst++ = *src;
+        crc = table[0][(crc ^ *src++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t crcPortable(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcPortableBody(crc, dst, src, size, 0);
+}
+
+static uint32_t crcPortableCopy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcPortableBody(crc, dst, src, size, 1);
+}
+
+#ifdef HAS_X86_CRC
+
+// x^(8n - 33) for the shifts of the interleaved streams, see `shiftCrc`
+static uint64_t longShifts[2];
+static uint64_t shortShifts[2];
+
+/**
+ * The crc32 instruction, 8 bytes at a time. It has a latency of 3 cycles, one stream can't go faster than that.
+ */
+__attribute__((target("sse4.2"))) static inline __attribute__((always_inline)) uint32_t crcSse42Body(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size, int copy)
+{
+    uint64_t crc64 = crc;
+    while (size >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, src, 8);
+        if (copy)
+        {
+            memcpy(dst, &word, 8);
+            dst += 8;
+        }
+        crc64 = _mm_crc32_u64(crc64, word);
+        src += 8;
+        size -= 8;
+    }
+    crc = crc64;
+    while (size-- > 0)
+    {
+        if (copy)
+            *dst++ = *src;
+        crc = _mm_crc32_u8(crc, *src++);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crcSse42(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcSse42Body(crc, dst, src, size, 0);
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crcSse42Copy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcSse42Body(crc, dst, src, size, 1);
+}
+
+/**
+ * Multiplies `crc` by x^(8n) with a carry-less multiply by `k` = x^(8n - 33), the crc32 instruction reduces the
+ * 64 bits product (and adds the missing x^33).
+ */
+__attribute__((target("sse4.2,pclmul"))) static inline uint32_t shiftCrc(uint32_t crc, uint64_t k)
+{
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(k), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+/**
+ * Three crc32 streams over consecutive blocks keep the instruction pipeline full, their crcs are then folded
+ * into one with `shiftCrc`. The blocks fit in L1, so the copy doesn't read them from memory again.
+ */
+__attribute__((target("sse4.2,pclmul"))) static inline __attribute__((always_inline)) uint32_t crcBlocks(uint32_t crc, uint8_t **dst, const uint8_t **src, size_t *size, size_t block, uint64_t *shifts, int copy)
+{
+    while (*size >= 3 * block)
+    {
+        uint64_t crc0 = crc;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const uint8_t *from = *src;
+        uint8_t *to = *dst;
+        for (size_t i = 0; i < block; i += 8)
+        {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, from + i, 8);
+            memcpy(&word1, from + block + i, 8);
+            memcpy(&word2, from + 2 * block + i, 8);
+            crc0 = _mm_crc32_u64(crc0, word0);
+            crc1 = _mm_crc32_u64(crc1, word1);
+            crc2 = _mm_crc32_u64(crc2, word2);
+        }
+        // still in L1, copying it here is faster than storing each word next to its crc32, which has to share
+        // the ports with the three streams
+        if (copy)
+            memcpy(to, from, 3 * block);
+        crc = shiftCrc(crc0, shifts[0]) ^ shiftCrc(crc1, shifts[1]) ^ (uint32_t)crc2;
+        *src += 3 * block;
+        if (copy)
+            *dst += 3 * block;
+        *size -= 3 * block;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul"))) static inline __attribute__((always_inline)) uint32_t crcPclmulBody(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size, int copy)
+{
+    crc = crcBlocks(crc, &dst, &src, &size, LONG_BLOCK, longShifts, copy);
+    crc = crcBlocks(crc, &dst, &src, &size, SHORT_BLOCK, shortShifts, copy);
+    return crcSse42Body(crc, dst, src, size, copy);
+}
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crcPclmul(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcPclmulBody(crc, dst, src, size, 0);
+}
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crcPclmulCopy(uint32_t crc, uint8_t *dst, const uint8_t *src, size_t size)
+{
+    return crcPclmulBody(crc, dst, src, size, 1);
+}
+
+#endif
+
+static void initCrc32c()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int slice = 1; slice < 8; slice++)
+            table[slice][i] = table[0][table[slice - 1][i] & 0xff] ^ (table[slice - 1][i] >> 8);
+    impls[REDILON_CRC32C_PORTABLE].compute = crcPortable;
+    impls[REDILON_CRC32C_PORTABLE].copy = crcPortableCopy;
+    current = &impls[REDILON_CRC32C_PORTABLE];
+
+#ifdef HAS_X86_CRC
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse4.2"))
+        return;
+    impls[REDILON_CRC32C_SSE42].compute = crcSse42;
+    impls[REDILON_CRC32C_SSE42].copy = crcSse42Copy;
+    current = &impls[REDILON_CRC32C_SSE42];
+    if (!__builtin_cpu_supports("pclmul"))
+        return;
+    longShifts[0] = xPowModP(8 * 2 * LONG_BLOCK - 33);
+    longShifts[1] = xPowModP(8 * LONG_BLOCK - 33);
+    shortShifts[0] = xPowModP(8 * 2 * SHORT_BLOCK - 33);
+    shortShifts[1] = xPowModP(8 * SHORT_BLOCK - 33);
+    impls[REDILON_CRC32C_PCLMUL].compute = crcPclmul;
+    impls[REDILON_CRC32C_PCLMUL].copy = crcPclmulCopy;
+    current = &impls[REDILON_CRC32C_PCLMUL];
+#endif
+}
+
+static CrcImpl *getImpl()
+{
+    pthread_once(&initOnce, initCrc32c);
+    return current;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Copies `size` bytes of `src` to `dst` and returns their crc32c, in a single pass over them.
+ *
+ * @param crc of the bytes before them, `0` for the first ones.
+ */
+uint32_t crc32cCopy(uint32_t crc, void *dst, const void *src, size_t size)
+{
+    return ~getImpl()->copy(~crc, dst, src, size);
+}
+
+/**
+ * Checks the crc32c trailer of a frame received with `FRAME_CHECKSUM_FLAG`, it covers the header and the body.
+ *
+ * @param body followed by the 4 bytes trailer.
+ * @returns `-1` with `EBADMSG` if it doesn't match.
+ */
+int checkFrame(uint8_t op_code, void *body, uint32_t body_size)
+{
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint32_t size = body_size | FRAME_CHECKSUM_FLAG;
+    header[0] = op_code;
+    memcpy(header + sizeof(uint8_t), &size, sizeof(uint32_t));
+    uint32_t crc = redilon_crc32c(redilon_crc32c(0, header, FRAME_HEADER_SIZE), body, body_size);
+    uint32_t trailer;
+    memcpy(&trailer, (uint8_t *)body + body_size, FRAME_TRAILER_SIZE);
+    if (crc != trailer)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * CRC32C (Castagnoli) of `size` bytes, the one that protects the checksummed frames. It uses the fastest
+ * implementation the cpu supports, picked on the first call.
+ *
+ * @param crc of the bytes before them, `0` for the first ones.
+ */
+uint32_t redilon_crc32c(uint32_t crc, const void *data, size_t size)
+{
+    return ~getImpl()->compute(~crc, NULL, data, size);
+}
+
+/**
+ * Forces an implementation of the crc32c, for every thread, call it before they use it. Meant for tests and
+ * benchmarks, the default is the best one.
+ *
+ * @returns `-1` with `ENOTSUP` if the cpu doesn't support it.
+ */
+int redilon_setCrc32cImpl(redilon_Crc32cImpl impl)
+{
+    getImpl();
+    if (impl == REDILON_CRC32C_BEST)
+    {
+        for (int i = REDILON_CRC32C_PCLMUL; i >= REDILON_CRC32C_PORTABLE; i--)
+            if (impls[i].compute != NULL)
+                return redilon_setCrc32cImpl(i);
+    }
+    if (impl < REDILON_CRC32C_PORTABLE || impl > REDILON_CRC32C_PCLMUL || impls[impl].compute == NULL)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    current = &impls[impl];
+    return 0;
+}
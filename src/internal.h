@@ -0,0 +1,484 @@
+#ifndef redilon_INTERNAL_H
+#define redilon_INTERNAL_H
+
+/**
+ * Private declarations shared between the library translation units.
+ * This header is not installed, nothing in here is part of the public api.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "./redilon.h"
+
+#define REDILON_INTERNAL __attribute__((visibility("hidden")))
+
+// hint the cpu that we are busy-waiting
+#if defined(__x86_64__) || defined(__i386__)
+#define cpuRelax() __builtin_ia32_pause()
+#else
+#define cpuRelax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// spans of the `redilon_dumpTrace` trace, built with `make TRACE=1`. Compiled out they cost nothing
+#ifdef REDILON_TRACE
+#define TRACE_START() traceStart()
+#define TRACE_END(name, start, fd, op_code) traceEnd(name, start, fd, op_code)
+#else
+#define TRACE_START() ((uint64_t)0)
+#define TRACE_END(name, start, fd, op_code) ((void)(start))
+#endif
+
+// size of the op_code + buffer size fields that prefix every frame
+#define FRAME_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+// set in the size field of a frame followed by a crc32c trailer, the body size is in the rest of the bits. Bodies
+// never reach it, they are capped at `REDILON_MAX_BODY_SIZE`
+#define FRAME_CHECKSUM_FLAG 0x80000000u
+#define FRAME_TRAILER_SIZE sizeof(uint32_t)
+// a busy frame carrying the op code of the request that was turned away
+#define BUSY_FRAME_SIZE (FRAME_HEADER_SIZE + sizeof(uint8_t))
+// pieces passed to `onChunk` when `chunk_size` is not set
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Where the frames of a relayed connection go, see `route` in `redilon_OnDemandServerConf`.
+ */
+typedef struct RelayRoute
+{
+    redilon_RouteHandler handler;
+    redilon_RelayBackend *backends;
+    int backends_size;
+    void *args;
+} RelayRoute;
+
+typedef struct MpscNode
+{
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+/**
+ * Lock-free queue with many producer threads and a single consumer, see mpsc.c.
+ * Nodes are embedded in the structs being queued, as their first member.
+ */
+typedef struct MpscQueue
+{
+    _Atomic(MpscNode *) head;
+    MpscNode *tail;
+    MpscNode stub;
+} MpscQueue;
+
+/**
+ * Serialized frame queued to many connections at once (pub/sub), it is freed when the last one has sent it.
+ * Only the loop thread touches `refs`.
+ */
+typedef struct SharedFrame
+{
+    int refs;
+    uint8_t data[];
+} SharedFrame;
+
+/**
+ * A serialized chunk of data waiting to be written to a connection.
+ */
+typedef struct OutChunk
+{
+    struct OutChunk *next;
+    // owned by the chunk, freed once it has been fully sent
+    void *data;
+    // file chunks are sent with sendfile(2) from `file_offset`, `-1` for memory chunks. The fd is owned by the chunk
+    int file_fd;
+    off_t file_offset;
+    size_t size;
+    size_t sent;
+    // start of its `send queue` span
+    uint64_t queued_at;
+    // `data` points into it, the chunk holds a reference instead of owning `data`
+    SharedFrame *shared;
+} OutChunk;
+
+/**
+ * Replies of a handler captured to be cached, in the order they were sent.
+ */
+typedef struct ReplyCapture
+{
+    SharedFrame *frame;
+    size_t size;
+    // some of them can't be cached (a file, a close) or there was no memory for them
+    int failed;
+} ReplyCapture;
+
+/**
+ * State kept by the async server for each connected client.
+ */
+typedef struct Connection
+{
+    int fd;
+    // unique per process, tells completions of a closed connection apart from the one that reused its fd
+    uint64_t id;
+    // frames handed to the workers whose handler has not returned yet
+    int in_flight;
+    // the user closed the connection, it gets closed for real once the outbound queue is drained
+    int closing;
+    // `EPOLLOUT` is registered because the socket buffer got full
+    int waiting_writable;
+    // listed in the loop pending flushes
+    int pending_flush;
+    // ran out of read budget with data left, listed in the loop ready list
+    int ready;
+    // handled in the current read, for the frame budget
+    uint32_t frames_read;
+    OutChunk *out_head;
+    OutChunk *out_tail;
+    size_t out_size;
+    // bytes of `out_size` held in memory, files are not
+    size_t out_memory;
+    // over `max_connection_memory`, not read until its outbound queue drains
+    int paused;
+    // what was left in the read buffer when it got paused, it goes first once it resumes
+    void *unread;
+    size_t unread_size;
+    // body of a refused frame still to come, it is skipped
+    uint32_t discarding;
+    // topics it is subscribed to, dropped when the connection is freed
+    struct Subscription *subscriptions;
+    // set while a handler runs inline for it and the reply is to be cached
+    ReplyCapture *capture;
+
+    // frame header split between reads
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint32_t header_received;
+    // frame that did not arrive whole, its body gets completed here
+    uint8_t op_code;
+    void *body;
+    uint32_t body_size;
+    uint32_t body_received;
+    // the frame has a crc32c trailer, it is counted in `body_size`
+    int checksum;
+    // frame being passed to `onChunk`, `body` holds the chunk being filled
+    int streaming;
+    uint32_t stream_offset;
+} Connection;
+
+/**
+ * A connection subscribed to a topic. It is both in the topic subscribers array and in the connection list.
+ */
+typedef struct Subscription
+{
+    struct Topic *topic;
+    Connection *conn;
+    // position in `topic->subscribers`, kept up to date as others leave
+    uint32_t index;
+    struct Subscription *next;
+} Subscription;
+
+typedef struct Topic
+{
+    // next in the hash bucket
+    struct Topic *next;
+    uint64_t hash;
+    char *name;
+    Subscription **subscribers;
+    uint32_t subscribers_size;
+    uint32_t subscribers_capacity;
+} Topic;
+
+/**
+ * Frame handed to a worker thread, it owns the body.
+ */
+typedef struct WorkerJob
+{
+    struct WorkerJob *next;
+    struct AsyncLoop *loop;
+    int fd;
+    uint64_t conn_id;
+    uint8_t op_code;
+    void *body;
+    uint32_t body_size;
+    // start of its `worker queue` span
+    uint64_t queued_at;
+    // the replies to `fd` are captured to be cached for this long, `0` when the op code is not cached
+    uint32_t cache_ttl_ms;
+    // cache generation when it was offloaded, a reply captured before an invalidation is not cached
+    uint64_t cache_generation;
+    // replies to `fd` captured so far
+    ReplyCapture capture;
+    // monotonic microseconds when it was queued, for the shedding
+    int64_t offloaded_at;
+    // over `max_in_flight`, it only carries the busy reply so it goes out after the replies to the frames before it
+    int rejected;
+} WorkerJob;
+
+/**
+ * CoDel state of a worker queue, only its worker touches it.
+ */
+typedef struct ShedState
+{
+    // the wait went over the target and has not gone under it since, `0` if it didn't
+    int64_t above_since;
+    int shedding;
+    int64_t next_shed_at;
+    // frames shed since it started shedding, the interval between them shrinks with its square root
+    uint32_t shed_count;
+} ShedState;
+
+typedef struct Worker
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    WorkerJob *head;
+    WorkerJob *tail;
+    int stop;
+    ShedState shed;
+    // reserved in the memory budget
+    size_t stack_size;
+} Worker;
+
+enum CompletionKind
+{
+    COMPLETION_DATA,
+    COMPLETION_FILE,
+    COMPLETION_CLOSE,
+    COMPLETION_SUBSCRIBE,
+    COMPLETION_UNSUBSCRIBE,
+    // `data` is a `SharedFrame` for the subscribers of `topic`, `fd` is the one excluded
+    COMPLETION_PUBLISH,
+    // `data` is a `SharedFrame` with the reply to the request in `key`
+    COMPLETION_CACHE,
+    // drops the cached replies of `op_code` (`-1` all of them), or only the one of `key`
+    COMPLETION_INVALIDATE,
+    // the handler of a job returned
+    COMPLETION_DONE,
+};
+
+/**
+ * Something a worker did on a connection, applied by the loop thread which is the only one that touches the sockets.
+ */
+typedef struct Completion
+{
+    MpscNode node;
+    enum CompletionKind kind;
+    int fd;
+    // `0` matches whatever connection has `fd`
+    uint64_t conn_id;
+    // owned by the completion. For `COMPLETION_FILE` it is the frame header
+    void *data;
+    size_t size;
+    int file_fd;
+    off_t file_offset;
+    size_t file_size;
+    // owned by the completion, pub/sub completions only
+    char *topic;
+    // cache completions only, `key` is owned by the completion
+    int op_code;
+    void *key;
+    uint32_t key_size;
+    uint32_t ttl_ms;
+    uint64_t cache_generation;
+} Completion;
+
+/**
+ * Cached reply to a request, keyed on its op code and payload.
+ */
+typedef struct CacheEntry
+{
+    // next in the hash bucket
+    struct CacheEntry *next;
+    uint64_t hash;
+    uint8_t op_code;
+    void *key;
+    uint32_t key_size;
+    // the reply frames, ready to be queued
+    SharedFrame *frame;
+    size_t frame_size;
+    int64_t expires_at;
+    // position in `entries`, the order the clock hand goes through
+    uint32_t index;
+    // hit since the clock hand last went by
+    int referenced;
+} CacheEntry;
+
+typedef struct ResponseCache
+{
+    // a power of two of buckets
+    CacheEntry **buckets;
+    uint32_t buckets_capacity;
+    CacheEntry **entries;
+    uint32_t entries_size;
+    uint32_t entries_capacity;
+    uint32_t hand;
+    size_t size;
+    size_t max_size;
+    // bumped on every invalidation
+    uint64_t generation;
+    // only the loop writes them, `redilon_getCacheStats` may read them from any thread
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t evictions;
+    _Atomic uint32_t stats_entries;
+    _Atomic size_t stats_size;
+} ResponseCache;
+
+/**
+ * State of a running async server loop.
+ */
+typedef struct AsyncLoop
+{
+    redilon_AsyncServerConf *conf;
+    int epoll_fd;
+    // eventfd to wake the loop up from other threads
+    int wake_fd;
+    // set by `redilon_stopAsyncServer`, it may run in a signal handler
+    volatile sig_atomic_t stop_requested;
+    volatile int drain_timeout_ms;
+    // stopped accepting and reading, writing what's left until the deadline
+    int draining;
+    int64_t drain_deadline;
+    // `conf->busy_poll_us`, unless there is a single cpu
+    int busy_poll_us;
+    // every read lands here first, so idle connections don't hold a buffer of their own
+    void *read_buffer;
+    // indexed by file descriptor
+    Connection **connections;
+    int connections_size;
+    // open connections, for `max_connections`
+    int connections_count;
+    // frames admitted to the workers whose handler has not returned, the workers decrement it
+    atomic_int in_flight;
+    // connections with queued writes, flushed at the end of the loop iteration
+    int *pending_flushes;
+    int pending_flushes_size;
+    int pending_flushes_capacity;
+    // connections with data left to read once their budget ran out, they are edge-triggered so epoll won't list them again
+    int *ready;
+    int ready_size;
+    int ready_capacity;
+    // offloaded handlers run here, the frames of a connection always go to the same worker
+    Worker *workers;
+    int workers_size;
+    // posted by the workers and `redilon_postToClient`, the loop is woken up through `wake_fd`
+    MpscQueue completions;
+    // `wake_fd` was written and the loop did not take the completions yet, saves a write per completion
+    atomic_int wake_pending;
+    // replies of the op codes picked by `conf->cacheTtl`
+    ResponseCache cache;
+    // pub/sub hash map, a power of two of buckets
+    Topic **topics;
+    uint32_t topics_capacity;
+    uint32_t topics_size;
+} AsyncLoop;
+
+// sockets
+REDILON_INTERNAL int setNonBlocking(int fd);
+REDILON_INTERNAL int openReserveFd();
+REDILON_INTERNAL int acceptClient(int server_fd, int flags, int *reserve_fd);
+REDILON_INTERNAL int sendAll(int fd, void *data, size_t size, int flags);
+REDILON_INTERNAL int applySocketOptions(int fd, redilon_SocketOptions *options);
+REDILON_INTERNAL uint64_t newConnectionId();
+REDILON_INTERNAL int recvAll(int fd, void *dst, size_t size, int may_be_empty);
+
+// connect
+REDILON_INTERNAL int connectToHost(char *host, char *port, redilon_SocketOptions *options);
+
+// async
+REDILON_INTERNAL AsyncLoop *getCurrentLoop();
+REDILON_INTERNAL Connection *getLoopConnection(int fd);
+REDILON_INTERNAL int queueToConnection(Connection *conn, void *data, size_t size);
+REDILON_INTERNAL int queueFileToConnection(Connection *conn, void *header, size_t header_size, int file_fd, off_t offset, size_t size);
+REDILON_INTERNAL void closeLoopConnection(Connection *conn);
+REDILON_INTERNAL int queueSharedToConnection(Connection *conn, SharedFrame *frame, size_t size);
+
+// workers
+REDILON_INTERNAL int startWorkers(AsyncLoop *loop, int size);
+REDILON_INTERNAL void stopWorkers(AsyncLoop *loop);
+REDILON_INTERNAL int offloadFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *body, uint32_t body_size, uint32_t cache_ttl_ms);
+REDILON_INTERNAL int offloadRejected(AsyncLoop *loop, Connection *conn, uint8_t op_code);
+REDILON_INTERNAL Completion *createCompletion(enum CompletionKind kind, int fd, uint64_t conn_id);
+REDILON_INTERNAL void pushCompletion(AsyncLoop *loop, Completion *completion);
+REDILON_INTERNAL Completion *popCompletion(AsyncLoop *loop);
+REDILON_INTERNAL void freeCompletion(Completion *completion);
+REDILON_INTERNAL WorkerJob *getCurrentWorkerJob();
+REDILON_INTERNAL int postData(WorkerJob *job, int fd, void *data, size_t size);
+REDILON_INTERNAL int postFile(WorkerJob *job, int fd, void *header, size_t header_size, int file_fd, off_t offset, size_t size);
+REDILON_INTERNAL int postClose(WorkerJob *job, int fd);
+
+// pubsub
+REDILON_INTERNAL SharedFrame *createSharedFrame(redilon_Packet *packet);
+REDILON_INTERNAL void releaseSharedFrame(SharedFrame *frame);
+REDILON_INTERNAL int subscribeConnection(AsyncLoop *loop, Connection *conn, char *topic);
+REDILON_INTERNAL int unsubscribeConnection(AsyncLoop *loop, Connection *conn, char *topic);
+REDILON_INTERNAL void unsubscribeAll(AsyncLoop *loop, Connection *conn);
+REDILON_INTERNAL int publishShared(AsyncLoop *loop, char *topic, SharedFrame *frame, size_t size, int exclude_fd);
+REDILON_INTERNAL void freeTopics(AsyncLoop *loop);
+
+// cache
+REDILON_INTERNAL uint32_t getCacheTtl(AsyncLoop *loop, uint8_t op_code);
+REDILON_INTERNAL int serveFromCache(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *payload, uint32_t size);
+REDILON_INTERNAL void captureReply(ReplyCapture *capture, void *data, size_t size);
+REDILON_INTERNAL void cacheCapturedReply(AsyncLoop *loop, Connection *conn, ReplyCapture *capture, uint8_t op_code, void *payload, uint32_t size, uint32_t ttl_ms);
+REDILON_INTERNAL void insertCacheEntry(AsyncLoop *loop, uint8_t op_code, void *key, uint32_t key_size, SharedFrame *frame, size_t size, uint32_t ttl_ms);
+REDILON_INTERNAL void invalidateCache(AsyncLoop *loop, int op_code, void *key, uint32_t key_size);
+REDILON_INTERNAL void freeCache(AsyncLoop *loop);
+
+// admission
+REDILON_INTERNAL size_t writeBusyFrame(uint8_t *frame, int op_code);
+REDILON_INTERNAL void rejectConnection(int fd, int reset);
+REDILON_INTERNAL int shouldShed(ShedState *state, int64_t waited_us, int64_t now_us, redilon_AsyncServerConf *conf);
+
+// mpsc
+REDILON_INTERNAL void initMpscQueue(MpscQueue *queue);
+REDILON_INTERNAL void pushMpscQueue(MpscQueue *queue, MpscNode *node);
+REDILON_INTERNAL MpscNode *popMpscQueue(MpscQueue *queue);
+
+// udp
+REDILON_INTERNAL redilon_UdpSocket *getCurrentUdpSocket(int fd);
+REDILON_INTERNAL int queueUdpReply(redilon_UdpSocket *sock, redilon_Packet *packet);
+
+// crc32c
+REDILON_INTERNAL uint32_t crc32cCopy(uint32_t crc, void *dst, const void *src, size_t size);
+REDILON_INTERNAL int checkFrame(uint8_t op_code, void *body, uint32_t body_size);
+
+// packets
+REDILON_INTERNAL size_t writeFrame(void *dst, redilon_Packet *packet);
+REDILON_INTERNAL void *serializeFrame(redilon_Packet *packet);
+REDILON_INTERNAL int nextBatchPacket(void *body, uint32_t size, uint32_t *offset, uint8_t *op_code, redilon_Buffer *buffer);
+REDILON_INTERNAL int dispatchBatch(int fd, void *body, uint32_t size, redilon_Handler requestHandler, void *args);
+
+// trace
+REDILON_INTERNAL uint64_t traceStart();
+REDILON_INTERNAL void traceEnd(const char *name, uint64_t start, int fd, int op_code);
+
+// affinity
+REDILON_INTERNAL int pinCurrentThread(int *cpus, int cpus_size);
+REDILON_INTERNAL int setAttrCpus(pthread_attr_t *attr, int *cpus, int cpus_size);
+REDILON_INTERNAL void touchPages(void *memory, size_t size);
+
+// shm
+REDILON_INTERNAL redilon_ShmChannel *getCurrentShmChannel(int fd);
+
+// memory
+REDILON_INTERNAL void *memAlloc(size_t size);
+REDILON_INTERNAL void *memCalloc(size_t count, size_t size);
+REDILON_INTERNAL void *memRealloc(void *ptr, size_t size);
+REDILON_INTERNAL char *memStrdup(const char *str);
+REDILON_INTERNAL void memFree(void *ptr);
+REDILON_INTERNAL void memDisown(void *ptr);
+REDILON_INTERNAL void *budgetAlloc(size_t size);
+REDILON_INTERNAL void *budgetRealloc(void *ptr, size_t size);
+REDILON_INTERNAL void *budgetAdopt(void *ptr, size_t size);
+REDILON_INTERNAL int reserveMemory(size_t size);
+REDILON_INTERNAL void releaseMemory(size_t size);
+REDILON_INTERNAL size_t reserveStack(pthread_attr_t *attr);
+REDILON_INTERNAL void releaseStack(size_t size);
+
+// capture
+REDILON_INTERNAL int isCapturing();
+REDILON_INTERNAL void captureFrame(uint64_t conn_id, uint8_t op_code, void *body, uint32_t size);
+
+// relay
+REDILON_INTERNAL int relayConnection(int client_fd, RelayRoute *route);
+
+#endif // redilon_INTERNAL_H
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "errno.h"
+#include "string.h"
+#include "malloc.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+#define CACHE_LINE 64
+// a thread adds up its allocations and frees locally, and moves them to `used` once they go past this either way
+#define MEMORY_FLUSH_SIZE (256 * 1024)
+
+/**
+ * Share of `used` of a single thread that was not moved to it yet. Only the owner writes it, so counting an
+ * allocation takes no atomic read-modify-write. It goes negative when the thread frees what others allocated.
+ */
+typedef struct MemoryCounter
+{
+    _Alignas(CACHE_LINE) _Atomic int64_t pending;
+    struct MemoryCounter *next;
+    // its thread exited, a new one can take it
+    int exited;
+} MemoryCounter;
+
+// bytes held by the library, counted with the size malloc actually gave us so a free takes back exactly what was
+// added. The threads keep up to `MEMORY_FLUSH_SIZE` of it each in their counter
+static _Atomic int64_t used = 0;
+static _Atomic int64_t peak = 0;
+static atomic_size_t thread_stacks = 0;
+static atomic_size_t budget = 0;
+static _Atomic uint64_t refused = 0;
+// every counter created, the ones of exited threads are reused
+static MemoryCounter *counters = NULL;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+// its destructor moves what the thread kept to `used` when it exits
+static pthread_key_t counter_key;
+static pthread_once_t counter_key_once = PTHREAD_ONCE_INIT;
+
+static __thread MemoryCounter *currentCounter = NULL;
+
+// private fns
+static void updatePeak(int64_t now)
+{
+    int64_t highest = atomic_load_explicit(&peak, memory_order_relaxed);
+    while (now > highest && !atomic_compare_exchange_weak_explicit(&peak, &highest, now, memory_order_relaxed,
+                                                                   memory_order_relaxed))
+        ;
+}
+
+static void flushCounter(MemoryCounter *counter)
+{
+    int64_t pending = atomic_load_explicit(&counter->pending, memory_order_relaxed);
+    atomic_store_explicit(&counter->pending, 0, memory_order_relaxed);
+    updatePeak(atomic_fetch_add_explicit(&used, pending, memory_order_relaxed) + pending);
+}
+
+static void releaseCounter(void *counter)
+{
+    pthread_mutex_lock(&counters_lock);
+    flushCounter(counter);
+    ((MemoryCounter *)counter)->exited = 1;
+    pthread_mutex_unlock(&counters_lock);
+    currentCounter = NULL;
+}
+
+static void createCounterKey()
+{
+    pthread_key_create(&counter_key, releaseCounter);
+}
+
+/**
+ * @returns the counter of this thread, or `NULL` if there is no memory for it and the thread counts straight in `used`.
+ */
+static MemoryCounter *getCounter()
+{
+    if (currentCounter != NULL)
+        return currentCounter;
+    pthread_once(&counter_key_once, createCounterKey);
+    pthread_mutex_lock(&counters_lock);
+    MemoryCounter *counter = counters;
+    while (counter != NULL && !counter->exited)
+        counter = counter->next;
+    // they are not counted themselves, they are bookkeeping of the bookkeeping
+    if (counter == NULL && (counter = aligned_alloc(CACHE_LINE, sizeof(MemoryCounter))) != NULL)
+    {
+        atomic_init(&counter->pending, 0);
+        counter->next = counters;
+        counters = counter;
+    }
+    if (counter != NULL)
+        counter->exited = 0;
+    pthread_mutex_unlock(&counters_lock);
+    if (counter == NULL)
+        return NULL;
+    // without the key it is just never reused
+    pthread_setspecific(counter_key, counter);
+    currentCounter = counter;
+    return counter;
+}
+
+static void addUsed(int64_t size)
+{
+    MemoryCounter *counter = getCounter();
+    if (counter == NULL)
+    {
+        updatePeak(atomic_fetch_add_explicit(&used, size, memory_order_relaxed) + size);
+        return;
+    }
+    int64_t pending = atomic_load_explicit(&counter->pending, memory_order_relaxed) + size;
+    atomic_store_explicit(&counter->pending, pending, memory_order_relaxed);
+    if (pending > MEMORY_FLUSH_SIZE || pending < -MEMORY_FLUSH_SIZE)
+        flushCounter(counter);
+}
+
+static void subUsed(size_t size)
+{
+    addUsed(-(int64_t)size);
+}
+
+/**
+ * @returns the bytes held by the library, with what every thread kept.
+ */
+static int64_t getUsed()
+{
+    int64_t now = atomic_load_explicit(&used, memory_order_relaxed);
+    pthread_mutex_lock(&counters_lock);
+    for (MemoryCounter *counter = counters; counter != NULL; counter = counter->next)
+        now += atomic_load_explicit(&counter->pending, memory_order_relaxed);
+    pthread_mutex_unlock(&counters_lock);
+    return now;
+}
+
+/**
+ * Checks that `size` more bytes fit in the budget. It only sees what this thread kept, the other threads may
+ * each hold up to `MEMORY_FLUSH_SIZE` more, and concurrent allocations may go over it by a little.
+ *
+ * @returns `-1` with `ENOMEM` if they don't.
+ */
+static int fitsBudget(size_t size)
+{
+    size_t limit = atomic_load_explicit(&budget, memory_order_relaxed);
+    if (limit == 0)
+        return 0;
+    int64_t now = atomic_load_explicit(&used, memory_order_relaxed);
+    MemoryCounter *counter = getCounter();
+    if (counter != NULL)
+        now += atomic_load_explicit(&counter->pending, memory_order_relaxed);
+    if ((now > 0 ? (size_t)now : 0) + size <= limit)
+        return 0;
+    atomic_fetch_add_explicit(&refused, 1, memory_order_relaxed);
+    errno = ENOMEM;
+    return -1;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * malloc(3) counted in the memory stats. The library bookkeeping goes through these, it is never refused by the
+ * budget so no state is left half way. Whatever they return must be freed with `memFree`.
+ */
+void *memAlloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr != NULL)
+        addUsed(malloc_usable_size(ptr));
+    return ptr;
+}
+
+void *memCalloc(size_t count, size_t size)
+{
+    void *ptr = calloc(count, size);
+    if (ptr != NULL)
+        addUsed(malloc_usable_size(ptr));
+    return ptr;
+}
+
+void *memRealloc(void *ptr, size_t size)
+{
+    size_t before = malloc_usable_size(ptr);
+    void *temp = realloc(ptr, size);
+    if (temp == NULL)
+        return NULL;
+    size_t after = malloc_usable_size(temp);
+    if (after > before)
+        addUsed(after - before);
+    else
+        subUsed(before - after);
+    return temp;
+}
+
+char *memStrdup(const char *str)
+{
+    size_t size = strlen(str) + 1;
+    char *copy = memAlloc(size);
+    if (copy != NULL)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+void memFree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+    subUsed(malloc_usable_size(ptr));
+    free(ptr);
+}
+
+/**
+ * Takes memory from `memAlloc` off the books, it is handed to the user who frees it with free(3).
+ */
+void memDisown(void *ptr)
+{
+    if (ptr != NULL)
+        subUsed(malloc_usable_size(ptr));
+}
+
+/**
+ * `memAlloc` for the memory sized by the traffic (bodies, frames, queued copies...), refused with `ENOMEM` when
+ * it would go over the budget.
+ */
+void *budgetAlloc(size_t size)
+{
+    if (fitsBudget(size) == -1)
+        return NULL;
+    return memAlloc(size);
+}
+
+void *budgetRealloc(void *ptr, size_t size)
+{
+    size_t before = malloc_usable_size(ptr);
+    if (size > before && fitsBudget(size - before) == -1)
+        return NULL;
+    return memRealloc(ptr, size);
+}
+
+/**
+ * `budgetRealloc` for memory that was not counted, allocated by the user. The whole of it is counted from now on.
+ */
+void *budgetAdopt(void *ptr, size_t size)
+{
+    if (fitsBudget(size) == -1)
+        return NULL;
+    void *temp = realloc(ptr, size);
+    if (temp != NULL)
+        addUsed(malloc_usable_size(temp));
+    return temp;
+}
+
+/**
+ * Counts memory that doesn't come from malloc, like mappings, against the budget.
+ *
+ * @returns `-1` with `ENOMEM` if it doesn't fit.
+ */
+int reserveMemory(size_t size)
+{
+    if (fitsBudget(size) == -1)
+        return -1;
+    addUsed(size);
+    return 0;
+}
+
+void releaseMemory(size_t size)
+{
+    subUsed(size);
+}
+
+/**
+ * Counts the stack of a thread about to be started with `attr` against the budget.
+ *
+ * @returns the stack size, to be released with `releaseStack` once the thread is done, or `0` with `ENOMEM` if
+ * it doesn't fit.
+ */
+size_t reserveStack(pthread_attr_t *attr)
+{
+    size_t size = 0;
+    if (pthread_attr_getstacksize(attr, &size) != 0 || size == 0 || reserveMemory(size) == -1)
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    atomic_fetch_add_explicit(&thread_stacks, size, memory_order_relaxed);
+    return size;
+}
+
+void releaseStack(size_t size)
+{
+    atomic_fetch_sub_explicit(&thread_stacks, size, memory_order_relaxed);
+    releaseMemory(size);
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Caps the memory the whole library may hold, across every server, connection and thread. Past it the allocations
+ * sized by the traffic are refused: the frames that don't fit are rejected or their connection closed (see
+ * `memory_policy`), new on-demand threads are not started, and the functions that allocate fail with `ENOMEM`.
+ * The library bookkeeping is still counted but never refused.
+ *
+ * Packets count until they are freed with `redilon_freePacket`, so leaking them shows up in
+ * `redilon_getMemoryStats`. What is handed over for good, the serialized frames and the strings, is not counted.
+ *
+ * @param size in bytes, `0` removes the budget.
+ */
+void redilon_setMemoryBudget(size_t size)
+{
+    atomic_store(&budget, size);
+}
+
+/**
+ * Fills `stats` with the memory held by the library right now. It can be called from any thread.
+ */
+void redilon_getMemoryStats(redilon_MemoryStats *stats)
+{
+    int64_t now = getUsed();
+    updatePeak(now);
+    stats->used = now > 0 ? now : 0;
+    stats->peak = atomic_load_explicit(&peak, memory_order_relaxed);
+    stats->thread_stacks = atomic_load_explicit(&thread_stacks, memory_order_relaxed);
+    stats->budget = atomic_load_explicit(&budget, memory_order_relaxed);
+    stats->refused = atomic_load_explicit(&refused, memory_order_relaxed);
+}
+
+/**
+ * Frees what `redilon_serializePacket` and `redilon_getString` return, the same as free(3).
+ */
+void redilon_free(void *ptr)
+{
+    free(ptr);
+}
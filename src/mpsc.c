@@ -0,0 +1,63 @@
+#include "stdlib.h"
+#include "stdatomic.h"
+#include "./internal.h"
+
+/**
+ * Intrusive multi-producer single-consumer queue (Dmitry Vyukov's). Producers only do one atomic exchange,
+ * so they never wait for each other nor for the consumer.
+ *
+ * `head` is the last node pushed, `tail` the next one to pop. `stub` keeps the list non-empty so that
+ * producers never have to touch `tail`.
+ */
+
+void initMpscQueue(MpscQueue *queue)
+{
+    atomic_store_explicit(&queue->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, &queue->stub, memory_order_relaxed);
+    queue->tail = &queue->stub;
+}
+
+/**
+ * Safe to call from any thread.
+ */
+void pushMpscQueue(MpscQueue *queue, MpscNode *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    MpscNode *prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    // until this store, the consumer sees the queue as ending at `prev`
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/**
+ * Only the consumer thread can call it.
+ *
+ * @returns the oldest node or `NULL` if the queue is empty or a producer is halfway through a push,
+ * in which case the node shows up once the push completes.
+ */
+MpscNode *popMpscQueue(MpscQueue *queue)
+{
+    MpscNode *tail = queue->tail;
+    MpscNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &queue->stub)
+    {
+        if (next == NULL)
+            return NULL;
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL)
+    {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire))
+        return NULL;
+    // `tail` is the last node, the stub goes behind it so that it can be taken out
+    pushMpscQueue(queue, &queue->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL)
+        return NULL;
+    queue->tail = next;
+    return tail;
+}
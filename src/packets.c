@@ -3,22 +3,72 @@
 #include "stdint.h"
 #include "stddef.h"
 #include "string.h"
+#include "errno.h"
 #include "./redilon.h"
+#include "./internal.h"
+
+// smallest allocation of a growing buffer
+#define MIN_BUFFER_CAPACITY 64
+// count and magic that close a field index
+#define FIELD_INDEX_FOOTER_SIZE (2 * sizeof(uint32_t))
+#define FIELD_INDEX_ENTRY_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+
+struct redilon_FieldIndex
+{
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t size;
+    uint32_t capacity;
+};
 
 // private fns
+static void freeFieldIndex(redilon_Buffer *buffer)
+{
+    if (buffer->index == NULL)
+        return;
+    memFree(buffer->index->types);
+    memFree(buffer->index->offsets);
+    memFree(buffer->index);
+    buffer->index = NULL;
+}
+
 /**
- * Reallocates memory for the buffer.
+ * Finds the field index at the end of `buffer`.
  *
- * @returns 0 on success, -1 on error
+ * @returns the number of fields, with the position of the index in `*table`, or `-1` with `EPROTO` if the buffer
+ * doesn't end with a well formed one.
  */
-static int redilon_reallocateBuffer(redilon_Buffer *buffer, size_t size)
+static int64_t findFieldIndex(redilon_Buffer *buffer, uint32_t *table)
 {
-    void *temp = realloc(buffer->stream, buffer->size + size);
-    if (temp == NULL)
+    uint32_t count, magic;
+    if (buffer->size < FIELD_INDEX_FOOTER_SIZE)
+    {
+        errno = EPROTO;
         return -1;
-    buffer->stream = temp;
-    buffer->size += size;
-    return 0;
+    }
+    memcpy(&count, buffer->stream + buffer->size - FIELD_INDEX_FOOTER_SIZE, sizeof(uint32_t));
+    memcpy(&magic, buffer->stream + buffer->size - sizeof(uint32_t), sizeof(uint32_t));
+    if (magic != REDILON_FIELD_INDEX_MAGIC || count > (buffer->size - FIELD_INDEX_FOOTER_SIZE) / FIELD_INDEX_ENTRY_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    *table = buffer->size - FIELD_INDEX_FOOTER_SIZE - count * FIELD_INDEX_ENTRY_SIZE;
+    return count;
+}
+
+// bytes a field takes before its variable part
+static uint32_t getFieldSize(redilon_FieldType type)
+{
+    switch (type)
+    {
+    case REDILON_FIELD_UINT8:
+        return sizeof(uint8_t);
+    case REDILON_FIELD_UINT64:
+        return sizeof(uint64_t);
+    default:
+        return sizeof(uint32_t);
+    }
 }
 
 /**
@@ -52,19 +102,24 @@ static int redilon_reallocateBuffer(redilon_Buffer *buffer, size_t size)
 
 redilon_Packet *redilon_createPacket(uint8_t op_code)
 {
-    redilon_Packet *packet = malloc(sizeof(redilon_Packet));
+    redilon_Packet *packet = memAlloc(sizeof(redilon_Packet));
     if (packet == NULL)
         return NULL;
-    packet->buffer = malloc(sizeof(redilon_Buffer));
+    packet->buffer = memAlloc(sizeof(redilon_Buffer));
     if (packet->buffer == NULL)
     {
-        free(packet);
+        memFree(packet);
         return NULL;
     }
     packet->op_code = op_code;
+    packet->checksum = 0;
+    // not counted until it grows, the same as a stream set by hand, so replacing it leaves nothing counted behind
     packet->buffer->stream = malloc(0);
     packet->buffer->offset = 0;
     packet->buffer->size = 0;
+    packet->buffer->capacity = 0;
+    packet->buffer->index = NULL;
+    packet->buffer->allocated = NULL;
     return packet;
 }
 
@@ -73,83 +128,204 @@ redilon_Packet *redilon_createPacket(uint8_t op_code)
  */
 int redilon_getPacketSize(redilon_Packet *packet)
 {
-    // sum of the op_code + buffer size field + buffer stream
-    return sizeof(uint8_t) + sizeof(uint32_t) + packet->buffer->size;
+    // sum of the op_code + buffer size field + buffer stream (+ crc32c trailer)
+    return sizeof(uint8_t) + sizeof(uint32_t) + packet->buffer->size + (packet->checksum ? FRAME_TRAILER_SIZE : 0);
 };
 
 /**
- * Serializes a packet.
+ * Serializes a packet, free it with `redilon_free` or free(3). It is yours, the memory stats don't count it.
  *
- * @returns Serialized packet on success, `NULL` on error
+ * @returns Serialized packet on success, `NULL` on error, with `EMSGSIZE` if its body is over `REDILON_MAX_BODY_SIZE`
  */
 void *redilon_serializePacket(redilon_Packet *packet)
 {
-    size_t size = redilon_getPacketSize(packet);
-    void *serializedPacket = malloc(size);
-    if (serializedPacket == NULL)
-        return NULL;
-    int offset = 0;
-    memcpy(serializedPacket + offset, &(packet->op_code), sizeof(uint8_t));
-    offset += sizeof(uint8_t);
-    memcpy(serializedPacket + offset, &(packet->buffer->size), sizeof(uint32_t));
-    offset += sizeof(uint32_t);
-    memcpy(serializedPacket + offset, packet->buffer->stream, packet->buffer->size);
-
+    void *serializedPacket = serializeFrame(packet);
+    memDisown(serializedPacket);
     return serializedPacket;
 }
 
 /**
- * Deallocates packet memory.
+ * Deallocates packet memory, the stream included even if you set it yourself.
  */
 void redilon_freePacket(redilon_Packet *packet)
 {
-    free(packet->buffer->stream);
-    free(packet->buffer);
-    free(packet);
+    freeFieldIndex(packet->buffer);
+    // only what was counted is taken out of the memory stats
+    if (packet->buffer->stream == packet->buffer->allocated)
+        memFree(packet->buffer->stream);
+    else
+        free(packet->buffer->stream);
+    memFree(packet->buffer);
+    memFree(packet);
 };
 
-// packet add
-
 /**
- * Adds a uint8_t value to the packet buffer.
+ * Creates a batch, an envelope that carries many packets in a single frame. Add the packets with `redilon_addPacketToBatch`
+ * and send it like any other packet: the receiver calls its `requestHandler` once per packet, in the order they were added.
  *
- * @returns 0 on success, -1 on error
+ * @returns `NULL` on error
  */
-int redilon_addUInt8(redilon_Buffer *buffer, uint8_t value)
+redilon_Packet *redilon_createBatch()
 {
-    if (redilon_reallocateBuffer(buffer, sizeof(uint8_t)) == -1)
-        return -1;
-    memcpy(buffer->stream + buffer->offset, &value, sizeof(uint8_t));
-    buffer->offset += sizeof(uint8_t);
-    return 0; // Returns 0 on success
+    return redilon_createPacket(REDILON_BATCH_OP_CODE);
 }
 
 /**
- * Adds a uint32_t value to the packet buffer.
+ * Appends a copy of `packet` to `batch`, you still own `packet`. Batches can't be nested.
+ *
+ * The packets in a batch carry no trailer of their own, `packet->checksum` is ignored. Set it on the batch instead,
+ * its trailer covers all of them.
  *
  * @returns 0 on success, -1 on error
  */
-int redilon_addUInt32(redilon_Buffer *buffer, uint32_t value)
+int redilon_addPacketToBatch(redilon_Packet *batch, redilon_Packet *packet)
 {
-    if (redilon_reallocateBuffer(buffer, sizeof(uint32_t)) == -1)
+    if (packet->op_code == REDILON_BATCH_OP_CODE)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t size = FRAME_HEADER_SIZE + packet->buffer->size;
+    if (batch->buffer->size + size > batch->buffer->capacity && redilon_reserveBuffer(batch->buffer, size) == -1)
         return -1;
-    memcpy(buffer->stream + buffer->offset, &value, sizeof(uint32_t));
-    buffer->offset += sizeof(uint32_t);
+    void *dst = batch->buffer->stream + batch->buffer->size;
+    memcpy(dst, &(packet->op_code), sizeof(uint8_t));
+    memcpy(dst + sizeof(uint8_t), &(packet->buffer->size), sizeof(uint32_t));
+    memcpy(dst + FRAME_HEADER_SIZE, packet->buffer->stream, packet->buffer->size);
+    batch->buffer->size += size;
     return 0;
 }
 
 /**
- * Adds a uint64_t value to the packet buffer.
  *
- * @returns 0 on success, -1 on error
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Writes the frame of `packet` to `dst`, which must have room for `redilon_getPacketSize` bytes. The crc32c of
+ * a checksummed packet is computed while its body is copied, so the body is only read once.
+ *
+ * @returns the size of the frame.
+ */
+size_t writeFrame(void *dst, redilon_Packet *packet)
+{
+    uint8_t *frame = dst;
+    uint32_t size = packet->buffer->size;
+    if (!packet->checksum)
+    {
+        memcpy(frame, &packet->op_code, sizeof(uint8_t));
+        memcpy(frame + sizeof(uint8_t), &size, sizeof(uint32_t));
+        memcpy(frame + FRAME_HEADER_SIZE, packet->buffer->stream, size);
+        return FRAME_HEADER_SIZE + size;
+    }
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint32_t flagged_size = size | FRAME_CHECKSUM_FLAG;
+    header[0] = packet->op_code;
+    memcpy(header + sizeof(uint8_t), &flagged_size, sizeof(uint32_t));
+    uint32_t crc = crc32cCopy(0, frame, header, FRAME_HEADER_SIZE);
+    crc = crc32cCopy(crc, frame + FRAME_HEADER_SIZE, packet->buffer->stream, size);
+    memcpy(frame + FRAME_HEADER_SIZE + size, &crc, FRAME_TRAILER_SIZE);
+    return FRAME_HEADER_SIZE + size + FRAME_TRAILER_SIZE;
+}
+
+/**
+ * Serializes a packet into a frame counted in the memory stats, for the library to send. Free it with `memFree`.
+ *
+ * @returns the frame or `NULL` on error, with `EMSGSIZE` if its body is over `REDILON_MAX_BODY_SIZE`.
+ */
+void *serializeFrame(redilon_Packet *packet)
+{
+    // a buffer filled by hand may be past it, the adders never are
+    if (packet->buffer->size > REDILON_MAX_BODY_SIZE)
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    void *frame = budgetAlloc(redilon_getPacketSize(packet));
+    if (frame == NULL)
+        return NULL;
+    writeFrame(frame, packet);
+    return frame;
+}
+
+/**
+ * Reads the packet at `*offset` of a batch body and moves `*offset` past it. `buffer` points into `body`, nothing is copied.
+ *
+ * @returns `1` if a packet was read, `0` at the end of the batch or `-1` if the batch is malformed.
  */
-int redilon_addUInt64(redilon_Buffer *buffer, uint64_t value)
+int nextBatchPacket(void *body, uint32_t size, uint32_t *offset, uint8_t *op_code, redilon_Buffer *buffer)
 {
-    if (redilon_reallocateBuffer(buffer, sizeof(uint64_t)) == -1)
+    if (*offset == size)
+        return 0;
+    if (size - *offset < FRAME_HEADER_SIZE)
+    {
+        errno = EPROTO;
         return -1;
+    }
+    memcpy(op_code, body + *offset, sizeof(uint8_t));
+    memcpy(&buffer->size, body + *offset + sizeof(uint8_t), sizeof(uint32_t));
+    if (*op_code == REDILON_BATCH_OP_CODE || buffer->size > size - *offset - FRAME_HEADER_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    buffer->offset = 0;
+    buffer->capacity = buffer->size;
+    buffer->index = NULL;
+    buffer->allocated = NULL;
+    buffer->stream = body + *offset + FRAME_HEADER_SIZE;
+    *offset += FRAME_HEADER_SIZE + buffer->size;
+    return 1;
+}
+
+/**
+ * Calls `requestHandler` with each packet of a batch.
+ *
+ * @returns `-1` if the batch is malformed, the packets before the malformed one are still handled.
+ */
+int dispatchBatch(int fd, void *body, uint32_t size, redilon_Handler requestHandler, void *args)
+{
+    uint32_t offset = 0;
+    uint8_t op_code;
+    redilon_Buffer buffer;
+    int res;
+    while ((res = nextBatchPacket(body, size, &offset, &op_code, &buffer)) == 1)
+        requestHandler(fd, op_code, &buffer, args);
+    return res;
+}
 
-    memcpy(buffer->stream + buffer->offset, &value, sizeof(uint64_t));
-    buffer->offset += sizeof(uint64_t);
+// packet add
+
+/**
+ * Makes room for `size` more bytes in the buffer, so that many can be added without reallocating.
+ *
+ * @returns 0 on success, -1 on error, with `EMSGSIZE` if the buffer would outgrow `REDILON_MAX_BODY_SIZE`
+ */
+int redilon_reserveBuffer(redilon_Buffer *buffer, uint32_t size)
+{
+    if (buffer->size > REDILON_MAX_BODY_SIZE || size > REDILON_MAX_BODY_SIZE - buffer->size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint32_t needed = buffer->size + size;
+    if (needed <= buffer->capacity)
+        return 0;
+    // doubling keeps the cost of adding fields amortized constant
+    uint64_t capacity = buffer->capacity < MIN_BUFFER_CAPACITY ? MIN_BUFFER_CAPACITY : (uint64_t)buffer->capacity * 2;
+    if (capacity < needed)
+        capacity = needed;
+    if (capacity > REDILON_MAX_BODY_SIZE)
+        capacity = REDILON_MAX_BODY_SIZE;
+    // a stream set by hand gets counted from here on
+    void *temp = buffer->stream == buffer->allocated ? budgetRealloc(buffer->stream, capacity)
+                                                     : budgetAdopt(buffer->stream, capacity);
+    if (temp == NULL)
+        return -1;
+    buffer->stream = temp;
+    buffer->allocated = temp;
+    buffer->capacity = capacity;
     return 0;
 }
 
@@ -161,65 +337,175 @@ int redilon_addUInt64(redilon_Buffer *buffer, uint64_t value)
 int redilon_addString(redilon_Buffer *buffer, char *value)
 {
     uint32_t length = strlen(value) + 1;
-    if (redilon_addUInt32(buffer, length) == -1)
+    if (redilon_reserveBuffer(buffer, sizeof(uint32_t) + length) == -1)
         return -1;
-    if (redilon_reallocateBuffer(buffer, length) == -1)
+    if (buffer->index != NULL && redilon_recordField(buffer, REDILON_FIELD_STRING) == -1)
         return -1;
-
-    memcpy(buffer->stream + buffer->offset, value, length);
-    buffer->offset += length;
+    // not through `redilon_addUInt32`, the length is not a field of its own
+    memcpy(buffer->stream + buffer->offset, &length, sizeof(uint32_t));
+    memcpy(buffer->stream + buffer->offset + sizeof(uint32_t), value, length);
+    buffer->offset += sizeof(uint32_t) + length;
+    buffer->size += sizeof(uint32_t) + length;
     return 0;
 }
 
-// packet get
-
 /**
- * Reads a uint8_t value from the packet buffer.
+ * Starts recording the fields added to the buffer from now on, so `redilon_addFieldIndex` can write their offsets.
+ * The receiver jumps straight to any of them with `redilon_seekField`, without decoding the ones before it.
+ *
+ * @returns 0 on success, -1 on error
  */
-uint8_t redilon_getUInt8(redilon_Buffer *buffer)
+int redilon_startFieldIndex(redilon_Buffer *buffer)
 {
-    uint8_t value;
-    memcpy(&value, buffer->stream + buffer->offset, sizeof(uint8_t));
-    buffer->offset += sizeof(uint8_t);
-    return value;
-};
+    if (buffer->index != NULL)
+        return 0;
+    buffer->index = memCalloc(1, sizeof(redilon_FieldIndex));
+    return buffer->index == NULL ? -1 : 0;
+}
 
 /**
- * Reads a uint32_t value from the packet buffer.
+ * Writes the index of the fields recorded since `redilon_startFieldIndex` and stops recording. It must be the last
+ * thing added, the index is read from the end of the body. It costs 5 bytes per field plus 8.
+ *
+ * @returns 0 on success, -1 with `EINVAL` if no index was started
  */
-uint32_t redilon_getUInt32(redilon_Buffer *buffer)
+int redilon_addFieldIndex(redilon_Buffer *buffer)
 {
-    uint32_t value;
-    memcpy(&value, buffer->stream + buffer->offset, sizeof(uint32_t));
-    buffer->offset += sizeof(uint32_t);
-    return value;
-};
+    redilon_FieldIndex *index = buffer->index;
+    if (index == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t size = index->size * FIELD_INDEX_ENTRY_SIZE + FIELD_INDEX_FOOTER_SIZE;
+    if (redilon_reserveBuffer(buffer, size) == -1)
+        return -1;
+    uint32_t magic = REDILON_FIELD_INDEX_MAGIC;
+    uint8_t *dst = buffer->stream + buffer->offset;
+    memcpy(dst, index->types, index->size);
+    dst += index->size;
+    memcpy(dst, index->offsets, index->size * sizeof(uint32_t));
+    dst += index->size * sizeof(uint32_t);
+    memcpy(dst, &index->size, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), &magic, sizeof(uint32_t));
+    buffer->offset += size;
+    buffer->size += size;
+    freeFieldIndex(buffer);
+    return 0;
+}
 
 /**
- * Reads a uint64_t value from the packet buffer.
+ * Records a field of `type` at the end of the buffer, the adders call it while an index is being built.
+ *
+ * @returns 0 on success, -1 on error
  */
-uint64_t redilon_getUInt64(redilon_Buffer *buffer)
+int redilon_recordField(redilon_Buffer *buffer, redilon_FieldType type)
 {
-    uint64_t value;
-    memcpy(&value, buffer->stream + buffer->offset, sizeof(uint64_t));
-    buffer->offset += sizeof(uint64_t);
-    return value;
-};
+    redilon_FieldIndex *index = buffer->index;
+    if (index->size == index->capacity)
+    {
+        uint32_t capacity = index->capacity == 0 ? 16 : index->capacity * 2;
+        uint8_t *types = budgetRealloc(index->types, capacity);
+        if (types == NULL)
+            return -1;
+        index->types = types;
+        uint32_t *offsets = budgetRealloc(index->offsets, capacity * sizeof(uint32_t));
+        if (offsets == NULL)
+            return -1;
+        index->offsets = offsets;
+        index->capacity = capacity;
+    }
+    index->types[index->size] = type;
+    index->offsets[index->size] = buffer->offset;
+    index->size++;
+    return 0;
+}
+
+// packet get
 
 /**
- * Reads a string from the packet buffer.
+ * Reads a string from the packet buffer. Free it with `redilon_free` or free(3), the memory stats don't count it.
  *
- * @returns Pointer to the string on success, `NULL` on error
+ * @returns Pointer to the string on success, `NULL` on error, errno is `ERANGE` if it overruns the buffer.
  */
-
 char *redilon_getString(redilon_Buffer *buffer)
 {
     // we expect the string to have the length before the actual string
+    uint32_t offset = buffer->offset;
     uint32_t length = redilon_getUInt32(buffer);
-    char *str = malloc(length);
+    if (length == 0 || length > buffer->size - buffer->offset)
+    {
+        buffer->offset = offset;
+        errno = ERANGE;
+        return NULL;
+    }
+    char *str = budgetAlloc(length);
     if (str == NULL)
+    {
+        buffer->offset = offset;
         return NULL;
+    }
     memcpy(str, buffer->stream + buffer->offset, length);
     buffer->offset += length;
+    memDisown(str);
     return str;
 }
+
+/**
+ * @returns the number of fields in the index at the end of the buffer, or `-1` with `EPROTO` if it has none.
+ */
+int redilon_getFieldCount(redilon_Buffer *buffer)
+{
+    uint32_t table;
+    return findFieldIndex(buffer, &table);
+}
+
+/**
+ * Moves the offset to the field number `field` (`0` is the first one) of a buffer that ends with a field index
+ * (see `redilon_addFieldIndex`), so the next getter reads it. The fields before it are not decoded.
+ *
+ * It checks that the field is of `type` and fits in the buffer, a string with its whole length. A buffer without
+ * an index is only told apart by its last 4 bytes, seek the op codes you know are sent with one.
+ *
+ * @returns 0 on success, -1 with errno `EPROTO` if the buffer has no index or it is malformed, `ERANGE` if there is
+ * no such field and `EINVAL` if it is of another type. The offset is not moved.
+ */
+int redilon_seekField(redilon_Buffer *buffer, uint32_t field, redilon_FieldType type)
+{
+    uint32_t table;
+    int64_t count = findFieldIndex(buffer, &table);
+    if (count == -1)
+        return -1;
+    if (field >= count)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    uint8_t field_type;
+    uint32_t offset;
+    memcpy(&field_type, buffer->stream + table + field, sizeof(uint8_t));
+    memcpy(&offset, buffer->stream + table + count + field * sizeof(uint32_t), sizeof(uint32_t));
+    if (field_type != type)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t size = getFieldSize(type);
+    if (offset > table || size > table - offset)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (type == REDILON_FIELD_STRING)
+    {
+        uint32_t length;
+        memcpy(&length, buffer->stream + offset, sizeof(uint32_t));
+        if (length > table - offset - size)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+    buffer->offset = offset;
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// buckets of the topics hash map when the first topic is created
+#define INITIAL_TOPICS_CAPACITY 64
+// subscribers array of a new topic
+#define INITIAL_SUBSCRIBERS_CAPACITY 4
+
+// private fns
+/**
+ * FNV-1a
+ */
+static uint64_t hashTopic(char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char *c = (unsigned char *)name; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static Topic *findTopic(AsyncLoop *loop, char *name, uint64_t hash)
+{
+    if (loop->topics_capacity == 0)
+        return NULL;
+    for (Topic *topic = loop->topics[hash & (loop->topics_capacity - 1)]; topic != NULL; topic = topic->next)
+        if (topic->hash == hash && strcmp(topic->name, name) == 0)
+            return topic;
+    return NULL;
+}
+
+/**
+ * Doubles the buckets of the topics hash map, it keeps at most one topic per bucket on average.
+ *
+ * @returns `-1` if there is no memory, the map is left as it was.
+ */
+static int growTopics(AsyncLoop *loop)
+{
+    uint32_t capacity = loop->topics_capacity == 0 ? INITIAL_TOPICS_CAPACITY : loop->topics_capacity * 2;
+    Topic **topics = memCalloc(capacity, sizeof(Topic *));
+    if (topics == NULL)
+        return -1;
+    for (uint32_t i = 0; i < loop->topics_capacity; i++)
+    {
+        Topic *topic = loop->topics[i];
+        while (topic != NULL)
+        {
+            Topic *next = topic->next;
+            Topic **bucket = &topics[topic->hash & (capacity - 1)];
+            topic->next = *bucket;
+            *bucket = topic;
+            topic = next;
+        }
+    }
+    memFree(loop->topics);
+    loop->topics = topics;
+    loop->topics_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @returns the topic called `name`, it gets created if nobody is subscribed to it yet. `NULL` if there is no memory.
+ */
+static Topic *getTopic(AsyncLoop *loop, char *name)
+{
+    uint64_t hash = hashTopic(name);
+    Topic *topic = findTopic(loop, name, hash);
+    if (topic != NULL)
+        return topic;
+    if (loop->topics_size >= loop->topics_capacity && growTopics(loop) == -1)
+        return NULL;
+    topic = memCalloc(1, sizeof(Topic));
+    if (topic == NULL)
+        return NULL;
+    topic->name = memStrdup(name);
+    if (topic->name == NULL)
+    {
+        memFree(topic);
+        return NULL;
+    }
+    topic->hash = hash;
+    Topic **bucket = &loop->topics[hash & (loop->topics_capacity - 1)];
+    topic->next = *bucket;
+    *bucket = topic;
+    loop->topics_size++;
+    return topic;
+}
+
+/**
+ * Frees a topic once its last subscriber is gone.
+ */
+static void removeTopic(AsyncLoop *loop, Topic *topic)
+{
+    Topic **bucket = &loop->topics[topic->hash & (loop->topics_capacity - 1)];
+    while (*bucket != topic)
+        bucket = &(*bucket)->next;
+    *bucket = topic->next;
+    loop->topics_size--;
+    memFree(topic->subscribers);
+    memFree(topic->name);
+    memFree(topic);
+}
+
+/**
+ * Takes the subscription out of its topic, the caller takes it out of the connection list.
+ */
+static void removeSubscription(AsyncLoop *loop, Subscription *subscription)
+{
+    Topic *topic = subscription->topic;
+    // the last subscriber takes its place, so leaving doesn't depend on the amount of subscribers
+    Subscription *last = topic->subscribers[--topic->subscribers_size];
+    topic->subscribers[subscription->index] = last;
+    last->index = subscription->index;
+    memFree(subscription);
+    if (topic->subscribers_size == 0)
+        removeTopic(loop, topic);
+}
+
+/**
+ * @returns a pub/sub completion with a copy of `topic`, or `NULL` if there is no memory.
+ */
+static Completion *createTopicCompletion(enum CompletionKind kind, int fd, char *topic)
+{
+    // a worker can only tell its own connection apart from the one that may reuse its fd
+    WorkerJob *job = getCurrentWorkerJob();
+    uint64_t conn_id = job != NULL && kind != COMPLETION_PUBLISH && job->fd == fd ? job->conn_id : 0;
+    Completion *completion = createCompletion(kind, fd, conn_id);
+    if (completion == NULL)
+        return NULL;
+    completion->topic = memStrdup(topic);
+    if (completion->topic == NULL)
+    {
+        freeCompletion(completion);
+        return NULL;
+    }
+    return completion;
+}
+
+/**
+ * Subscribes or unsubscribes from the loop thread, or asks the loop to do it from any other thread.
+ *
+ * @returns `-1` on error
+ */
+static int changeSubscription(redilon_AsyncServerConf *conf, int client_fd, char *topic, int subscribe)
+{
+    AsyncLoop *loop = conf->state;
+    if (loop == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (getCurrentLoop() != loop)
+    {
+        Completion *completion = createTopicCompletion(subscribe ? COMPLETION_SUBSCRIBE : COMPLETION_UNSUBSCRIBE, client_fd, topic);
+        if (completion == NULL)
+            return -1;
+        pushCompletion(loop, completion);
+        return 0;
+    }
+    Connection *conn = getLoopConnection(client_fd);
+    if (conn == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return subscribe ? subscribeConnection(loop, conn, topic) : unsubscribeConnection(loop, conn, topic);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Serializes `packet` into a frame that can be queued to many connections without copying it.
+ *
+ * @returns the frame, with a reference held by the caller, or `NULL` if there is no memory or the body is too big.
+ */
+SharedFrame *createSharedFrame(redilon_Packet *packet)
+{
+    if (packet->buffer->size > REDILON_MAX_BODY_SIZE)
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    SharedFrame *frame = budgetAlloc(sizeof(SharedFrame) + redilon_getPacketSize(packet));
+    if (frame == NULL)
+        return NULL;
+    frame->refs = 1;
+    writeFrame(frame->data, packet);
+    return frame;
+}
+
+void releaseSharedFrame(SharedFrame *frame)
+{
+    if (--frame->refs == 0)
+        memFree(frame);
+}
+
+/**
+ * Subscribes the connection to `topic`, subscribing it twice has no effect.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int subscribeConnection(AsyncLoop *loop, Connection *conn, char *name)
+{
+    Topic *topic = getTopic(loop, name);
+    if (topic == NULL)
+        return -1;
+    // a connection is subscribed to a handful of topics, unlike a topic which may have thousands of subscribers
+    for (Subscription *subscription = conn->subscriptions; subscription != NULL; subscription = subscription->next)
+        if (subscription->topic == topic)
+            return 0;
+
+    Subscription *subscription = memAlloc(sizeof(Subscription));
+    if (subscription != NULL && topic->subscribers_size == topic->subscribers_capacity)
+    {
+        uint32_t capacity = topic->subscribers_capacity == 0 ? INITIAL_SUBSCRIBERS_CAPACITY : topic->subscribers_capacity * 2;
+        Subscription **temp = memRealloc(topic->subscribers, capacity * sizeof(Subscription *));
+        if (temp == NULL)
+        {
+            memFree(subscription);
+            subscription = NULL;
+        }
+        else
+        {
+            topic->subscribers = temp;
+            topic->subscribers_capacity = capacity;
+        }
+    }
+    if (subscription == NULL)
+    {
+        // it was created for this subscription
+        if (topic->subscribers_size == 0)
+            removeTopic(loop, topic);
+        return -1;
+    }
+    subscription->topic = topic;
+    subscription->conn = conn;
+    subscription->index = topic->subscribers_size;
+    topic->subscribers[topic->subscribers_size++] = subscription;
+    subscription->next = conn->subscriptions;
+    conn->subscriptions = subscription;
+    return 0;
+}
+
+/**
+ * Unsubscribes the connection from `topic`, it is fine if it was not subscribed.
+ */
+int unsubscribeConnection(AsyncLoop *loop, Connection *conn, char *name)
+{
+    Topic *topic = findTopic(loop, name, hashTopic(name));
+    if (topic == NULL)
+        return 0;
+    for (Subscription **subscription = &conn->subscriptions; *subscription != NULL; subscription = &(*subscription)->next)
+    {
+        if ((*subscription)->topic != topic)
+            continue;
+        Subscription *found = *subscription;
+        *subscription = found->next;
+        removeSubscription(loop, found);
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Drops every subscription of a connection that is going away.
+ */
+void unsubscribeAll(AsyncLoop *loop, Connection *conn)
+{
+    Subscription *subscription = conn->subscriptions;
+    while (subscription != NULL)
+    {
+        Subscription *next = subscription->next;
+        removeSubscription(loop, subscription);
+        subscription = next;
+    }
+    conn->subscriptions = NULL;
+}
+
+/**
+ * Queues `frame` to every subscriber of `topic` but `exclude_fd`. Takes the caller reference of `frame`.
+ *
+ * @returns the amount of subscribers it was queued to.
+ */
+int publishShared(AsyncLoop *loop, char *name, SharedFrame *frame, size_t size, int exclude_fd)
+{
+    int queued = 0;
+    Topic *topic = findTopic(loop, name, hashTopic(name));
+    for (uint32_t i = 0; topic != NULL && i < topic->subscribers_size; i++)
+    {
+        Connection *conn = topic->subscribers[i]->conn;
+        if (conn->fd == exclude_fd || conn->closing)
+            continue;
+        // a subscriber we are out of memory for misses it, the others still get it
+        if (queueSharedToConnection(conn, frame, size) == 0)
+            queued++;
+    }
+    releaseSharedFrame(frame);
+    return queued;
+}
+
+/**
+ * Frees the topics hash map, the connections must have been freed already.
+ */
+void freeTopics(AsyncLoop *loop)
+{
+    for (uint32_t i = 0; i < loop->topics_capacity; i++)
+        while (loop->topics[i] != NULL)
+        {
+            Topic *topic = loop->topics[i];
+            while (topic->subscribers_size > 0)
+                removeSubscription(loop, topic->subscribers[0]);
+            // the last subscription already took it
+            if (loop->topics[i] == topic)
+                removeTopic(loop, topic);
+        }
+    memFree(loop->topics);
+    loop->topics = NULL;
+    loop->topics_capacity = 0;
+    loop->topics_size = 0;
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Subscribes a client of a running async server to `topic`, it gets every packet published to it with `redilon_publish`
+ * until it unsubscribes or its connection is closed.
+ *
+ * Safe to call from any thread, from outside the loop thread it is applied by the loop later on.
+ *
+ * @returns `-1` on error
+ */
+int redilon_subscribe(redilon_AsyncServerConf *conf, int client_fd, char *topic)
+{
+    return changeSubscription(conf, client_fd, topic, 1);
+}
+
+/**
+ * Unsubscribes a client from `topic`, it is fine if it was not subscribed. Closed connections are unsubscribed from
+ * everything without calling it.
+ *
+ * Safe to call from any thread, from outside the loop thread it is applied by the loop later on.
+ *
+ * @returns `-1` on error
+ */
+int redilon_unsubscribe(redilon_AsyncServerConf *conf, int client_fd, char *topic)
+{
+    return changeSubscription(conf, client_fd, topic, 0);
+}
+
+/**
+ * Sends a packet to every subscriber of `topic` but `exclude_fd` (`-1` to exclude none), e.g the sender of a chat message.
+ * The packet is serialized once and the same frame is queued to all of them, finding the subscribers doesn't depend on
+ * the amount of topics nor clients.
+ *
+ * Safe to call from any thread, from outside the loop thread it is published by the loop later on.
+ *
+ * @returns the amount of subscribers it was queued to (`0` from outside the loop thread) or `-1` if there is an error.
+ */
+int redilon_publish(redilon_AsyncServerConf *conf, char *topic, redilon_Packet *packet, int exclude_fd, int should_free)
+{
+    AsyncLoop *loop = conf->state;
+    size_t size = redilon_getPacketSize(packet);
+    SharedFrame *frame = loop != NULL ? createSharedFrame(packet) : NULL;
+    if (should_free)
+        redilon_freePacket(packet);
+    if (loop == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (frame == NULL)
+        return -1;
+    if (getCurrentLoop() == loop)
+        return publishShared(loop, topic, frame, size, exclude_fd);
+
+    Completion *completion = createTopicCompletion(COMPLETION_PUBLISH, exclude_fd, topic);
+    if (completion == NULL)
+    {
+        memFree(frame);
+        return -1;
+    }
+    // a single allocation, freeing the completion frees it
+    completion->data = frame;
+    completion->size = size;
+    pushCompletion(loop, completion);
+    return 0;
+}
@@ -3,23 +3,271 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 
 // Structures
+/**
+ * Fields recorded by the adders while a field index is being built, see `redilon_startFieldIndex`.
+ */
+typedef struct redilon_FieldIndex redilon_FieldIndex;
+
 typedef struct Buffer
 {
     uint32_t size;
     uint32_t offset;
+    /**
+     * bytes allocated for `stream`, the adders grow it geometrically.
+     */
+    uint32_t capacity;
     void *stream;
+    /**
+     * set between `redilon_startFieldIndex` and `redilon_addFieldIndex`, `NULL` otherwise.
+     */
+    redilon_FieldIndex *index;
+    /**
+     * `stream` as the library allocated it, counted in the memory stats. A stream you malloc'd and set yourself is
+     * not counted until the library grows it.
+     */
+    void *allocated;
 } redilon_Buffer;
 
+/**
+ * Types of the fields in a field index, `redilon_seekField` checks them.
+ */
+typedef enum redilon_FieldType
+{
+    REDILON_FIELD_UINT8 = 1,
+    REDILON_FIELD_UINT32,
+    REDILON_FIELD_UINT64,
+    REDILON_FIELD_STRING,
+} redilon_FieldType;
+
+/**
+ * Last bytes of a body that ends with a field index. The index is `[uint8 type] * count`, `[uint32 offset] * count`,
+ * `[uint32 count]` and this magic.
+ */
+#define REDILON_FIELD_INDEX_MAGIC 0x58444952
+
 typedef struct redilon_Packet
 {
     uint8_t op_code;
     redilon_Buffer *buffer;
-
+    /**
+     * sends the packet with a CRC32C trailer that covers its header and body, the receiver drops the connection
+     * if it doesn't match. Not for streamed frames nor datagrams, udp has a checksum of its own.
+     */
+    uint8_t checksum;
 } redilon_Packet;
 
-typedef void (*redilon_Handler)(uint8_t client_fd, uint8_t operation, redilon_Buffer *buffer, void *args);
+/**
+ * Implementations of the crc32c, see `redilon_setCrc32cImpl`.
+ */
+typedef enum redilon_Crc32cImpl
+{
+    // the fastest one the cpu supports
+    REDILON_CRC32C_BEST,
+    // slicing by 8 tables, any cpu
+    REDILON_CRC32C_PORTABLE,
+    // the SSE4.2 crc32 instruction
+    REDILON_CRC32C_SSE42,
+    // three crc32 streams folded together with PCLMULQDQ
+    REDILON_CRC32C_PCLMUL,
+} redilon_Crc32cImpl;
+
+/**
+ * Shared memory transport between two processes in the same host, see `redilon_createShmChannel`.
+ */
+typedef struct redilon_ShmChannel redilon_ShmChannel;
+
+/**
+ * Datagram transport, see `redilon_createUdpServer`.
+ */
+typedef struct redilon_UdpSocket redilon_UdpSocket;
+
+/**
+ * Reserved op code of the batch frames (see `redilon_createBatch`), handlers never receive it.
+ */
+#define REDILON_BATCH_OP_CODE 0xFF
+
+/**
+ * Largest body of a frame. The top bit of the size field flags a checksum trailer (see `redilon_Packet.checksum`),
+ * and a whole frame, with its header and trailer, must fit in an int. Larger bodies are refused with `EMSGSIZE`.
+ */
+#define REDILON_MAX_BODY_SIZE (INT32_MAX - 9)
+
+/**
+ * Reserved op code of the frames an overloaded async server answers with (see `max_connections`). Its body is the
+ * op code of the request that was turned away, a single uint8, or empty when the whole connection was.
+ */
+#define REDILON_BUSY_OP_CODE 0xFE
+
+typedef void (*redilon_Handler)(int client_fd, uint8_t operation, redilon_Buffer *buffer, void *args);
+
+/**
+ * Counters of the response cache of an async server, see `redilon_getCacheStats`.
+ */
+typedef struct redilon_CacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    // entries dropped to make room for new ones
+    uint64_t evictions;
+    uint32_t entries;
+    // bytes taken by the entries
+    size_t size;
+} redilon_CacheStats;
+
+/**
+ * What a server does with a connection over its `max_connection_memory`, or a frame whose body the memory budget
+ * (`redilon_setMemoryBudget`) has no room for.
+ */
+typedef enum redilon_MemoryPolicy
+{
+    // stops reading the connection until its outbound queue drains, a frame that doesn't fit by itself is rejected
+    REDILON_MEMORY_PAUSE,
+    // answers its frames with a busy frame (`REDILON_BUSY_OP_CODE`), their body is skipped without buffering it
+    REDILON_MEMORY_REJECT,
+    // closes the connection
+    REDILON_MEMORY_CLOSE,
+} redilon_MemoryPolicy;
+
+/**
+ * Memory held by the library, see `redilon_getMemoryStats`.
+ */
+typedef struct redilon_MemoryStats
+{
+    // bytes allocated and not freed yet, the packets you hold included
+    size_t used;
+    // the most `used` has been. Each thread keeps a few hundred KiB of its count to itself, the peak is as coarse
+    size_t peak;
+    // bytes reserved for the stacks of the threads the library started, they are counted in `used` too
+    size_t thread_stacks;
+    // `0` when there is none
+    size_t budget;
+    // allocations refused because they would have gone over the budget
+    uint64_t refused;
+} redilon_MemoryStats;
+
+/**
+ * First bytes of a capture file, see `redilon_startCapture`.
+ */
+#define REDILON_CAPTURE_MAGIC "RDLNCAP1"
+
+/**
+ * Header of a capture file, its records follow right after it.
+ */
+typedef struct redilon_CaptureHeader
+{
+    char magic[8];
+    // wall clock time the capture started at, in nanoseconds since the epoch
+    uint64_t started_at;
+    // frames in the file, and frames that didn't fit in it
+    uint64_t frames;
+    uint64_t dropped;
+} redilon_CaptureHeader;
+
+/**
+ * A frame in a capture file, followed by its `size` bytes of body. Records are packed back to back in the order
+ * they were reserved, which may differ by a little from the order of `at_ns` across threads.
+ */
+typedef struct __attribute__((packed)) redilon_CaptureRecord
+{
+    // nanoseconds since the capture started
+    uint64_t at_ns;
+    // unique across the process for as long as it runs, the frames of the same connection share it. Never `0`, the
+    // ones of the sockets read with `redilon_read` have the top bit set
+    uint64_t conn_id;
+    uint8_t op_code;
+    uint32_t size;
+} redilon_CaptureRecord;
+
+/**
+ * gets fired with each piece of a streamed frame, in order, as it arrives.
+ *
+ * @param offset position of the chunk in the frame body, `0` for the first one.
+ * @param total_size size of the whole frame body, it's the last chunk when `offset + chunk_size == total_size`.
+ */
+typedef void (*redilon_ChunkHandler)(int client_fd, uint8_t operation, void *chunk, uint32_t chunk_size, uint32_t offset, uint32_t total_size, void *args);
+
+/**
+ * A server the frames of a relay are forwarded to, see `route` in `redilon_OnDemandServerConf`.
+ */
+typedef struct redilon_RelayBackend
+{
+    char *host;
+    // `NULL` makes `host` the path of a unix socket
+    char *port;
+} redilon_RelayBackend;
+
+/**
+ * gets fired with the header of each frame a relayed client sends, before its body is read.
+ *
+ * @param size bytes that follow the header, the checksum trailer included.
+ * @returns the index of the backend in `backends`, or `-1` to turn the frame away with a busy frame.
+ */
+typedef int (*redilon_RouteHandler)(int client_fd, uint8_t operation, uint32_t size, void *args);
+
+/**
+ * Tuning applied to the sockets created by the library, a `0` leaves the kernel default.
+ *
+ * use `redilon_getDefaultSocketOptions` to start from the default profile.
+ */
+typedef struct redilon_SocketOptions
+{
+    /**
+     * disables Nagle's algorithm (`TCP_NODELAY`) so small frames are not delayed waiting for acks.
+     */
+    int no_delay;
+    /**
+     * `SO_REUSEADDR`, lets a restarted server bind the port while old connections are in TIME_WAIT.
+     */
+    int reuse_addr;
+    /**
+     * `SO_REUSEPORT`, lets several sockets bind the same port and the kernel balances the connections among them.
+     */
+    int reuse_port;
+    /**
+     * `SO_KEEPALIVE`, detects dead peers on idle connections.
+     */
+    int keep_alive;
+    /**
+     * `SO_SNDBUF` in bytes.
+     */
+    int send_buffer_size;
+    /**
+     * `SO_RCVBUF` in bytes.
+     */
+    int recv_buffer_size;
+    /**
+     * `SO_BUSY_POLL` and `SO_PREFER_BUSY_POLL`, a blocked read polls the device queue for this many microseconds
+     * instead of sleeping until the interrupt. Accepted connections inherit it from the listener.
+     * Trades cpu for latency, it needs `CAP_NET_ADMIN` and is ignored without it.
+     *
+     * `0` disables it.
+     */
+    int busy_poll_us;
+    /**
+     * clients only, gives up connecting after this many milliseconds (`ETIMEDOUT`) even if some addresses were not tried.
+     *
+     * `0` waits for the kernel to give up on each address.
+     */
+    int connect_timeout_ms;
+    /**
+     * clients only, the addresses a host resolves to are reused for this many seconds by the following connections.
+     * They are resolved again earlier if none of them connects, or after `redilon_flushResolverCache`.
+     *
+     * `0` resolves the host on every connection, the default options set it to 30.
+     */
+    int resolve_ttl_secs;
+} redilon_SocketOptions;
 
 typedef struct redilon_AsyncServerConf
 {
@@ -45,6 +293,167 @@ typedef struct redilon_AsyncServerConf
      * gets fired whenever a client makes the initial connection to the socket.
      */
     void (*onNewConnection)(int client_fd, void *args);
+    /**
+     * max connections accepted per loop iteration, the rest wait until the connected clients have been served.
+     *
+     * `0` defaults to 64.
+     */
+    int accept_budget;
+    /**
+     * registers the listener with `EPOLLEXCLUSIVE`.
+     * Set it when several loops (threads or processes) accept on the same `server_fd`, so a new connection wakes up only one of them.
+     */
+    int exclusive_accept;
+    /**
+     * sets `TCP_DEFER_ACCEPT` on the listener, connections are not accepted until the client sends data or the timeout (in seconds) expires.
+     *
+     * `0` disables it.
+     */
+    int defer_accept_secs;
+    /**
+     * frames bigger than this many bytes are not buffered, their body is passed to `onChunk` in `chunk_size` pieces as it arrives.
+     * Bounds the memory a single frame can take, `requestHandler` does not get called for them.
+     */
+    uint32_t stream_threshold;
+    /**
+     * size of the pieces passed to `onChunk`, all of them but the last one have exactly this size.
+     *
+     * `0` defaults to 64KiB.
+     */
+    uint32_t chunk_size;
+    /**
+     * gets fired with each piece of the frames bigger than `stream_threshold`, pass NULL to disable streaming.
+     */
+    redilon_ChunkHandler onChunk;
+    /**
+     * amount of worker threads, when set `requestHandler` runs in them instead of in the event loop,
+     * so slow handlers don't hold up the rest of the connections. Their replies are still written by the loop,
+     * in the same order the frames came in.
+     *
+     * `handlersArgs` is shared by the workers, it must be thread safe. `onChunk` always runs in the loop.
+     *
+     * `0` disables it.
+     */
+    int workers;
+    /**
+     * picks the frames that go to the workers, the rest are handled in the loop. Once a frame of a connection is
+     * in a worker the ones that follow go there too until it is done, otherwise their replies could overtake it.
+     *
+     * NULL offloads every frame.
+     */
+    int (*shouldOffload)(uint8_t op_code, void *args);
+    /**
+     * before blocking in `epoll_wait`, keep polling it without a timeout for this many microseconds. Saves the
+     * wake up latency of the loop thread when the next frame comes soon, at the cost of a busy cpu.
+     * Ignored when there is a single cpu online.
+     *
+     * `0` disables it.
+     */
+    int busy_poll_us;
+    /**
+     * bytes read from a single connection per loop iteration. A connection that has more waits for the others
+     * to be served, and is read again in the next iteration, round robin, so a client pipelining lots of frames
+     * can't starve the rest.
+     *
+     * `0` defaults to 256KiB.
+     */
+    uint32_t read_budget;
+    /**
+     * frames handled per connection per loop iteration, checked between reads, so it may go over by the frames
+     * of one read.
+     *
+     * `0` defaults to 256.
+     */
+    uint32_t frame_budget;
+    /**
+     * picks the op codes whose replies are cached, returning for how many milliseconds (`0` to not cache it).
+     * Their requests are keyed on op code and payload: a request that was already answered gets the same reply frames,
+     * without calling `requestHandler`. Only what the handler sends to the requesting client is cached, so pick read
+     * only op codes, and drop the replies that go stale with `redilon_invalidateCache`.
+     *
+     * NULL disables the cache.
+     */
+    uint32_t (*cacheTtl)(uint8_t op_code, void *args);
+    /**
+     * bytes the cached replies may take, the ones that were not hit recently are evicted first.
+     *
+     * `0` defaults to 64MiB.
+     */
+    size_t cache_size;
+    /**
+     * connections beyond this many are turned away as soon as they are accepted, before reading anything from them,
+     * with a busy frame (`REDILON_BUSY_OP_CODE`) or a reset (see `reject_with_reset`). `onNewConnection` does not
+     * get called for them.
+     *
+     * `0` doesn't limit them.
+     */
+    int max_connections;
+    /**
+     * resets the connections over `max_connections` (`SO_LINGER` 0) instead of sending them a busy frame, they
+     * cost the server nothing more and don't leave a socket in TIME_WAIT.
+     */
+    int reject_with_reset;
+    /**
+     * frames handed to the `workers` whose handler has not returned yet, across all the connections. The frames
+     * that would go over it are answered with a busy frame, after the replies to the ones before them, and never
+     * reach the handler.
+     *
+     * `0` doesn't limit them.
+     */
+    int max_in_flight;
+    /**
+     * CoDel for the worker queues: once the frames a worker takes have waited in its queue more than this many
+     * microseconds for a whole `shed_interval_ms`, it answers some of them with a busy frame instead of calling
+     * the handler, more often the longer it lasts, until the wait is back under the target.
+     * Keeps the queues short when the workers can't keep up, so the frames that are handled are handled in time.
+     *
+     * `0` disables it.
+     */
+    uint32_t shed_target_us;
+    /**
+     * how long the wait has to stay over `shed_target_us` before shedding, around the worst round trip time
+     * of the clients.
+     *
+     * `0` defaults to 100ms.
+     */
+    uint32_t shed_interval_ms;
+    /**
+     * cpus the loop thread is pinned to, its buffers are allocated once pinned so they live in the local numa node.
+     *
+     * `loop_cpus_size` `0` leaves it to the scheduler.
+     */
+    int *loop_cpus;
+    int loop_cpus_size;
+    /**
+     * cpus for the `workers`, each one is pinned to a single cpu of the list, round robin.
+     *
+     * `worker_cpus_size` `0` leaves them to the scheduler.
+     */
+    int *worker_cpus;
+    int worker_cpus_size;
+    /**
+     * sets `SO_INCOMING_CPU` on the listener to the first of `loop_cpus`. With one loop per cpu sharing the port
+     * (`reuse_port`), each connection is accepted by the loop of the cpu that handles its interrupts.
+     */
+    int incoming_cpu;
+    /**
+     * bytes a single connection may hold: the body of the frame being received plus its outbound queue (the files
+     * sent with `redilon_sendFile` don't count). What happens past it is up to `memory_policy`.
+     * Bounds what a client that sends big frames, or never reads its replies, costs the server.
+     *
+     * `0` doesn't limit it.
+     */
+    size_t max_connection_memory;
+    /**
+     * what to do with a connection over `max_connection_memory`, or a frame the memory budget has no room for.
+     *
+     * `0` defaults to `REDILON_MEMORY_PAUSE`.
+     */
+    redilon_MemoryPolicy memory_policy;
+    /**
+     * set by the library while the server runs, used by `redilon_stopAsyncServer` to reach it.
+     */
+    void *state;
 } redilon_AsyncServerConf;
 
 typedef struct redilon_OnDemandServerConf
@@ -63,35 +472,245 @@ typedef struct redilon_OnDemandServerConf
      * gets fired whenever a client makes the initial connection to the socket.
      */
     void (*onNewConnection)(int client_fd, void *args);
+    /**
+     * frames bigger than this many bytes are not buffered, their body is passed to `onChunk` in `chunk_size` pieces as it arrives.
+     * Bounds the memory a single frame can take, `requestHandler` does not get called for them.
+     */
+    uint32_t stream_threshold;
+    /**
+     * size of the pieces passed to `onChunk`, all of them but the last one have exactly this size.
+     *
+     * `0` defaults to 64KiB.
+     */
+    uint32_t chunk_size;
+    /**
+     * gets fired with each piece of the frames bigger than `stream_threshold`, pass NULL to disable streaming.
+     */
+    redilon_ChunkHandler onChunk;
+    /**
+     * cpus for the client threads, each one is pinned to a single cpu of the list, round robin.
+     *
+     * `cpus_size` `0` leaves them to the scheduler.
+     */
+    int *cpus;
+    int cpus_size;
+    /**
+     * pins each client thread to the cpu that handles the interrupts of its connection (`SO_INCOMING_CPU`),
+     * when that cpu is in `cpus` or `cpus` is not set.
+     */
+    int incoming_cpu;
+    /**
+     * bytes the body of a frame may take, the frames bigger than it are rejected with a busy frame without buffering
+     * them, or their connection closed with `REDILON_MEMORY_CLOSE`. Each thread reads one frame at a time, so
+     * `REDILON_MEMORY_PAUSE` rejects them too.
+     *
+     * `0` doesn't limit it.
+     */
+    size_t max_connection_memory;
+    redilon_MemoryPolicy memory_policy;
+    /**
+     * stack size of the client threads, they are counted against the memory budget (`redilon_setMemoryBudget`) and
+     * a connection that doesn't fit is turned away with a busy frame.
+     *
+     * `0` leaves the system default (`ulimit -s`, usually 8MiB).
+     */
+    size_t stack_size;
+    /**
+     * relays the connections instead of reading them: each frame goes to the backend `route` picks by its op code, and
+     * the replies of the backends go back to the client. Only the 5 bytes header is parsed, the bodies are forwarded
+     * as they are, in batches of whole frames or with splice(2) when they are big, and no packet is ever built.
+     *
+     * Each client thread opens its own connection to a backend with the first frame routed to it, the client is closed
+     * when any of them closes. The sockets are non-blocking, a side that is slow to read only holds back the frames
+     * going to it, up to 64KiB of them. The replies of different backends may reach the client in a different order
+     * than the requests. `requestHandler`, streaming and `max_connection_memory` do not apply to the relayed connections.
+     */
+    redilon_RouteHandler route;
+    redilon_RelayBackend *backends;
+    int backends_size;
+    /**
+     * set by the library while the server runs, used by `redilon_stopOnDemandServer` to reach it.
+     */
+    void *state;
 } redilon_OnDemandServerConf;
 
 // sockets
 int redilon_read(int fd, redilon_Handler requestHandler, void *args);
+int redilon_readStream(int fd, redilon_Handler requestHandler, redilon_ChunkHandler onChunk, uint32_t stream_threshold, uint32_t chunk_size, void *args);
+int redilon_sendStreamHeader(int fd, uint8_t op_code, uint32_t size);
+int redilon_sendChunk(int fd, void *chunk, uint32_t size);
+void redilon_getDefaultSocketOptions(redilon_SocketOptions *options);
 // server
 int redilon_createTcpServer(char *port, unsigned int queue_size);
+int redilon_createTcpServerWithOptions(char *port, unsigned int queue_size, redilon_SocketOptions *options);
+int redilon_createUnixServer(char *path, unsigned int queue_size);
 int redilon_acceptConnectionsAsync(redilon_AsyncServerConf *conf);
 int redilon_acceptConnectionsOnDemand(redilon_OnDemandServerConf *conf);
+int redilon_stopAsyncServer(redilon_AsyncServerConf *conf, int drain_timeout_ms);
+int redilon_stopOnDemandServer(redilon_OnDemandServerConf *conf, int drain_timeout_ms);
+int redilon_handOffListener(char *path, int server_fd);
+int redilon_takeOverListener(char *path);
 int redilon_sendToClient(int client_fd, redilon_Packet *packet, int should_free);
+int redilon_postToClient(redilon_AsyncServerConf *conf, int client_fd, redilon_Packet *packet, int should_free);
+int redilon_sendFile(int client_fd, uint8_t op_code, int file_fd, off_t offset, uint32_t size);
 void redilon_closeClientConn(int client_fd, int epoll_fd);
+// pub/sub on an async server
+int redilon_subscribe(redilon_AsyncServerConf *conf, int client_fd, char *topic);
+int redilon_unsubscribe(redilon_AsyncServerConf *conf, int client_fd, char *topic);
+int redilon_publish(redilon_AsyncServerConf *conf, char *topic, redilon_Packet *packet, int exclude_fd, int should_free);
+// response cache of an async server
+int redilon_invalidateCache(redilon_AsyncServerConf *conf, int op_code);
+int redilon_invalidateCachedRequest(redilon_AsyncServerConf *conf, redilon_Packet *request);
+int redilon_getCacheStats(redilon_AsyncServerConf *conf, redilon_CacheStats *stats);
+ssize_t redilon_getConnectionMemory(int client_fd);
 // client
 int redilon_connectToTcpServer(char *host, char *port);
+int redilon_connectToTcpServerWithOptions(char *host, char *port, redilon_SocketOptions *options);
+int redilon_connectToUnixServer(char *path);
 int redilon_sendToServer(int server_fd, redilon_Packet *packet, redilon_Handler requestHandler, void *handler_args);
 void redilon_closeServerConn(int server_fd);
+void redilon_flushResolverCache();
+// fd passing (unix sockets)
+int redilon_sendFd(int unix_fd, int fd);
+int redilon_receiveFd(int unix_fd);
+
+// shared memory
+redilon_ShmChannel *redilon_createShmChannel(uint32_t ring_size, int spin_us);
+redilon_ShmChannel *redilon_attachShmChannel(int fd, int spin_us);
+int redilon_getShmChannelFd(redilon_ShmChannel *channel);
+int redilon_sendShm(redilon_ShmChannel *channel, redilon_Packet *packet);
+int redilon_readShm(redilon_ShmChannel *channel, redilon_Handler requestHandler, void *args);
+void redilon_closeShmChannel(redilon_ShmChannel *channel);
+
+// datagrams (udp)
+redilon_UdpSocket *redilon_createUdpServer(char *port, uint32_t datagram_size);
+redilon_UdpSocket *redilon_connectToUdpServer(char *host, char *port, uint32_t datagram_size);
+int redilon_getUdpSocketFd(redilon_UdpSocket *sock);
+int redilon_readDatagrams(redilon_UdpSocket *sock, redilon_Handler requestHandler, void *args);
+struct sockaddr *redilon_getPeerAddress(socklen_t *addr_len);
+int redilon_sendDatagram(redilon_UdpSocket *sock, redilon_Packet *packet, struct sockaddr *addr, socklen_t addr_len);
+int redilon_flushDatagrams(redilon_UdpSocket *sock);
+void redilon_closeUdpSocket(redilon_UdpSocket *sock);
+
+// tracing (make TRACE=1)
+void redilon_setTraceSampling(uint32_t one_in);
+int redilon_dumpTrace(char *path);
+
+// memory accounting
+void redilon_setMemoryBudget(size_t size);
+void redilon_getMemoryStats(redilon_MemoryStats *stats);
+void redilon_free(void *ptr);
+
+// capture
+int redilon_startCapture(char *path, size_t max_size);
+int redilon_stopCapture();
 
 // packets
 redilon_Packet *redilon_createPacket(uint8_t op_code);
 void *redilon_serializePacket(redilon_Packet *packet);
 int redilon_getPacketSize(redilon_Packet *packet);
 void redilon_freePacket(redilon_Packet *packet);
+redilon_Packet *redilon_createBatch();
+int redilon_addPacketToBatch(redilon_Packet *batch, redilon_Packet *packet);
+uint32_t redilon_crc32c(uint32_t crc, const void *data, size_t size);
+int redilon_setCrc32cImpl(redilon_Crc32cImpl impl);
 // add
-int redilon_addUInt8(redilon_Buffer *buffer, uint8_t value);
-int redilon_addUInt32(redilon_Buffer *buffer, uint32_t value);
-int redilon_addUInt64(redilon_Buffer *buffer, uint64_t value);
+int redilon_reserveBuffer(redilon_Buffer *buffer, uint32_t size);
 int redilon_addString(redilon_Buffer *buffer, char *value);
+int redilon_startFieldIndex(redilon_Buffer *buffer);
+int redilon_addFieldIndex(redilon_Buffer *buffer);
+int redilon_recordField(redilon_Buffer *buffer, redilon_FieldType type);
 // get
-uint8_t redilon_getUInt8(redilon_Buffer *buffer);
-uint32_t redilon_getUInt32(redilon_Buffer *buffer);
-uint64_t redilon_getUInt64(redilon_Buffer *buffer);
 char *redilon_getString(redilon_Buffer *buffer);
+int redilon_getFieldCount(redilon_Buffer *buffer);
+int redilon_seekField(redilon_Buffer *buffer, uint32_t field, redilon_FieldType type);
+
+/**
+ * The fixed size fields are coded inline, so a decode loop compiles down to plain loads and stores instead of a call
+ * into the shared library per field. They are `static inline`, each file that includes this header gets its own copy
+ * and the library doesn't export them.
+ *
+ * The adders only leave the fast path when the buffer is out of capacity or a field index is being built.
+ * The getters set errno to `ERANGE` and return `0` if the field overruns the buffer, the offset is not moved.
+ */
+
+static inline int redilon_addUInt8(redilon_Buffer *buffer, uint8_t value)
+{
+    if (buffer->size + sizeof(uint8_t) > buffer->capacity && redilon_reserveBuffer(buffer, sizeof(uint8_t)) == -1)
+        return -1;
+    if (buffer->index != NULL && redilon_recordField(buffer, REDILON_FIELD_UINT8) == -1)
+        return -1;
+    memcpy((char *)buffer->stream + buffer->offset, &value, sizeof(uint8_t));
+    buffer->offset += sizeof(uint8_t);
+    buffer->size += sizeof(uint8_t);
+    return 0;
+}
+
+static inline int redilon_addUInt32(redilon_Buffer *buffer, uint32_t value)
+{
+    if (buffer->size + sizeof(uint32_t) > buffer->capacity && redilon_reserveBuffer(buffer, sizeof(uint32_t)) == -1)
+        return -1;
+    if (buffer->index != NULL && redilon_recordField(buffer, REDILON_FIELD_UINT32) == -1)
+        return -1;
+    memcpy((char *)buffer->stream + buffer->offset, &value, sizeof(uint32_t));
+    buffer->offset += sizeof(uint32_t);
+    buffer->size += sizeof(uint32_t);
+    return 0;
+}
+
+static inline int redilon_addUInt64(redilon_Buffer *buffer, uint64_t value)
+{
+    if (buffer->size + sizeof(uint64_t) > buffer->capacity && redilon_reserveBuffer(buffer, sizeof(uint64_t)) == -1)
+        return -1;
+    if (buffer->index != NULL && redilon_recordField(buffer, REDILON_FIELD_UINT64) == -1)
+        return -1;
+    memcpy((char *)buffer->stream + buffer->offset, &value, sizeof(uint64_t));
+    buffer->offset += sizeof(uint64_t);
+    buffer->size += sizeof(uint64_t);
+    return 0;
+}
+
+static inline uint8_t redilon_getUInt8(redilon_Buffer *buffer)
+{
+    uint8_t value;
+    if (sizeof(uint8_t) > buffer->size - buffer->offset)
+    {
+        errno = ERANGE;
+        return 0;
+    }
+    memcpy(&value, (char *)buffer->stream + buffer->offset, sizeof(uint8_t));
+    buffer->offset += sizeof(uint8_t);
+    return value;
+}
+
+static inline uint32_t redilon_getUInt32(redilon_Buffer *buffer)
+{
+    uint32_t value;
+    if (sizeof(uint32_t) > buffer->size - buffer->offset)
+    {
+        errno = ERANGE;
+        return 0;
+    }
+    memcpy(&value, (char *)buffer->stream + buffer->offset, sizeof(uint32_t));
+    buffer->offset += sizeof(uint32_t);
+    return value;
+}
+
+static inline uint64_t redilon_getUInt64(redilon_Buffer *buffer)
+{
+    uint64_t value;
+    if (sizeof(uint64_t) > buffer->size - buffer->offset)
+    {
+        errno = ERANGE;
+        return 0;
+    }
+    memcpy(&value, (char *)buffer->stream + buffer->offset, sizeof(uint64_t));
+    buffer->offset += sizeof(uint64_t);
+    return value;
+}
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif // redilon_H
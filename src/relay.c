@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdint.h"
+#include "errno.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "sys/socket.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// frames are read in batches this big, the frames read together go out with a single send per destination
+#define RELAY_BUFFER_SIZE (64 * 1024)
+// the rest of a body bigger than this goes through the pipe with splice, smaller ones are cheaper to copy
+#define RELAY_SPLICE_THRESHOLD (16 * 1024)
+// asked for the pipe, the kernel may give a smaller one
+#define RELAY_PIPE_SIZE (1024 * 1024)
+// the client is always the first end, the backends follow in the order of the route
+#define RELAY_CLIENT 0
+// the `target` of an end between two frames
+#define RELAY_NO_FRAME -1
+// the `target` of a frame turned away, its body is dropped
+#define RELAY_DROP -2
+
+/**
+ * The client or one of its backends. Both directions are buffered so that a side that stops reading only holds
+ * back the frames going to it, never the other fds.
+ */
+typedef struct RelayEnd
+{
+    // `-1` while the backend is not connected
+    int fd;
+    // read but not forwarded yet, from `input_offset` to `input_size`
+    uint8_t *input;
+    size_t input_offset;
+    size_t input_size;
+    // end the frame being read goes to, `RELAY_NO_FRAME` between frames or `RELAY_DROP`
+    int target;
+    // the header of the frame is still in `input`, waiting for `target` to take it
+    int routed;
+    size_t body_left;
+    // waiting to be sent, from `output_offset` to `output_size`
+    uint8_t *output;
+    size_t output_offset;
+    size_t output_size;
+    size_t output_capacity;
+    // end whose frame is being written to `output`, the others wait for it so frames never interleave. `-1` if none
+    int writer;
+} RelayEnd;
+
+/**
+ * A client being relayed, owned by its on-demand thread.
+ */
+typedef struct Relay
+{
+    RelayRoute *route;
+    RelayEnd *ends;
+    int ends_size;
+    struct pollfd *fds;
+    // `-1` until a body needs it, or for good when splice is not supported between these sockets
+    int pipe_fds[2];
+    int pipe_size;
+    int splice_failed;
+    // bytes of a body in the pipe, from the end `piped_from` on their way to `piped_to`. They go out before its `output`
+    size_t piped;
+    int piped_from;
+    int piped_to;
+    // an end closed, what is left in the outputs is sent before the relay ends
+    int closing;
+} Relay;
+
+// private fns
+static size_t getBodySize(uint8_t *header)
+{
+    uint32_t size;
+    memcpy(&size, header + sizeof(uint8_t), sizeof(uint32_t));
+    return (size & ~FRAME_CHECKSUM_FLAG) + ((size & FRAME_CHECKSUM_FLAG) ? FRAME_TRAILER_SIZE : 0);
+}
+
+static int openPipe(Relay *relay)
+{
+    if (pipe2(relay->pipe_fds, O_CLOEXEC) == -1)
+    {
+        relay->splice_failed = 1;
+        return -1;
+    }
+    // best effort, a bigger pipe moves more of the body per splice
+    fcntl(relay->pipe_fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    relay->pipe_size = fcntl(relay->pipe_fds[1], F_GETPIPE_SZ);
+    if (relay->pipe_size <= 0)
+        relay->pipe_size = 64 * 1024;
+    return 0;
+}
+
+static int hasOutput(Relay *relay, int index)
+{
+    RelayEnd *end = &relay->ends[index];
+    return end->output_offset < end->output_size || (relay->piped > 0 && relay->piped_to == index);
+}
+
+/**
+ * @returns whether `end` holds enough already, the frames for it wait in the inputs until it sends some.
+ */
+static int isFull(RelayEnd *end)
+{
+    return end->output_size - end->output_offset >= RELAY_BUFFER_SIZE;
+}
+
+/**
+ * @returns `-1` if there was no memory for it.
+ */
+static int appendOutput(RelayEnd *end, uint8_t *data, size_t size)
+{
+    if (end->output_offset == end->output_size)
+        end->output_offset = end->output_size = 0;
+    if (end->output_size + size > end->output_capacity && end->output_offset > 0)
+    {
+        memmove(end->output, end->output + end->output_offset, end->output_size - end->output_offset);
+        end->output_size -= end->output_offset;
+        end->output_offset = 0;
+    }
+    if (end->output_size + size > end->output_capacity)
+    {
+        size_t capacity = end->output_size + size;
+        uint8_t *temp = budgetRealloc(end->output, capacity);
+        if (temp == NULL)
+            return -1;
+        end->output = temp;
+        end->output_capacity = capacity;
+    }
+    memcpy(end->output + end->output_size, data, size);
+    end->output_size += size;
+    return 0;
+}
+
+/**
+ * @returns whether the rest of the body read from `end` would be spliced, if its target had sent what it holds.
+ */
+static int isSpliceable(Relay *relay, RelayEnd *end)
+{
+    return end->target >= 0 && !end->routed && end->input_offset == end->input_size &&
+           end->body_left > RELAY_SPLICE_THRESHOLD && !relay->splice_failed && relay->piped == 0;
+}
+
+/**
+ * @returns whether `index` should be polled for reading.
+ */
+static int canRead(Relay *relay, int index)
+{
+    RelayEnd *end = &relay->ends[index];
+    if (end->fd == -1 || relay->closing || (relay->piped > 0 && relay->piped_from == index))
+        return 0;
+    if (isSpliceable(relay, end) && hasOutput(relay, end->target))
+        return 0;
+    return end->input_size - end->input_offset < RELAY_BUFFER_SIZE;
+}
+
+static int openBackend(RelayRoute *route, int backend, RelayEnd *end)
+{
+    if (end->input == NULL && (end->input = budgetAlloc(RELAY_BUFFER_SIZE)) == NULL)
+        return -1;
+    redilon_RelayBackend *target = &route->backends[backend];
+    int fd = target->port == NULL ? redilon_connectToUnixServer(target->host)
+                                  : redilon_connectToTcpServer(target->host, target->port);
+    if (fd == -1)
+        return -1;
+    if (setNonBlocking(fd) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    end->fd = fd;
+    return 0;
+}
+
+/**
+ * Picks the backend of a frame from the client, connecting to it the first time.
+ *
+ * @returns its end or `RELAY_DROP` if the frame has to be turned away.
+ */
+static int routeFrame(Relay *relay, uint8_t op_code, size_t size)
+{
+    RelayRoute *route = relay->route;
+    int backend = route->handler(relay->ends[RELAY_CLIENT].fd, op_code, size, route->args);
+    if (backend < 0 || backend >= route->backends_size)
+        return RELAY_DROP;
+    RelayEnd *end = &relay->ends[backend + 1];
+    if (end->fd == -1 && openBackend(route, backend, end) == -1)
+        return RELAY_DROP;
+    return backend + 1;
+}
+
+/**
+ * Moves the frames read from `index` to the outputs of the ends they go to, as far as those take them. Only the
+ * headers are parsed, the bodies are copied as they are.
+ *
+ * @returns `1` if anything moved, `0` if not, `-1` if there was no memory for it.
+ */
+static int forwardInput(Relay *relay, int index)
+{
+    RelayEnd *src = &relay->ends[index];
+    size_t start = src->input_offset;
+    while (1)
+    {
+        uint8_t *data = src->input + src->input_offset;
+        size_t available = src->input_size - src->input_offset;
+        if (src->target == RELAY_NO_FRAME)
+        {
+            if (available < FRAME_HEADER_SIZE)
+                break;
+            src->body_left = getBodySize(data);
+            src->target = index == RELAY_CLIENT ? routeFrame(relay, data[0], src->body_left) : RELAY_CLIENT;
+            src->routed = 1;
+        }
+        // a frame turned away is answered with a busy frame, it has to wait for the client output all the same
+        RelayEnd *dst = &relay->ends[src->target == RELAY_DROP ? RELAY_CLIENT : src->target];
+        if (src->routed)
+        {
+            if (dst->writer != -1 || isFull(dst))
+                break;
+            uint8_t frame[BUSY_FRAME_SIZE];
+            int res = src->target == RELAY_DROP ? appendOutput(dst, frame, writeBusyFrame(frame, data[0]))
+                                                : appendOutput(dst, data, FRAME_HEADER_SIZE);
+            if (res == -1)
+                return -1;
+            if (src->target != RELAY_DROP)
+                dst->writer = index;
+            src->routed = 0;
+            src->input_offset += FRAME_HEADER_SIZE;
+            data += FRAME_HEADER_SIZE;
+            available -= FRAME_HEADER_SIZE;
+        }
+        size_t length = available < src->body_left ? available : src->body_left;
+        if (src->target != RELAY_DROP && length > 0)
+        {
+            if (isFull(dst))
+                break;
+            if (appendOutput(dst, data, length) == -1)
+                return -1;
+        }
+        src->input_offset += length;
+        src->body_left -= length;
+        if (src->body_left > 0)
+            break;
+        if (src->target != RELAY_DROP)
+            dst->writer = -1;
+        src->target = RELAY_NO_FRAME;
+    }
+    int moved = src->input_offset != start;
+    if (src->input_offset == src->input_size)
+        src->input_offset = src->input_size = 0;
+    return moved;
+}
+
+/**
+ * Sends what `index` holds, the piped bytes first, as much as its socket takes without blocking.
+ *
+ * @returns `1` if anything was sent, `0` if not, `-1` if it failed.
+ */
+static int flushOutput(Relay *relay, int index)
+{
+    RelayEnd *end = &relay->ends[index];
+    int sent = 0;
+    while (relay->piped > 0 && relay->piped_to == index)
+    {
+        ssize_t out = splice(relay->pipe_fds[0], NULL, end->fd, NULL, relay->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (out == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+        }
+        relay->piped -= out;
+        sent = 1;
+    }
+    while (end->output_offset < end->output_size)
+    {
+        // more of the frame being written is still to come
+        ssize_t out = send(end->fd, end->output + end->output_offset, end->output_size - end->output_offset,
+                           MSG_NOSIGNAL | (end->writer != -1 ? MSG_MORE : 0));
+        if (out == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? sent : -1;
+        }
+        end->output_offset += out;
+        sent = 1;
+    }
+    return sent;
+}
+
+/**
+ * Moves the next part of a body from `index` into the pipe, it never reaches user space. It is sent by
+ * `flushOutput`, the end is not read again before the pipe is empty.
+ *
+ * @returns `-1` if the end is closed or failed.
+ */
+static int spliceInput(Relay *relay, int index)
+{
+    RelayEnd *src = &relay->ends[index];
+    size_t length = src->body_left < (size_t)relay->pipe_size ? src->body_left : (size_t)relay->pipe_size;
+    ssize_t in = splice(src->fd, NULL, relay->pipe_fds[1], NULL, length,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (length < src->body_left ? SPLICE_F_MORE : 0));
+    if (in == 0)
+        return -1;
+    if (in == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        // only the first splice from a socket can fail this way, the body is read with recv instead
+        if (errno == EINVAL)
+        {
+            relay->splice_failed = 1;
+            return 0;
+        }
+        return -1;
+    }
+    relay->piped = in;
+    relay->piped_from = index;
+    relay->piped_to = src->target;
+    src->body_left -= in;
+    if (src->body_left == 0)
+    {
+        // what is written after it is sent after the pipe
+        relay->ends[src->target].writer = -1;
+        src->target = RELAY_NO_FRAME;
+    }
+    return 0;
+}
+
+/**
+ * Reads what `index` has, without blocking.
+ *
+ * @returns `-1` when the end is closed or failed.
+ */
+static int readInput(Relay *relay, int index)
+{
+    RelayEnd *src = &relay->ends[index];
+    if (isSpliceable(relay, src) && !hasOutput(relay, src->target) &&
+        (relay->pipe_fds[0] != -1 || openPipe(relay) == 0))
+        return spliceInput(relay, index);
+    if (src->input_offset > 0)
+    {
+        memmove(src->input, src->input + src->input_offset, src->input_size - src->input_offset);
+        src->input_size -= src->input_offset;
+        src->input_offset = 0;
+    }
+    ssize_t received = recv(src->fd, src->input + src->input_size, RELAY_BUFFER_SIZE - src->input_size, 0);
+    if (received == 0)
+        return -1;
+    if (received == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    src->input_size += received;
+    return 0;
+}
+
+/**
+ * Forwards and sends until nothing moves anymore, a frame that was waiting for an output may go once another
+ * one is done with it or once it sent some.
+ *
+ * @returns `-1` if an end failed or there was no memory.
+ */
+static int pumpRelay(Relay *relay)
+{
+    int moved = 1;
+    while (moved)
+    {
+        moved = 0;
+        for (int i = 0; i < relay->ends_size; i++)
+        {
+            int res = relay->ends[i].input_offset < relay->ends[i].input_size ? forwardInput(relay, i) : 0;
+            if (res == -1)
+                return -1;
+            moved |= res;
+        }
+        // after all the inputs, the frames read together take a single send
+        for (int i = 0; i < relay->ends_size; i++)
+        {
+            int res = hasOutput(relay, i) ? flushOutput(relay, i) : 0;
+            if (res == -1)
+                return -1;
+            moved |= res;
+        }
+    }
+    return 0;
+}
+
+static int hasAnyOutput(Relay *relay)
+{
+    for (int i = 0; i < relay->ends_size; i++)
+        if (hasOutput(relay, i))
+            return 1;
+    return 0;
+}
+
+static void closeRelay(Relay *relay)
+{
+    // the client fd belongs to the caller
+    for (int i = 1; relay->ends != NULL && i < relay->ends_size; i++)
+        if (relay->ends[i].fd != -1)
+            close(relay->ends[i].fd);
+    for (int i = 0; relay->ends != NULL && i < relay->ends_size; i++)
+    {
+        memFree(relay->ends[i].input);
+        memFree(relay->ends[i].output);
+    }
+    if (relay->pipe_fds[0] != -1)
+    {
+        close(relay->pipe_fds[0]);
+        close(relay->pipe_fds[1]);
+    }
+    memFree(relay->ends);
+    memFree(relay->fds);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Relays the frames of `client_fd` to the backends picked by `route` and their replies back, until the client or
+ * one of its backends closes the connection. What was already read is sent before returning. The fds are made
+ * non-blocking, a side that stops reading only holds back the frames going to it.
+ *
+ * @returns `-1` if there was no memory for the relay.
+ */
+int relayConnection(int client_fd, RelayRoute *route)
+{
+    Relay relay = {.route = route, .ends_size = route->backends_size + 1, .pipe_fds = {-1, -1}};
+    relay.ends = memCalloc(relay.ends_size, sizeof(RelayEnd));
+    relay.fds = memAlloc(sizeof(struct pollfd) * relay.ends_size);
+    if (relay.ends == NULL || relay.fds == NULL ||
+        (relay.ends[RELAY_CLIENT].input = budgetAlloc(RELAY_BUFFER_SIZE)) == NULL)
+    {
+        closeRelay(&relay);
+        return -1;
+    }
+    for (int i = 0; i < relay.ends_size; i++)
+    {
+        relay.ends[i].fd = -1;
+        relay.ends[i].target = RELAY_NO_FRAME;
+        relay.ends[i].writer = -1;
+    }
+    relay.ends[RELAY_CLIENT].fd = client_fd;
+
+    int res = setNonBlocking(client_fd);
+    while (res != -1 && (res = pumpRelay(&relay)) != -1 && (!relay.closing || hasAnyOutput(&relay)))
+    {
+        // an end with nothing to wait for is left out, a hang up would otherwise wake the poll for nothing
+        for (int i = 0; i < relay.ends_size; i++)
+        {
+            short events = (canRead(&relay, i) ? POLLIN : 0) | (hasOutput(&relay, i) ? POLLOUT : 0);
+            relay.fds[i] = (struct pollfd){.fd = events != 0 ? relay.ends[i].fd : -1, .events = events};
+        }
+        if (poll(relay.fds, relay.ends_size, -1) == -1)
+        {
+            res = errno == EINTR ? 0 : -1;
+            continue;
+        }
+        for (int i = 0; i < relay.ends_size && res != -1; i++)
+        {
+            short revents = relay.fds[i].revents;
+            if ((revents & (POLLOUT | POLLERR | POLLHUP)) && hasOutput(&relay, i))
+                res = flushOutput(&relay, i);
+            // an end that is gone stops the reads, the others still get what is left for them
+            if (res != -1 && (revents & (POLLIN | POLLERR | POLLHUP)) && canRead(&relay, i) &&
+                readInput(&relay, i) == -1)
+                relay.closing = 1;
+        }
+    }
+    closeRelay(&relay);
+    return 0;
+}
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "errno.h"
+#include "string.h"
+#include "signal.h"
+#include "time.h"
+#include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/syscall.h"
+#include "linux/futex.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+#define SHM_MAGIC 0x5244534d
+#define SHM_MIN_RING_SIZE 4096
+// a record this big marks the end of the ring data, the reader jumps to the beginning
+#define SHM_WRAP_RECORD UINT32_MAX
+// how often a blocked side checks that its peer is still alive
+#define SHM_LIVENESS_CHECK_MS 100
+#define CACHE_LINE 64
+
+/**
+ * Single producer single consumer ring. Positions only grow, the index in `data` is `position & (size - 1)`.
+ *
+ * Each record is `[uint32 record size][op_code][buffer size][buffer stream]` padded to 8 bytes, so the frames use the same format as the sockets.
+ */
+typedef struct ShmRing
+{
+    // written by the producer
+    _Alignas(CACHE_LINE) _Atomic uint64_t write_pos;
+    // written by the consumer
+    _Alignas(CACHE_LINE) _Atomic uint64_t read_pos;
+    // futex words, bumped when the other side has to be woken up
+    _Alignas(CACHE_LINE) _Atomic uint32_t data_seq;
+    _Atomic uint32_t data_waiters;
+    _Alignas(CACHE_LINE) _Atomic uint32_t space_seq;
+    _Atomic uint32_t space_waiters;
+} ShmRing;
+
+typedef struct ShmSegment
+{
+    uint32_t magic;
+    uint32_t ring_size;
+    _Atomic uint32_t closed;
+    _Atomic pid_t pids[2];
+    ShmRing rings[2];
+} ShmSegment;
+
+struct redilon_ShmChannel
+{
+    int fd;
+    int spin_us;
+    ShmSegment *segment;
+    size_t segment_size;
+    // copied from the segment once it was checked, the peer could rewrite the one in there
+    uint32_t ring_size;
+    // creator = 0, the one that attaches = 1. Each side writes into rings[side] and reads from the other one
+    int side;
+    ShmRing *tx;
+    ShmRing *rx;
+    char *tx_data;
+    char *rx_data;
+};
+
+// channel being read in this thread, lets `redilon_sendToClient` reply through it from the handlers
+static __thread redilon_ShmChannel *currentChannel = NULL;
+
+// private fns
+static uint64_t alignRecord(uint64_t size)
+{
+    return (size + 7) & ~(uint64_t)7;
+}
+
+static size_t getSegmentSize(uint32_t ring_size)
+{
+    size_t header = (sizeof(ShmSegment) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    return header + 2 * (size_t)ring_size;
+}
+
+static uint64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int peerAlive(redilon_ShmChannel *channel)
+{
+    pid_t peer = atomic_load(&channel->segment->pids[1 - channel->side]);
+    if (atomic_load(&channel->segment->closed))
+        return 0;
+    return peer == 0 || kill(peer, 0) == 0 || errno != ESRCH;
+}
+
+static void wake(_Atomic uint32_t *seq, _Atomic uint32_t *waiters)
+{
+    // pairs with the fence in `waitFor`: either the waiter sees the new position or we see the waiter
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0)
+        return;
+    atomic_fetch_add(seq, 1);
+    syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/**
+ * Waits until `*pos` moves away from `value`. Spins for `spin_us` first, then sleeps on the futex.
+ *
+ * @returns `-1` if the channel got closed or the peer died.
+ */
+static int waitFor(redilon_ShmChannel *channel, _Atomic uint64_t *pos, uint64_t value, _Atomic uint32_t *seq, _Atomic uint32_t *waiters)
+{
+    if (channel->spin_us > 0)
+    {
+        uint64_t deadline = nowUs() + channel->spin_us;
+        do
+        {
+            for (int i = 0; i < 64; i++)
+            {
+                if (atomic_load_explicit(pos, memory_order_acquire) != value)
+                    return 0;
+                cpuRelax();
+            }
+        } while (nowUs() < deadline);
+    }
+
+    struct timespec timeout = {.tv_sec = 0, .tv_nsec = SHM_LIVENESS_CHECK_MS * 1000000L};
+    while (atomic_load_explicit(pos, memory_order_acquire) == value)
+    {
+        if (!peerAlive(channel))
+            return -1;
+        atomic_fetch_add(waiters, 1);
+        uint32_t current = atomic_load(seq);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(pos, memory_order_acquire) == value)
+            syscall(SYS_futex, seq, FUTEX_WAIT, current, &timeout, NULL, 0);
+        atomic_fetch_sub(waiters, 1);
+    }
+    return 0;
+}
+
+static redilon_ShmChannel *mapChannel(int fd, uint32_t ring_size, int side, int spin_us)
+{
+    size_t segment_size = getSegmentSize(ring_size);
+    // the mapping is counted by each process that maps it
+    if (reserveMemory(segment_size) == -1)
+        return NULL;
+    redilon_ShmChannel *channel = memAlloc(sizeof(redilon_ShmChannel));
+    void *addr = channel != NULL ? mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (addr == MAP_FAILED)
+    {
+        memFree(channel);
+        releaseMemory(segment_size);
+        return NULL;
+    }
+    channel->fd = fd;
+    // with a single cpu spinning only delays the peer we are waiting for
+    channel->spin_us = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin_us : 0;
+    channel->segment = addr;
+    channel->segment_size = segment_size;
+    channel->ring_size = ring_size;
+    channel->side = side;
+    channel->tx = &channel->segment->rings[side];
+    channel->rx = &channel->segment->rings[1 - side];
+    char *data = (char *)addr + getSegmentSize(0);
+    channel->tx_data = data + (size_t)side * ring_size;
+    channel->rx_data = data + (size_t)(1 - side) * ring_size;
+    return channel;
+}
+
+/**
+ * Copies `size` bytes into the ring at `pos`, the caller makes sure they don't cross the end.
+ */
+static void writeRing(redilon_ShmChannel *channel, uint64_t pos, void *src, size_t size)
+{
+    memcpy(channel->tx_data + (pos & (channel->ring_size - 1)), src, size);
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns the channel being read in this thread if `fd` belongs to it, `NULL` otherwise.
+ */
+redilon_ShmChannel *getCurrentShmChannel(int fd)
+{
+    if (currentChannel == NULL || currentChannel->fd != fd)
+        return NULL;
+    return currentChannel;
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Creates a shared memory channel, a pair of lock-free single producer single consumer rings in a memfd segment.
+ *
+ * The other process attaches to it with `redilon_attachShmChannel`, pass it the fd from `redilon_getShmChannelFd`
+ * through `redilon_sendFd` or by inheritance (fork).
+ *
+ * @param ring_size size in bytes of each direction ring, rounded up to a power of two.
+ * @param spin_us microseconds to busy-poll before sleeping on a futex when there is nothing to read, `0` never spins.
+ * @returns the channel or `NULL` on error.
+ */
+redilon_ShmChannel *redilon_createShmChannel(uint32_t ring_size, int spin_us)
+{
+    if (ring_size > (1u << 31))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t size = SHM_MIN_RING_SIZE;
+    while (size < ring_size)
+        size <<= 1;
+
+    int fd = memfd_create("redilon-shm", MFD_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    size_t segment_size = getSegmentSize(size);
+    if (ftruncate(fd, segment_size) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+    // the segment is zeroed by ftruncate, we only need the header
+    ShmSegment header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SHM_MAGIC;
+    header.ring_size = size;
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    redilon_ShmChannel *channel = mapChannel(fd, size, 0, spin_us);
+    if (channel == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    atomic_store(&channel->segment->pids[0], getpid());
+    return channel;
+}
+
+/**
+ * Attaches to a channel created with `redilon_createShmChannel`, the channel takes ownership of `fd`.
+ *
+ * @returns the channel or `NULL` on error, with `EINVAL` if `fd` is not a channel segment or its header is corrupt.
+ */
+redilon_ShmChannel *redilon_attachShmChannel(int fd, int spin_us)
+{
+    ShmSegment header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != SHM_MAGIC || fstat(fd, &st) == -1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    // the rings are indexed by masking, and both of them have to be inside the segment
+    uint32_t ring_size = header.ring_size;
+    if (ring_size < SHM_MIN_RING_SIZE || ring_size > (1u << 31) || (ring_size & (ring_size - 1)) != 0 ||
+        getSegmentSize(ring_size) > (size_t)st.st_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    redilon_ShmChannel *channel = mapChannel(fd, ring_size, 1, spin_us);
+    if (channel == NULL)
+        return NULL;
+    atomic_store(&channel->segment->pids[1], getpid());
+    return channel;
+}
+
+/**
+ * @returns the file descriptor of the segment, it is also the `client_fd` that the handlers receive.
+ */
+int redilon_getShmChannelFd(redilon_ShmChannel *channel)
+{
+    return channel->fd;
+}
+
+/**
+ * Writes the packet into the ring, blocks while the ring is full.
+ *
+ * @returns the packet size or `-1` if there is an error or the peer is gone.
+ */
+int redilon_sendShm(redilon_ShmChannel *channel, redilon_Packet *packet)
+{
+    uint32_t ring_size = channel->ring_size;
+    // checked before the record size is computed, so it can't wrap
+    if (packet->buffer->size > ring_size / 2)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint32_t record_size = sizeof(uint32_t) + redilon_getPacketSize(packet);
+    uint64_t needed = alignRecord(record_size);
+    if (needed > ring_size / 2)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (atomic_load(&channel->segment->closed))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    // we are the only writer of write_pos
+    uint64_t pos = atomic_load_explicit(&channel->tx->write_pos, memory_order_relaxed);
+    uint64_t until_end = ring_size - (pos & (ring_size - 1));
+    uint64_t total = needed + (until_end < needed ? until_end : 0);
+    for (;;)
+    {
+        uint64_t read_pos = atomic_load_explicit(&channel->tx->read_pos, memory_order_acquire);
+        if (ring_size - (pos - read_pos) >= total)
+            break;
+        if (waitFor(channel, &channel->tx->read_pos, read_pos, &channel->tx->space_seq, &channel->tx->space_waiters) == -1)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+
+    if (until_end < needed)
+    {
+        uint32_t wrap = SHM_WRAP_RECORD;
+        writeRing(channel, pos, &wrap, sizeof(uint32_t));
+        pos += until_end;
+    }
+    writeRing(channel, pos, &record_size, sizeof(uint32_t));
+    writeFrame(channel->tx_data + ((pos + sizeof(uint32_t)) & (ring_size - 1)), packet);
+
+    atomic_store_explicit(&channel->tx->write_pos, pos + needed, memory_order_release);
+    wake(&channel->tx->data_seq, &channel->tx->data_waiters);
+    return record_size - sizeof(uint32_t);
+}
+
+/**
+ * Waits for the next packet and calls the `requestHandler` with it, like `redilon_read` does for sockets.
+ * The buffer points straight into the ring, it is only valid until the handler returns.
+ *
+ * Calling `redilon_sendToClient` with the `client_fd` the handler receives replies through this channel.
+ *
+ * @returns `-1` when the channel is closed, or with `EBADMSG` if the frame was checksummed and doesn't match,
+ * the next read goes on with the frame that follows. With `EPROTO` the peer wrote a record that doesn't fit the ring,
+ * the channel can't be read any further.
+ */
+int redilon_readShm(redilon_ShmChannel *channel, redilon_Handler requestHandler, void *args)
+{
+    uint32_t ring_size = channel->ring_size;
+    // we are the only writer of read_pos
+    uint64_t pos = atomic_load_explicit(&channel->rx->read_pos, memory_order_relaxed);
+    uint64_t write_pos;
+    for (;;)
+    {
+        // the peer may have written everything and closed right after, so drain before giving up
+        if (atomic_load_explicit(&channel->rx->write_pos, memory_order_acquire) == pos &&
+            waitFor(channel, &channel->rx->write_pos, pos, &channel->rx->data_seq, &channel->rx->data_waiters) == -1)
+            return -1;
+        write_pos = atomic_load_explicit(&channel->rx->write_pos, memory_order_acquire);
+
+        uint32_t record_size;
+        memcpy(&record_size, channel->rx_data + (pos & (ring_size - 1)), sizeof(uint32_t));
+        if (record_size != SHM_WRAP_RECORD)
+            break;
+        pos += ring_size - (pos & (ring_size - 1));
+    }
+
+    char *record = channel->rx_data + (pos & (ring_size - 1));
+    uint32_t record_size;
+    memcpy(&record_size, record, sizeof(uint32_t));
+
+    // a sender never writes a record bigger than half the ring, nor one that crosses its end
+    if (record_size < sizeof(uint32_t) + FRAME_HEADER_SIZE || record_size > ring_size / 2 ||
+        (pos & (ring_size - 1)) + record_size > ring_size || write_pos - pos < record_size)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    redilon_Buffer buffer;
+    uint8_t op_code;
+    memcpy(&op_code, record + sizeof(uint32_t), sizeof(uint8_t));
+    memcpy(&buffer.size, record + sizeof(uint32_t) + sizeof(uint8_t), sizeof(uint32_t));
+    int checksum = (buffer.size & FRAME_CHECKSUM_FLAG) != 0;
+    buffer.size &= ~FRAME_CHECKSUM_FLAG;
+    if ((uint64_t)sizeof(uint32_t) + FRAME_HEADER_SIZE + buffer.size + (checksum ? FRAME_TRAILER_SIZE : 0) > record_size)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    buffer.offset = 0;
+    buffer.capacity = buffer.size;
+    buffer.index = NULL;
+    buffer.allocated = NULL;
+    buffer.stream = record + sizeof(uint32_t) + FRAME_HEADER_SIZE;
+
+    redilon_ShmChannel *previous = currentChannel;
+    currentChannel = channel;
+    int res = 0;
+    // the record boundaries don't depend on it, only this frame is dropped
+    if (checksum && checkFrame(op_code, buffer.stream, buffer.size) == -1)
+        res = -1;
+    else if (op_code == REDILON_BATCH_OP_CODE)
+        // a malformed batch can only come from a bug in the peer, the rest of the ring is still fine
+        dispatchBatch(channel->fd, buffer.stream, buffer.size, requestHandler, args);
+    else
+    {
+        uint64_t trace_start = TRACE_START();
+        requestHandler(channel->fd, op_code, &buffer, args);
+        TRACE_END("handler", trace_start, channel->fd, op_code);
+    }
+    currentChannel = previous;
+
+    atomic_store_explicit(&channel->rx->read_pos, pos + alignRecord(record_size), memory_order_release);
+    wake(&channel->rx->space_seq, &channel->rx->space_waiters);
+    return res;
+}
+
+/**
+ * Closes the channel, the peer gets `-1` from its reads once it consumed what was already sent.
+ */
+void redilon_closeShmChannel(redilon_ShmChannel *channel)
+{
+    atomic_store(&channel->segment->closed, 1);
+    // wake up anyone blocked on us so they notice
+    for (int i = 0; i < 2; i++)
+    {
+        atomic_fetch_add(&channel->segment->rings[i].data_seq, 1);
+        syscall(SYS_futex, &channel->segment->rings[i].data_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+        atomic_fetch_add(&channel->segment->rings[i].space_seq, 1);
+        syscall(SYS_futex, &channel->segment->rings[i].space_seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    munmap(channel->segment, channel->segment_size);
+    close(channel->fd);
+    releaseMemory(channel->segment_size);
+    memFree(channel);
+}
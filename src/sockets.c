@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "stdlib.h"
+#include "stddef.h"
 #include "stdio.h"
 #include "errno.h"
 #include "string.h"
@@ -6,13 +8,48 @@
 #include "sys/epoll.h"
 #include "unistd.h"
 #include "netdb.h"
+#include "sys/un.h"
+#include "sys/sendfile.h"
 #include "fcntl.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "poll.h"
+#include "time.h"
+#include "signal.h"
+#include "sys/eventfd.h"
+#include "sys/stat.h"
 #include "commons/log.h"
 #include "pthread.h"
+#include "stdatomic.h"
 #include "./redilon.h"
+#include "./internal.h"
+
+// linux 5.11, older headers lack it
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// addresses of a host are reused for this long by the clients using the default options
+#define DEFAULT_RESOLVE_TTL_SECS 30
+// set in the capture ids of the sockets read with `redilon_read`, the ids of `newConnectionId` never reach it
+#define READ_CONNECTION_ID_FLAG ((uint64_t)1 << 63)
+
+static _Atomic uint64_t lastConnectionId = 0;
+// id of the connection the on-demand thread serves, `0` for the sockets read with `redilon_read`
+static __thread uint64_t currentConnectionId = 0;
 
 // private fns
-static int setNonBlocking(int fd)
+/**
+ * @returns the capture id of a socket read with `redilon_read`. It comes from the socket inode, so a new socket that
+ * reuses the fd gets another one.
+ */
+static uint64_t getReadConnectionId(int fd)
+{
+    struct stat st;
+    return READ_CONNECTION_ID_FLAG | (fstat(fd, &st) == 0 ? (uint64_t)st.st_ino : (uint64_t)fd);
+}
+
+int setNonBlocking(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
@@ -20,6 +57,147 @@ static int setNonBlocking(int fd)
     return 0;
 }
 
+/**
+ * Keeps a spare file descriptor around so that we can still drain the backlog when the process runs out of them.
+ *
+ * @returns the reserved fd or `-1` if it could not be opened.
+ */
+int openReserveFd()
+{
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Accepts a client with `accept4`, so the client flags (e.g `SOCK_NONBLOCK`) are set in the same syscall.
+ *
+ * When we hit EMFILE/ENFILE the connection stays in the backlog and the listener keeps being reported as readable.
+ * To avoid spinning on it, we release the reserved fd, accept the connection and close it right away.
+ *
+ * @returns the client file descriptor or `-1` with errno set.
+ */
+int acceptClient(int server_fd, int flags, int *reserve_fd)
+{
+    int client = accept4(server_fd, NULL, NULL, flags | SOCK_CLOEXEC);
+    if (client != -1 || (errno != EMFILE && errno != ENFILE) || *reserve_fd == -1)
+        return client;
+
+    int err = errno;
+    close(*reserve_fd);
+    client = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1)
+        // the backlog may have been emptied meanwhile (EAGAIN)
+        err = errno;
+    else
+        close(client);
+    *reserve_fd = openReserveFd();
+    errno = err;
+    return -1;
+}
+
+/**
+ * Sends the whole `data`, retrying on partial writes. Non-blocking sockets wait until they are writable again.
+ *
+ * @returns the amount of bytes sent or `-1` on error.
+ */
+int sendAll(int fd, void *data, size_t size, int flags)
+{
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t res = send(fd, data + sent, size - sent, flags | MSG_NOSIGNAL);
+        if (res == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        sent += res;
+    }
+    return sent;
+}
+
+/**
+ * @returns `-1` if any of the options could not be set.
+ */
+int applySocketOptions(int fd, redilon_SocketOptions *options)
+{
+    int on = 1;
+    if (options->reuse_addr && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+        return -1;
+    if (options->reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+        return -1;
+    if (options->keep_alive && setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1)
+        return -1;
+    // buffer sizes must be set before listen/connect for the tcp window scale to take them into account
+    if (options->send_buffer_size > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer_size, sizeof(int)) == -1)
+        return -1;
+    if (options->recv_buffer_size > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->recv_buffer_size, sizeof(int)) == -1)
+        return -1;
+    if (options->no_delay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+        return -1;
+    // best effort, unprivileged processes can't raise it
+    if (options->busy_poll_us > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options->busy_poll_us, sizeof(int)) == 0)
+        setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+    return 0;
+}
+
+/**
+ * @returns an id no other connection of the process has had, never `0`.
+ */
+uint64_t newConnectionId()
+{
+    return atomic_fetch_add_explicit(&lastConnectionId, 1, memory_order_relaxed) + 1;
+}
+
+/**
+ * Queues a reply to the connection. Takes ownership of `data`.
+ *
+ * @returns `-1` on error
+ */
+static int queueReply(Connection *conn, void *data, size_t size)
+{
+    if (queueToConnection(conn, data, size) == -1)
+        return -1;
+    // the handler running inline for it may have its reply cached
+    if (conn->capture != NULL)
+        captureReply(conn->capture, data, size);
+    return 0;
+}
+
+/**
+ * Sends `data` right away or, from a handler of an async server, queues a copy of it.
+ *
+ * @returns the amount of bytes sent or `-1` on error.
+ */
+static int sendOrQueueCopy(int fd, void *data, size_t size, int flags)
+{
+    Connection *conn = getLoopConnection(fd);
+    WorkerJob *job = getCurrentWorkerJob();
+    if (conn == NULL && job == NULL)
+        return sendAll(fd, data, size, flags);
+
+    void *copy = budgetAlloc(size);
+    if (copy == NULL)
+        return -1;
+    memcpy(copy, data, size);
+    if ((conn != NULL ? queueReply(conn, copy, size) : postData(job, fd, copy, size)) == -1)
+    {
+        memFree(copy);
+        return -1;
+    }
+    return size;
+}
+
 enum SocketType
 {
     CLIENT,
@@ -54,31 +232,346 @@ static struct addrinfo *getAddrInfo(char *host, char *port, enum SocketType type
     return addrInfo;
 }
 
+/**
+ * Fills a unix socket address. A `path` starting with `@` is placed in the abstract namespace (i.e no file gets created).
+ *
+ * @returns the address length or `-1` if the path does not fit.
+ */
+static int getUnixAddr(char *path, struct sockaddr_un *addr)
+{
+    size_t length = strlen(path);
+    if (length == 0 || length >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, length);
+    // abstract addresses start with a null byte and their length is given by the address length, not by a terminator
+    if (path[0] == '@')
+        addr->sun_path[0] = '\0';
+    return offsetof(struct sockaddr_un, sun_path) + length + (path[0] == '@' ? 0 : 1);
+}
+
+/**
+ * Receives exactly `size` bytes, waiting for the rest of them if the socket is non-blocking.
+ *
+ * @param may_be_empty when set, returns `0` if there was nothing to read in a non-blocking socket.
+ * @returns `1` once all the bytes are read, `0` if there was nothing to read or `-1` if the connection was closed or failed.
+ */
+int recvAll(int fd, void *dst, size_t size, int may_be_empty)
+{
+    size_t received = 0;
+    while (received < size)
+    {
+        ssize_t res = recv(fd, dst + received, size - received, 0);
+        if (res == 0)
+            return -1;
+        if (res > 0)
+        {
+            received += res;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (received == 0 && may_be_empty)
+            return 0;
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            return -1;
+    }
+    return 1;
+}
+
+/**
+ * Passes the body of a frame to `onChunk` in `chunk_size` pieces as it arrives, so it never gets buffered whole.
+ *
+ * @returns `-1` if the connection was closed or failed.
+ */
+static int readChunks(int fd, uint8_t op_code, uint32_t size, uint32_t chunk_size, redilon_ChunkHandler onChunk, void *args)
+{
+    void *chunk = budgetAlloc(chunk_size);
+    if (chunk == NULL)
+        return -1;
+    uint32_t offset = 0;
+    while (offset < size)
+    {
+        uint32_t length = size - offset < chunk_size ? size - offset : chunk_size;
+        if (recvAll(fd, chunk, length, 0) != 1)
+        {
+            memFree(chunk);
+            return -1;
+        }
+        onChunk(fd, op_code, chunk, length, offset, size, args);
+        offset += length;
+    }
+    memFree(chunk);
+    return 0;
+}
+
+/**
+ * Skips the body of a frame that can't be buffered and answers it with a busy frame.
+ *
+ * @returns `-1` if the connection was closed or failed.
+ */
+static int rejectBody(int fd, uint8_t op_code, size_t size)
+{
+    uint8_t scratch[4096];
+    while (size > 0)
+    {
+        size_t length = size < sizeof(scratch) ? size : sizeof(scratch);
+        if (recvAll(fd, scratch, length, 0) != 1)
+            return -1;
+        size -= length;
+    }
+    uint8_t frame[BUSY_FRAME_SIZE];
+    return sendAll(fd, frame, writeBusyFrame(frame, op_code), 0) == -1 ? -1 : 0;
+}
+
+/**
+ * `redilon_readStream` that holds at most `max_body` bytes of a body.
+ *
+ * @param max_body `0` doesn't limit it.
+ * @param reject the frames that don't fit, in `max_body` or in the memory budget, are skipped and answered with a
+ * busy frame. Otherwise the read fails and the stream can't be read anymore.
+ * @returns `-1` when client is closed or failed.
+ */
+static int readFrame(int fd, redilon_Handler requestHandler, redilon_ChunkHandler onChunk, uint32_t stream_threshold,
+                     uint32_t chunk_size, size_t max_body, int reject, void *args)
+{
+    // op code and buffer size must always be explicit in the messages
+    uint8_t header[FRAME_HEADER_SIZE];
+    int res = recvAll(fd, header, FRAME_HEADER_SIZE, 1);
+    // no data was sent or connection closed
+    if (res != 1)
+        return res;
+
+    uint8_t op_code;
+    redilon_Buffer buffer;
+    memcpy(&op_code, header, sizeof(uint8_t));
+    memcpy(&buffer.size, header + sizeof(uint8_t), sizeof(uint32_t));
+    int checksum = (buffer.size & FRAME_CHECKSUM_FLAG) != 0;
+    buffer.size &= ~FRAME_CHECKSUM_FLAG;
+    buffer.offset = 0;
+    buffer.capacity = buffer.size;
+    buffer.index = NULL;
+    buffer.allocated = NULL;
+
+    // batches are never streamed, their packets are handled one by one. Nor the checksummed frames, they have to be
+    // checked before anybody sees them
+    if (onChunk != NULL && buffer.size > stream_threshold && op_code != REDILON_BATCH_OP_CODE && !checksum)
+        return readChunks(fd, op_code, buffer.size, chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE, onChunk, args);
+
+    size_t received = buffer.size + (checksum ? FRAME_TRAILER_SIZE : 0);
+    if (max_body > 0 && received > max_body)
+    {
+        errno = EMSGSIZE;
+        buffer.stream = NULL;
+    }
+    else
+        buffer.stream = budgetAlloc(received);
+    if (buffer.stream == NULL && received != 0)
+        return reject ? rejectBody(fd, op_code, received) : -1;
+    if (recvAll(fd, buffer.stream, received, 0) != 1 || (checksum && checkFrame(op_code, buffer.stream, buffer.size) == -1))
+    {
+        memFree(buffer.stream);
+        return -1;
+    }
+    if (isCapturing())
+        captureFrame(currentConnectionId != 0 ? currentConnectionId : getReadConnectionId(fd), op_code, buffer.stream,
+                     buffer.size);
+
+    // everything alright call the requestHandler
+    if (requestHandler != NULL && op_code == REDILON_BATCH_OP_CODE)
+        res = dispatchBatch(fd, buffer.stream, buffer.size, requestHandler, args);
+    else if (requestHandler != NULL)
+    {
+        uint64_t trace_start = TRACE_START();
+        requestHandler(fd, op_code, &buffer, args);
+        TRACE_END("handler", trace_start, fd, op_code);
+    }
+    memFree(buffer.stream);
+    return res == -1 ? -1 : 0;
+}
+
+/**
+ * State of a running on-demand server, shared between the accept loop and the client threads.
+ */
+typedef struct OnDemandState
+{
+    pthread_mutex_t lock;
+    // signaled when the last client thread finishes
+    pthread_cond_t idle;
+    // wakes the accept loop up, written by `redilon_stopOnDemandServer`
+    int wake_fd;
+    volatile sig_atomic_t stop_requested;
+    volatile int drain_timeout_ms;
+    // fds of the connections being served, unordered
+    int *clients;
+    int clients_size;
+    int clients_capacity;
+    // the accept loop gave up waiting, the last client thread frees the state
+    int abandoned;
+} OnDemandState;
+
 struct HandleReadThreadArgs
 {
     int fd;
     void *args;
     void (*onClientClosed)(int client_fd, void *args);
     redilon_Handler requestHandler;
+    uint32_t stream_threshold;
+    uint32_t chunk_size;
+    redilon_ChunkHandler onChunk;
+    size_t max_body;
+    int reject;
+    // reserved in the memory budget, released when the thread is done
+    size_t stack_size;
+    // relay mode when `route.handler` is set
+    RelayRoute route;
+    OnDemandState *state;
 };
 
+static void freeOnDemandState(OnDemandState *state)
+{
+    pthread_mutex_destroy(&state->lock);
+    pthread_cond_destroy(&state->idle);
+    close(state->wake_fd);
+    memFree(state->clients);
+    memFree(state);
+}
+
+/**
+ * @returns `-1` if the client could not be tracked.
+ */
+static int addOnDemandClient(OnDemandState *state, int fd)
+{
+    pthread_mutex_lock(&state->lock);
+    if (state->clients_size == state->clients_capacity)
+    {
+        int capacity = state->clients_capacity == 0 ? 16 : state->clients_capacity * 2;
+        int *clients = memRealloc(state->clients, sizeof(int) * capacity);
+        if (clients == NULL)
+        {
+            pthread_mutex_unlock(&state->lock);
+            return -1;
+        }
+        state->clients = clients;
+        state->clients_capacity = capacity;
+    }
+    state->clients[state->clients_size++] = fd;
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+static void removeOnDemandClient(OnDemandState *state, int fd)
+{
+    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < state->clients_size; i++)
+        if (state->clients[i] == fd)
+        {
+            state->clients[i] = state->clients[--state->clients_size];
+            break;
+        }
+    if (state->clients_size == 0 && state->abandoned)
+    {
+        pthread_mutex_unlock(&state->lock);
+        freeOnDemandState(state);
+        return;
+    }
+    if (state->clients_size == 0)
+        pthread_cond_signal(&state->idle);
+    pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Stops reading from the connected clients and waits for their threads to finish, at most `drain_timeout_ms`.
+ * A handler that is running gets to send its response, the next read of each thread reports the connection as closed.
+ */
+static void drainOnDemandClients(OnDemandState *state)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += state->drain_timeout_ms / 1000;
+    deadline.tv_nsec += (state->drain_timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < state->clients_size; i++)
+        shutdown(state->clients[i], SHUT_RD);
+    int res = 0;
+    while (state->clients_size > 0 && res != ETIMEDOUT)
+        res = pthread_cond_timedwait(&state->idle, &state->lock, &deadline);
+    if (state->clients_size > 0)
+    {
+        // the remaining threads keep using the state, the last one frees it
+        state->abandoned = 1;
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+    pthread_mutex_unlock(&state->lock);
+    freeOnDemandState(state);
+}
+
+/**
+ * Picks the cpu of the thread of a new client, either the one that handles the interrupts of its connection
+ * or the next one of `conf->cpus`.
+ *
+ * @returns the cpu or `-1` to leave the thread to the scheduler.
+ */
+static int getClientCpu(redilon_OnDemandServerConf *conf, int client_fd, int *next_cpu)
+{
+    int incoming;
+    socklen_t length = sizeof(int);
+    if (conf->incoming_cpu && getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &length) == 0 && incoming >= 0)
+    {
+        if (conf->cpus_size == 0)
+            return incoming;
+        for (int i = 0; i < conf->cpus_size; i++)
+            if (conf->cpus[i] == incoming)
+                return incoming;
+    }
+    if (conf->cpus_size == 0)
+        return -1;
+    return conf->cpus[(*next_cpu)++ % conf->cpus_size];
+}
+
 // we are using void* as a parameter, to allow multiple arguments in threads.
 static void handleReadThread(void *_args)
 {
     struct HandleReadThreadArgs *args = _args;
     void *handlerArgs = args->args;
+    currentConnectionId = newConnectionId();
 
     // in the threaded version, to keep the connection alive we need this loop
     // otherwise the thread will die
     int res = 0;
+    // the relay forwards the frames until the connection closes, they are never read here
+    if (args->route.handler != NULL)
+    {
+        relayConnection(args->fd, &args->route);
+        res = -1;
+    }
     // until connection gets closed
     while (res != -1)
     {
-        res = redilon_read(args->fd, args->requestHandler, handlerArgs);
+        res = readFrame(args->fd, args->requestHandler, args->onChunk, args->stream_threshold, args->chunk_size,
+                        args->max_body, args->reject, handlerArgs);
     }
 
+    // before the callback closes the fd, a drain could otherwise shut down whatever reuses its number
+    removeOnDemandClient(args->state, args->fd);
     if (args->onClientClosed != NULL)
         args->onClientClosed(args->fd, handlerArgs);
+    releaseStack(args->stack_size);
+    memFree(args);
 };
 
 /**
@@ -93,35 +586,53 @@ static void handleReadThread(void *_args)
  */
 int redilon_read(int fd, redilon_Handler requestHandler, void *args)
 {
-    redilon_Packet *packet = redilon_createPacket(-1);
-    if (packet == NULL)
-        return 0;
-    // op code and buffer size must always be explicit in the messages
-    int bytes_read;
-    bytes_read = recv(fd, &(packet->op_code), sizeof(uint8_t), 0);
-    bytes_read = recv(fd, &(packet->buffer->size), sizeof(uint32_t), 0);
-    packet->buffer->stream = malloc(packet->buffer->size);
-    if (packet->buffer->size != 0)
-        bytes_read = recv(fd, packet->buffer->stream, packet->buffer->size, 0);
-
-    // no data was sent
-    if (bytes_read == -1)
-        return 0;
-    // connection closed
-    if (bytes_read == 0)
-        return -1;
+    return redilon_readStream(fd, requestHandler, NULL, 0, 0, args);
+};
 
-    // everything alright call the requestHandler
-    requestHandler(fd, packet->op_code, packet->buffer, args);
-    redilon_freePacket(packet);
-    return 0;
+/**
+ * Like `redilon_read`, but frames bigger than `stream_threshold` are passed to `onChunk` in `chunk_size` pieces
+ * as they arrive instead of being buffered whole.
+ *
+ * @param onChunk pass NULL to disable streaming.
+ * @param chunk_size `0` defaults to 64KiB.
+ * @returns `-1` when client is closed, with `EBADMSG` when a checksummed frame doesn't match, or with `ENOMEM` when
+ * the memory budget has no room for the body (its body is left unread, close the connection).
+ */
+int redilon_readStream(int fd, redilon_Handler requestHandler, redilon_ChunkHandler onChunk, uint32_t stream_threshold, uint32_t chunk_size, void *args)
+{
+    return readFrame(fd, requestHandler, onChunk, stream_threshold, chunk_size, 0, 0, args);
 };
 
+/**
+ * Fills `options` with the profile used by `redilon_createTcpServer` and `redilon_connectToTcpServer`:
+ * `TCP_NODELAY` and `SO_REUSEADDR` on, kernel default buffer sizes.
+ */
+void redilon_getDefaultSocketOptions(redilon_SocketOptions *options)
+{
+    memset(options, 0, sizeof(redilon_SocketOptions));
+    options->no_delay = 1;
+    options->reuse_addr = 1;
+    options->resolve_ttl_secs = DEFAULT_RESOLVE_TTL_SECS;
+}
+
 /**
  * Creates a tcp server using sockets.
  * @returns the socket file descriptor or `-1` if it fails.
  */
 int redilon_createTcpServer(char *port, unsigned int queue_size)
+{
+    redilon_SocketOptions options;
+    redilon_getDefaultSocketOptions(&options);
+    return redilon_createTcpServerWithOptions(port, queue_size, &options);
+}
+
+/**
+ * Creates a tcp server and tunes the listening socket with `options`.
+ * Accepted clients inherit the options from the listener.
+ *
+ * @returns the socket file descriptor or `-1` if it fails.
+ */
+int redilon_createTcpServerWithOptions(char *port, unsigned int queue_size, redilon_SocketOptions *options)
 {
     struct addrinfo *addrInfo = getAddrInfo(NULL, port, SERVER);
     if (addrInfo == NULL)
@@ -135,12 +646,13 @@ int redilon_createTcpServer(char *port, unsigned int queue_size)
              and) try the next address. */
     for (addr = addrInfo; addr != NULL; addr = addr->ai_next)
     {
-        fileDescriptor = socket(addr->ai_family, addr->ai_socktype,
+        fileDescriptor = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC,
                                 addr->ai_protocol);
         if (fileDescriptor == -1)
             continue;
 
-        if (bind(fileDescriptor, addr->ai_addr, addr->ai_addrlen) == 0)
+        if (applySocketOptions(fileDescriptor, options) == 0 &&
+            bind(fileDescriptor, addr->ai_addr, addr->ai_addrlen) == 0)
             break; /* Success */
 
         // this means that the we could not bind the socket, so close it and try next one.
@@ -154,116 +666,116 @@ int redilon_createTcpServer(char *port, unsigned int queue_size)
 
     int listening = listen(fileDescriptor, queue_size);
     if (listening == -1)
+    {
+        close(fileDescriptor);
         return -1;
+    }
 
     return fileDescriptor;
 }
 
 /**
- * accept connections using an async non blocking io mechanism with epoll
+ * Creates a unix domain socket server, for peers in the same host it skips the whole tcp/ip stack.
+ * It works with both server mechanisms and uses the same packets.
  *
- * @returns `-1` if there is an error
+ * @param path file system path of the socket or, if it starts with `@`, a name in the abstract namespace.
+ * A stale socket file left in `path` is removed.
+ * @returns the socket file descriptor or `-1` if it fails.
  */
-int redilon_acceptConnectionsAsync(redilon_AsyncServerConf *conf)
+int redilon_createUnixServer(char *path, unsigned int queue_size)
 {
-    // create epoll in edge-triggered mode
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1)
+    struct sockaddr_un addr;
+    int addr_len = getUnixAddr(path, &addr);
+    if (addr_len == -1)
         return -1;
 
-    *conf->epoll_fd = epoll_fd;
-
-    if (setNonBlocking(conf->server_fd) == -1)
-        return -1;
-    struct epoll_event event;
-    memset(&event, 0, sizeof(event));
-    event.data.fd = conf->server_fd;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conf->server_fd, &event) == -1)
+    int fileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fileDescriptor == -1)
         return -1;
+    if (path[0] != '@')
+        unlink(path);
 
-    // creates an array of size max_clients
-    struct epoll_event *events = calloc(conf->max_clients, sizeof(event));
-    for (;;)
+    if (bind(fileDescriptor, (struct sockaddr *)&addr, addr_len) == -1 ||
+        listen(fileDescriptor, queue_size) == -1)
     {
-        int number_fds = epoll_wait(epoll_fd, events, conf->max_clients, -1);
-        if (number_fds == -1)
-        {
-            free(events);
-            return -1;
-        }
+        close(fileDescriptor);
+        return -1;
+    }
 
-        for (int i = 0; i < number_fds; i++)
-        {
-            {
-                // error
-                if ((events[i].events & EPOLLERR) ||
-                    (!(events[i].events & EPOLLIN)))
-                {
-                    continue;
-                }
-                // server socket
-                if (events[i].data.fd == conf->server_fd)
-                {
-                    // call accept as many times as we can
-                    for (;;)
-                    {
-                        struct sockaddr client_addr;
-                        socklen_t client_addrlen = sizeof(client_addr);
-                        int client = accept(conf->server_fd, &client_addr, &client_addrlen);
-                        if (client == -1)
-                        {
-                            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                                // we processed all of the connections
-                                break;
-                            continue;
-                        }
-                        setNonBlocking(client);
-                        event.events = EPOLLIN | EPOLLOUT;
-                        event.data.fd = client;
-                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event);
-                        if (conf->onNewConnection != NULL)
-                            conf->onNewConnection(client, conf->handlersArgs);
-                    };
-                }
-                // handle client
-                else
-                {
-                    int result = redilon_read(events[i].data.fd, conf->requestHandler, conf->handlersArgs);
-                    if (result == -1)
-                    {
-                        if (conf->onConnectionClosed != NULL)
-                            conf->onConnectionClosed(events[i].data.fd, conf->handlersArgs);
-                    }
-                }
-            }
-        }
-    };
-};
+    return fileDescriptor;
+}
 
 /**
  * accept connections using an on-demand mechanism (i.e creates one thread per client)
  *
  * @note there is no limitation on the amount of threads created
  *
- * @returns `-1` if there is an error.
+ * @returns `0` when stopped with `redilon_stopOnDemandServer` or `-1` if there is an error.
  */
 int redilon_acceptConnectionsOnDemand(redilon_OnDemandServerConf *conf)
 {
-    for (;;)
+    OnDemandState *state = memCalloc(1, sizeof(OnDemandState));
+    if (state == NULL)
+        return -1;
+    state->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->idle, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    // the listener is polled together with the wake up fd, so accept must not block
+    if (state->wake_fd == -1 || setNonBlocking(conf->server_fd) == -1)
     {
+        freeOnDemandState(state);
+        return -1;
+    }
+    conf->state = state;
+
+    int reserve_fd = openReserveFd();
+    int next_cpu = 0;
+    struct pollfd fds[2] = {{.fd = conf->server_fd, .events = POLLIN}, {.fd = state->wake_fd, .events = POLLIN}};
+    while (!state->stop_requested)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            conf->state = NULL;
+            drainOnDemandClients(state);
+            if (reserve_fd != -1)
+                close(reserve_fd);
+            errno = err;
+            return -1;
+        }
+        if (!(fds[0].revents & POLLIN))
+            continue;
 
         pthread_t thread;
-        int client;
-        struct sockaddr client_addr;
-        socklen_t client_addrlen = sizeof(client_addr);
-        client = accept(conf->server_fd, &client_addr, &client_addrlen);
+        int client = acceptClient(conf->server_fd, 0, &reserve_fd);
         if (client == -1)
             continue;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        // a size under PTHREAD_STACK_MIN leaves the default one
+        if (conf->stack_size > 0)
+            pthread_attr_setstacksize(&attr, conf->stack_size);
+        // the memory budget has no room for its thread, turned away before it costs us anything else
+        size_t stack_size = reserveStack(&attr);
+        if (stack_size == 0)
+        {
+            pthread_attr_destroy(&attr);
+            rejectConnection(client, 0);
+            continue;
+        }
         // dynamically allocating memory to ensure its memory persists beyond the current iteration
-        struct HandleReadThreadArgs *args = malloc(sizeof(struct HandleReadThreadArgs));
-        if (args == NULL)
+        struct HandleReadThreadArgs *args = memAlloc(sizeof(struct HandleReadThreadArgs));
+        if (args == NULL || addOnDemandClient(state, client) == -1)
         {
+            pthread_attr_destroy(&attr);
+            releaseStack(stack_size);
+            memFree(args);
             close(client);
             continue;
         }
@@ -274,31 +786,226 @@ int redilon_acceptConnectionsOnDemand(redilon_OnDemandServerConf *conf)
         args->requestHandler = conf->requestHandler;
         args->args = conf->args;
         args->onClientClosed = conf->onConnectionClosed;
-        pthread_create(&thread, NULL, (void *)handleReadThread, args);
+        args->stream_threshold = conf->stream_threshold;
+        args->chunk_size = conf->chunk_size;
+        args->onChunk = conf->onChunk;
+        args->max_body = conf->max_connection_memory;
+        args->reject = conf->memory_policy != REDILON_MEMORY_CLOSE;
+        args->stack_size = stack_size;
+        args->route = (RelayRoute){.handler = conf->route, .backends = conf->backends, .backends_size = conf->backends_size, .args = conf->args};
+        args->state = state;
+        int cpu = getClientCpu(conf, client, &next_cpu);
+        // a cpu out of range just leaves the thread to the scheduler
+        if (cpu != -1)
+            setAttrCpus(&attr, &cpu, 1);
+        int res = pthread_create(&thread, &attr, (void *)handleReadThread, args);
+        pthread_attr_destroy(&attr);
+        if (res != 0)
+        {
+            removeOnDemandClient(state, client);
+            releaseStack(stack_size);
+            memFree(args);
+            close(client);
+            continue;
+        }
         pthread_detach(thread);
     };
+
+    conf->state = NULL;
+    drainOnDemandClients(state);
+    if (reserve_fd != -1)
+        close(reserve_fd);
+    return 0;
 };
 
 /**
+ * Stops a running on-demand server gracefully: it stops accepting, lets the handlers that are running finish and
+ * waits at most `drain_timeout_ms` for the client threads, then `redilon_acceptConnectionsOnDemand` returns `0`.
+ *
+ * The listening socket is left open, so it can be handed to another process (see `redilon_handOffListener`).
+ * It is safe to call from a signal handler or from another thread.
+ *
+ * @returns `-1` if the server is not running.
+ */
+int redilon_stopOnDemandServer(redilon_OnDemandServerConf *conf, int drain_timeout_ms)
+{
+    OnDemandState *state = conf->state;
+    if (state == NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    state->drain_timeout_ms = drain_timeout_ms;
+    state->stop_requested = 1;
+    uint64_t value = 1;
+    return write(state->wake_fd, &value, sizeof(value)) == -1 ? -1 : 0;
+}
+
+/**
+ * When called from a handler of a shared memory channel, the reply goes through the channel. From a handler of
+ * `redilon_readDatagrams` it is queued to the sender of the datagram.
+ *
+ * When called from a handler of an async server the packet is queued and written, together with everything else
+ * sent in the same loop iteration, in a single syscall. From a worker the packet is posted to the loop, which writes it.
+ *
+ * To send to a client of an async server from any other thread use `redilon_postToClient`.
+ *
  * @returns `-1` if theres is an error
  */
 int redilon_sendToClient(int client_fd, redilon_Packet *packet, int should_free)
 {
-    int res = send(client_fd, redilon_serializePacket(packet), redilon_getPacketSize(packet), 0);
+    // replying from a handler of a shared memory channel
+    redilon_ShmChannel *channel = getCurrentShmChannel(client_fd);
+    if (channel != NULL)
+    {
+        int res = redilon_sendShm(channel, packet);
+        if (should_free)
+            redilon_freePacket(packet);
+        return res;
+    }
+    // replying to the sender of a datagram
+    redilon_UdpSocket *sock = getCurrentUdpSocket(client_fd);
+    if (sock != NULL)
+    {
+        int size = redilon_getPacketSize(packet);
+        int res = queueUdpReply(sock, packet);
+        if (should_free)
+            redilon_freePacket(packet);
+        return res == -1 ? -1 : size;
+    }
+
+    int size = redilon_getPacketSize(packet);
+    void *serializedPacket = serializeFrame(packet);
     if (should_free)
-        free(packet);
+        redilon_freePacket(packet);
+    if (serializedPacket == NULL)
+        return -1;
+
+    Connection *conn = getLoopConnection(client_fd);
+    if (conn != NULL)
+    {
+        if (queueReply(conn, serializedPacket, size) == -1)
+        {
+            memFree(serializedPacket);
+            return -1;
+        }
+        return size;
+    }
+    // replying from a worker, the loop writes it
+    WorkerJob *job = getCurrentWorkerJob();
+    if (job != NULL)
+    {
+        if (postData(job, client_fd, serializedPacket, size) == -1)
+        {
+            memFree(serializedPacket);
+            return -1;
+        }
+        return size;
+    }
+
+    int res = sendAll(client_fd, serializedPacket, size, 0);
+    memFree(serializedPacket);
     return res;
 }
 
+/**
+ * Sends a frame whose body is `size` bytes of `file_fd` starting at `offset`. The body is moved by the kernel
+ * with `sendfile`, so it is never copied to user space nor held in memory.
+ *
+ * From a handler of an async server the frame goes through the outbound queue, which keeps its own copy of `file_fd`,
+ * so you can close yours right away.
+ *
+ * @returns the frame size or `-1` if there is an error, with `EMSGSIZE` if `size` is over `REDILON_MAX_BODY_SIZE`.
+ */
+int redilon_sendFile(int client_fd, uint8_t op_code, int file_fd, off_t offset, uint32_t size)
+{
+    if (size > REDILON_MAX_BODY_SIZE)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint8_t header[FRAME_HEADER_SIZE];
+    memcpy(header, &op_code, sizeof(uint8_t));
+    memcpy(header + sizeof(uint8_t), &size, sizeof(uint32_t));
+
+    Connection *conn = getLoopConnection(client_fd);
+    WorkerJob *job = getCurrentWorkerJob();
+    if (conn != NULL || job != NULL)
+    {
+        void *queued_header = memAlloc(FRAME_HEADER_SIZE);
+        int queued_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+        if (queued_header == NULL || queued_fd == -1)
+        {
+            memFree(queued_header);
+            if (queued_fd != -1)
+                close(queued_fd);
+            return -1;
+        }
+        memcpy(queued_header, header, FRAME_HEADER_SIZE);
+        int res = conn != NULL ? queueFileToConnection(conn, queued_header, FRAME_HEADER_SIZE, queued_fd, offset, size)
+                               : postFile(job, client_fd, queued_header, FRAME_HEADER_SIZE, queued_fd, offset, size);
+        if (res == -1)
+        {
+            memFree(queued_header);
+            close(queued_fd);
+            return -1;
+        }
+        // files are not cached
+        if (conn != NULL && conn->capture != NULL)
+            conn->capture->failed = 1;
+        return FRAME_HEADER_SIZE + size;
+    }
+
+    // the body comes right after, don't send the header in a segment of its own
+    if (sendAll(client_fd, header, FRAME_HEADER_SIZE, MSG_MORE) == -1)
+        return -1;
+    uint32_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t res = sendfile(client_fd, file_fd, &offset, size - sent);
+        if (res > 0)
+        {
+            sent += res;
+            continue;
+        }
+        // the file is shorter than `size`
+        if (res == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        struct pollfd pfd = {.fd = client_fd, .events = POLLOUT};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+            return -1;
+    }
+    return FRAME_HEADER_SIZE + size;
+}
+
 /**
  * if you are accepting connection `on-demand` then ignore the `epoll_fd` by passing a `-1`
  *
  * if you are using an `async` server, be aware that a connection will be deleted from epoll if all its file descriptors have been closed.
  * So, if you have duplicated a file descriptor via dup(2), dup2(2), fcntl(2) F_DUPFD, or fork(2), then you need to make sure to close all the fds.
  * To prevent this, you should pass the `epoll_fd` to close all connections.
+ *
+ * @note when called from a handler of an async server (or one of its workers), the packets queued for the client are written before closing it.
  */
 void redilon_closeClientConn(int client_fd, int epoll_fd)
 {
+    Connection *conn = getLoopConnection(client_fd);
+    if (conn != NULL)
+    {
+        closeLoopConnection(conn);
+        return;
+    }
+    // the loop closes it after writing what the worker sent before
+    WorkerJob *job = getCurrentWorkerJob();
+    if (job != NULL && postClose(job, client_fd) == 0)
+        return;
     close(client_fd);
     if (epoll_fd != -1)
         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
@@ -309,34 +1016,44 @@ void redilon_closeClientConn(int client_fd, int epoll_fd)
  */
 int redilon_connectToTcpServer(char *host, char *port)
 {
-    struct addrinfo *serverInfo = getAddrInfo(host, port, CLIENT);
-    if (serverInfo == NULL)
-        return -1;
+    redilon_SocketOptions options;
+    redilon_getDefaultSocketOptions(&options);
+    return redilon_connectToTcpServerWithOptions(host, port, &options);
+}
 
-    int fileDescriptor;
-    struct addrinfo *addr;
-    /* getaddrinfo() returns a list of address structures.
-              Try each address until we successfully connect(2).
-              If socket(2) (or connect(2)) fails, we (close the socket
-              and) try the next address. */
-    for (addr = serverInfo; addr != NULL; addr = addr->ai_next)
-    {
-        fileDescriptor = socket(addr->ai_family, addr->ai_socktype,
-                                addr->ai_protocol);
-        if (fileDescriptor == -1)
-            continue;
+/**
+ * Connects to a tcp server tuning the socket with `options`.
+ *
+ * The addresses of `host` are raced (Happy Eyeballs): a connection attempt starts every 250ms, alternating ipv6 and ipv4,
+ * and the first one to connect wins, so an unreachable address doesn't hold up the others for a whole tcp timeout.
+ * They are cached for `options->resolve_ttl_secs`.
+ *
+ * @returns server file descriptor if connection success or `-1` in case of an error.
+ */
+int redilon_connectToTcpServerWithOptions(char *host, char *port, redilon_SocketOptions *options)
+{
+    return connectToHost(host, port, options);
+}
 
-        if (connect(fileDescriptor, addr->ai_addr, addr->ai_addrlen) != -1)
-            break; /* Success */
+/**
+ * @param path same as in `redilon_createUnixServer`.
+ * @returns server file descriptor if connection success or `-1` in case of an error.
+ */
+int redilon_connectToUnixServer(char *path)
+{
+    struct sockaddr_un addr;
+    int addr_len = getUnixAddr(path, &addr);
+    if (addr_len == -1)
+        return -1;
 
+    int fileDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fileDescriptor == -1)
+        return -1;
+    if (connect(fileDescriptor, (struct sockaddr *)&addr, addr_len) == -1)
+    {
         close(fileDescriptor);
-    }
-
-    freeaddrinfo(serverInfo);
-
-    /* No address succeeded */
-    if (addr == NULL)
         return -1;
+    }
 
     return fileDescriptor;
 }
@@ -347,8 +1064,13 @@ int redilon_connectToTcpServer(char *host, char *port)
  */
 int redilon_sendToServer(int server_fd, redilon_Packet *packet, redilon_Handler requestHandler, void *handler_args)
 {
-    int result = send(server_fd, redilon_serializePacket(packet), redilon_getPacketSize(packet), 0);
+    int size = redilon_getPacketSize(packet);
+    void *serializedPacket = serializeFrame(packet);
     redilon_freePacket(packet);
+    if (serializedPacket == NULL)
+        return -1;
+    int result = sendAll(server_fd, serializedPacket, size, 0);
+    memFree(serializedPacket);
     if (requestHandler == NULL || result == -1)
         return result;
     int read = redilon_read(server_fd, requestHandler, handler_args);
@@ -358,4 +1080,162 @@ int redilon_sendToServer(int server_fd, redilon_Packet *packet, redilon_Handler
 void redilon_closeServerConn(int server_fd)
 {
     close(server_fd);
-}
\ No newline at end of file
+}
+
+/**
+ * Passes `fd` to the process at the other end of the unix socket `unix_fd` (`SCM_RIGHTS`), e.g to hand a client connection over.
+ * The receiver gets its own copy, you can close yours once this returns.
+ *
+ * @returns `-1` if there is an error.
+ */
+int redilon_sendFd(int unix_fd, int fd)
+{
+    // at least one byte of real data must travel with the ancillary data
+    char byte = 0;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int res;
+    do
+        res = sendmsg(unix_fd, &msg, MSG_NOSIGNAL);
+    while (res == -1 && errno == EINTR);
+    return res == -1 ? -1 : 0;
+}
+
+/**
+ * Receives a file descriptor sent with `redilon_sendFd`, blocks until it arrives.
+ *
+ * @returns the received file descriptor or `-1` if there is an error or the connection was closed.
+ */
+int redilon_receiveFd(int unix_fd)
+{
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = sizeof(byte)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    int res;
+    do
+        res = recvmsg(unix_fd, &msg, MSG_CMSG_CLOEXEC);
+    while (res == -1 && errno == EINTR);
+    if (res <= 0)
+        return -1;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/**
+ * Hands a listening socket over to the process that calls `redilon_takeOverListener` with the same `path`, for zero downtime restarts.
+ * Blocks until the successor connects. Once this returns, stop the server (e.g `redilon_stopAsyncServer`) and close
+ * your copy, the pending and new connections are accepted by the successor.
+ *
+ * @note an alternative is to create the successor's listener with the `reuse_port` socket option and stop the old server once it is up,
+ * but connections queued in the old listener are lost when it is closed.
+ *
+ * @param path same as in `redilon_createUnixServer`.
+ * @returns `-1` if there is an error.
+ */
+int redilon_handOffListener(char *path, int server_fd)
+{
+    int unix_server = redilon_createUnixServer(path, 1);
+    if (unix_server == -1)
+        return -1;
+    int successor;
+    do
+        successor = accept4(unix_server, NULL, NULL, SOCK_CLOEXEC);
+    while (successor == -1 && errno == EINTR);
+
+    int res = successor == -1 ? -1 : redilon_sendFd(successor, server_fd);
+    int err = errno;
+    if (successor != -1)
+        close(successor);
+    close(unix_server);
+    if (path[0] != '@')
+        unlink(path);
+    errno = err;
+    return res;
+}
+
+/**
+ * Receives the listening socket handed over with `redilon_handOffListener`, pass it to the server as `server_fd`.
+ *
+ * @returns the listening socket or `-1` if there is an error.
+ */
+int redilon_takeOverListener(char *path)
+{
+    int unix_fd = redilon_connectToUnixServer(path);
+    if (unix_fd == -1)
+        return -1;
+    int server_fd = redilon_receiveFd(unix_fd);
+    int err = errno;
+    close(unix_fd);
+    errno = err;
+    return server_fd;
+}
+
+/**
+ * Starts a frame of `size` bytes whose body is sent afterwards in pieces with `redilon_sendChunk`,
+ * so big payloads don't need to be held in memory whole. The chunks must add up to exactly `size` bytes.
+ *
+ * @returns `-1` if there is an error, with `EMSGSIZE` if `size` is over `REDILON_MAX_BODY_SIZE`.
+ */
+int redilon_sendStreamHeader(int fd, uint8_t op_code, uint32_t size)
+{
+    if (size > REDILON_MAX_BODY_SIZE)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint8_t header[FRAME_HEADER_SIZE];
+    memcpy(header, &op_code, sizeof(uint8_t));
+    memcpy(header + sizeof(uint8_t), &size, sizeof(uint32_t));
+    // the body comes right after, don't send the header in a segment of its own
+    return sendOrQueueCopy(fd, header, FRAME_HEADER_SIZE, MSG_MORE);
+}
+
+/**
+ * Sends the next piece of a frame started with `redilon_sendStreamHeader`.
+ * From a handler of an async server the chunk is copied into the outbound queue.
+ *
+ * @returns `-1` if there is an error.
+ */
+int redilon_sendChunk(int fd, void *chunk, uint32_t size)
+{
+    return sendOrQueueCopy(fd, chunk, size, 0);
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "errno.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "sys/syscall.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+#ifdef REDILON_TRACE
+
+// spans kept per thread, the oldest ones get overwritten
+#define TRACE_RING_SIZE 16384
+// rings of exited threads kept until they are dumped, past it new threads take them over anyway
+#define TRACE_MAX_EXITED_RINGS 64
+
+typedef struct TraceSpan
+{
+    // odd while the owner thread is writing it, so a dump can skip torn spans
+    _Atomic uint64_t seq;
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    int fd;
+    int op_code;
+} TraceSpan;
+
+/**
+ * Spans recorded by a single thread. Only the owner writes, so recording takes no locks nor atomic read-modify-writes.
+ */
+typedef struct TraceRing
+{
+    struct TraceRing *next;
+    // the rest of the fields change hands under `rings_lock`
+    pid_t tid;
+    // its thread exited, another one can take it over
+    int exited;
+    // first span of the current owner, the ones before belong to a previous thread
+    uint64_t start_pos;
+    // spans written when it was last dumped
+    uint64_t dumped_pos;
+    _Atomic uint64_t write_pos;
+    TraceSpan spans[TRACE_RING_SIZE];
+} TraceRing;
+
+static _Atomic uint32_t sampling = 1;
+// every ring created, they outlive their threads so their spans can still be dumped. The ones of exited threads are
+// reused by new threads once dumped, or when there are too many of them
+static TraceRing *rings = NULL;
+static int exited_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+// its destructor hands the ring back when the thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread TraceRing *currentRing = NULL;
+static __thread uint32_t sampleCounter = 0;
+
+// private fns
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void releaseRing(void *ring)
+{
+    pthread_mutex_lock(&rings_lock);
+    ((TraceRing *)ring)->exited = 1;
+    exited_rings++;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void createRingKey()
+{
+    pthread_key_create(&ring_key, releaseRing);
+}
+
+/**
+ * @returns a ring of an exited thread that was already dumped, or any of them if there are too many. `NULL` if
+ * there is none to take over. Called with `rings_lock` held.
+ */
+static TraceRing *takeExitedRing()
+{
+    TraceRing *oldest = NULL;
+    for (TraceRing *ring = rings; ring != NULL; ring = ring->next)
+    {
+        if (!ring->exited)
+            continue;
+        if (ring->dumped_pos == atomic_load_explicit(&ring->write_pos, memory_order_relaxed))
+            return ring;
+        // new rings are pushed at the front, the last one is the oldest
+        oldest = ring;
+    }
+    return exited_rings >= TRACE_MAX_EXITED_RINGS ? oldest : NULL;
+}
+
+static TraceRing *getRing()
+{
+    if (currentRing != NULL)
+        return currentRing;
+    pthread_once(&ring_key_once, createRingKey);
+    pthread_mutex_lock(&rings_lock);
+    TraceRing *ring = takeExitedRing();
+    if (ring != NULL)
+    {
+        ring->exited = 0;
+        exited_rings--;
+    }
+    else if ((ring = memCalloc(1, sizeof(TraceRing))) != NULL)
+    {
+        ring->next = rings;
+        rings = ring;
+    }
+    if (ring != NULL)
+    {
+        ring->tid = syscall(SYS_gettid);
+        ring->start_pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+        ring->dumped_pos = ring->start_pos;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    if (ring == NULL)
+        return NULL;
+    // without the key it is just never handed back
+    pthread_setspecific(ring_key, ring);
+    currentRing = ring;
+    return ring;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns the start timestamp of a span or `0` if it is not sampled.
+ */
+uint64_t traceStart()
+{
+    uint32_t one_in = atomic_load_explicit(&sampling, memory_order_relaxed);
+    if (one_in == 0 || ++sampleCounter < one_in)
+        return 0;
+    sampleCounter = 0;
+    return nowNs();
+}
+
+/**
+ * Records a span that started at `start`, returned by `traceStart`, and ends now.
+ *
+ * @param op_code `-1` if the span is not about a single frame.
+ */
+void traceEnd(const char *name, uint64_t start, int fd, int op_code)
+{
+    if (start == 0)
+        return;
+    uint64_t end = nowNs();
+    TraceRing *ring = getRing();
+    if (ring == NULL)
+        return;
+    uint64_t pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    TraceSpan *span = &ring->spans[pos % TRACE_RING_SIZE];
+    atomic_store_explicit(&span->seq, pos * 2 + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    span->name = name;
+    span->start_ns = start;
+    span->end_ns = end;
+    span->fd = fd;
+    span->op_code = op_code;
+    atomic_store_explicit(&span->seq, pos * 2 + 2, memory_order_release);
+    atomic_store_explicit(&ring->write_pos, pos + 1, memory_order_release);
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Records one in `one_in` spans, `0` stops recording. Everything is recorded by default.
+ *
+ * @note only available when the library is built with `make TRACE=1`.
+ */
+void redilon_setTraceSampling(uint32_t one_in)
+{
+    atomic_store(&sampling, one_in);
+}
+
+/**
+ * Writes the spans recorded so far by every thread to `path`, in the Chrome trace event format.
+ * Open it with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * The spans are: `epoll_wait`, `read` (a connection, handlers included), `handler`, `worker queue` (an offloaded frame
+ * waiting for its worker), `send queue` (a frame waiting to be written) and `flush` (writing a connection outbound queue).
+ *
+ * @returns `-1` if there is an error or the library was built without tracing.
+ */
+int redilon_dumpTrace(char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    fprintf(file, "{\"traceEvents\":[");
+    int first = 1;
+    pid_t pid = getpid();
+
+    pthread_mutex_lock(&rings_lock);
+    for (TraceRing *ring = rings; ring != NULL; ring = ring->next)
+    {
+        uint64_t end = atomic_load_explicit(&ring->write_pos, memory_order_acquire);
+        uint64_t begin = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        if (begin < ring->start_pos)
+            begin = ring->start_pos;
+        ring->dumped_pos = end;
+        for (uint64_t pos = begin; pos < end; pos++)
+        {
+            TraceSpan *span = &ring->spans[pos % TRACE_RING_SIZE];
+            if (atomic_load_explicit(&span->seq, memory_order_acquire) != pos * 2 + 2)
+                continue;
+            TraceSpan copy;
+            copy.name = span->name;
+            copy.start_ns = span->start_ns;
+            copy.end_ns = span->end_ns;
+            copy.fd = span->fd;
+            copy.op_code = span->op_code;
+            atomic_thread_fence(memory_order_acquire);
+            // overwritten while we were copying it
+            if (atomic_load_explicit(&span->seq, memory_order_relaxed) != pos * 2 + 2)
+                continue;
+
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"redilon\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d",
+                    first ? "" : ",", copy.name, copy.start_ns / 1000.0, (copy.end_ns - copy.start_ns) / 1000.0, pid, ring->tid, copy.fd);
+            if (copy.op_code != -1)
+                fprintf(file, ",\"op_code\":%d", copy.op_code);
+            fprintf(file, "}}");
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    fprintf(file, "\n]}\n");
+    if (fclose(file) == EOF)
+        return -1;
+    return 0;
+}
+
+#else
+
+void redilon_setTraceSampling(uint32_t one_in)
+{
+}
+
+int redilon_dumpTrace(char *path)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "errno.h"
+#include "string.h"
+#include "unistd.h"
+#include "netdb.h"
+#include "sys/socket.h"
+#include "netinet/in.h"
+#include "netinet/udp.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// max datagrams taken by a single recvmmsg(2) or handed to a single sendmmsg(2)
+#define UDP_BATCH_SIZE 64
+// fits in a 1500 bytes ethernet frame with the ipv6 and udp headers
+#define DEFAULT_DATAGRAM_SIZE 1400
+// the largest udp payload over ipv4, a GSO buffer can't be bigger either
+#define MAX_DATAGRAM_SIZE 65507
+// with GRO a single read can return this many bytes of coalesced datagrams
+#define GRO_BUFFER_SIZE 65535
+// the kernel won't split a GSO send into more segments than this (UDP_MAX_SEGMENTS)
+#define MAX_GSO_SEGMENTS 64
+
+// older libc headers don't have them
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/**
+ * A datagram being filled with packets, its bytes are its slot of `tx_data`.
+ */
+typedef struct OutDatagram
+{
+    struct sockaddr_storage addr;
+    // `0` for a connected socket
+    socklen_t addr_len;
+    uint32_t size;
+} OutDatagram;
+
+struct redilon_UdpSocket
+{
+    int fd;
+    // payload of the datagrams we send, the ones we receive can be as big as the peer made them
+    uint32_t datagram_size;
+    // the kernel segments and coalesces datagrams for us (UDP_SEGMENT, UDP_GRO)
+    int gso;
+    int gro;
+    // one slot per datagram of a recvmmsg call, allocated on the first read
+    uint8_t *rx_data;
+    uint32_t rx_slot_size;
+    struct mmsghdr rx_msgs[UDP_BATCH_SIZE];
+    struct iovec rx_iovs[UDP_BATCH_SIZE];
+    struct sockaddr_storage rx_addrs[UDP_BATCH_SIZE];
+    char rx_control[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(int))];
+    // one slot of `datagram_size` per queued datagram
+    uint8_t *tx_data;
+    OutDatagram tx[UDP_BATCH_SIZE];
+    int tx_size;
+    // sender of the datagram being dispatched
+    struct sockaddr_storage *peer;
+    socklen_t peer_len;
+};
+
+// socket being read in this thread, lets `redilon_sendToClient` reply to the sender and `redilon_getPeerAddress` find it
+static __thread redilon_UdpSocket *currentSocket = NULL;
+
+// private fns
+static redilon_UdpSocket *createUdpSocket(int fd, uint32_t datagram_size)
+{
+    if (datagram_size == 0)
+        datagram_size = DEFAULT_DATAGRAM_SIZE;
+    if (datagram_size > MAX_DATAGRAM_SIZE || datagram_size < FRAME_HEADER_SIZE)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    redilon_UdpSocket *sock = memCalloc(1, sizeof(redilon_UdpSocket));
+    if (sock == NULL)
+        return NULL;
+    sock->tx_data = budgetAlloc((size_t)UDP_BATCH_SIZE * datagram_size);
+    if (sock->tx_data == NULL)
+    {
+        memFree(sock);
+        return NULL;
+    }
+    sock->fd = fd;
+    sock->datagram_size = datagram_size;
+    // it only tells whether the kernel knows the option, the device may still reject it on the first send
+    int segment;
+    socklen_t len = sizeof(segment);
+    sock->gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segment, &len) == 0;
+    int on = 1;
+    sock->gro = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    return sock;
+}
+
+/**
+ * Creates a udp socket for the first address of `host` that works, bound to it or connected to it.
+ *
+ * @returns the socket file descriptor or `-1` on error.
+ */
+static int openUdpSocket(char *host, char *port, int server)
+{
+    struct addrinfo hints;
+    struct addrinfo *addrInfo;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (server)
+        hints.ai_flags = AI_PASSIVE;
+    int status = getaddrinfo(host, port, &hints, &addrInfo);
+    if (status != 0)
+    {
+        errno = status == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *addr = addrInfo; addr != NULL; addr = addr->ai_next)
+    {
+        fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+        if (fd == -1)
+            continue;
+        if ((server ? bind(fd, addr->ai_addr, addr->ai_addrlen) : connect(fd, addr->ai_addr, addr->ai_addrlen)) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrInfo);
+    return fd;
+}
+
+static int isSamePeer(OutDatagram *datagram, struct sockaddr *addr, socklen_t addr_len)
+{
+    return datagram->addr_len == addr_len && (addr_len == 0 || memcmp(&datagram->addr, addr, addr_len) == 0);
+}
+
+/**
+ * Sends the queued datagrams. With GSO, runs of datagrams of the same size to the same peer go down the stack as
+ * a single buffer that is split into datagrams at the end, by the device when it can.
+ *
+ * @returns `-1` on error, the queued datagrams are dropped anyway.
+ */
+static int sendQueued(redilon_UdpSocket *sock)
+{
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    char control[UDP_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    int msgs_size = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < sock->tx_size;)
+    {
+        OutDatagram *first = &sock->tx[i];
+        struct msghdr *msg = &msgs[msgs_size].msg_hdr;
+        msg->msg_name = first->addr_len > 0 ? &first->addr : NULL;
+        msg->msg_namelen = first->addr_len;
+        msg->msg_iov = &iovs[i];
+        // a run ends with a smaller datagram, the kernel takes it as the last segment
+        int run = 1;
+        size_t run_size = first->size;
+        while (sock->gso && i + run < sock->tx_size && run < MAX_GSO_SEGMENTS && sock->tx[i + run - 1].size == first->size &&
+               sock->tx[i + run].size <= first->size && run_size + sock->tx[i + run].size <= MAX_DATAGRAM_SIZE &&
+               isSamePeer(&sock->tx[i + run], (struct sockaddr *)&first->addr, first->addr_len))
+            run_size += sock->tx[i + run++].size;
+        for (int j = 0; j < run; j++)
+        {
+            iovs[i + j].iov_base = sock->tx_data + (size_t)(i + j) * sock->datagram_size;
+            iovs[i + j].iov_len = sock->tx[i + j].size;
+        }
+        msg->msg_iovlen = run;
+        if (run > 1)
+        {
+            msg->msg_control = control[msgs_size];
+            msg->msg_controllen = sizeof(control[msgs_size]);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment_size = first->size;
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(uint16_t));
+        }
+        msgs_size++;
+        i += run;
+    }
+
+    int sent = 0;
+    while (sent < msgs_size)
+    {
+        int res = sendmmsg(sock->fd, msgs + sent, msgs_size - sent, 0);
+        if (res == -1 && errno == EINTR)
+            continue;
+        if (res == -1 && sock->gso && msgs[sent].msg_hdr.msg_iovlen > 1 && (errno == EIO || errno == EINVAL))
+        {
+            // the device can't checksum the segments, from now on the datagrams go one by one
+            sock->gso = 0;
+            // the ones that went out are not sent again
+            int skip = 0;
+            for (int i = 0; i < sent; i++)
+                skip += msgs[i].msg_hdr.msg_iovlen;
+            sock->tx_size -= skip;
+            memmove(sock->tx_data, sock->tx_data + (size_t)skip * sock->datagram_size, (size_t)sock->tx_size * sock->datagram_size);
+            memmove(sock->tx, sock->tx + skip, sock->tx_size * sizeof(OutDatagram));
+            return sendQueued(sock);
+        }
+        if (res == -1)
+        {
+            sock->tx_size = 0;
+            return -1;
+        }
+        sent += res;
+    }
+    sock->tx_size = 0;
+    return 0;
+}
+
+/**
+ * Appends the frames in `data` to the last datagram queued to the peer, or to a new one if they don't fit.
+ *
+ * @returns `-1` on error
+ */
+static int queueFrames(redilon_UdpSocket *sock, void *header, uint32_t header_size, void *body, uint32_t body_size,
+                       struct sockaddr *addr, socklen_t addr_len)
+{
+    uint64_t size = (uint64_t)header_size + body_size;
+    if (size > sock->datagram_size || (size_t)addr_len > sizeof(struct sockaddr_storage))
+    {
+        errno = size > sock->datagram_size ? EMSGSIZE : EINVAL;
+        return -1;
+    }
+    OutDatagram *last = sock->tx_size > 0 ? &sock->tx[sock->tx_size - 1] : NULL;
+    if (last == NULL || !isSamePeer(last, addr, addr_len) || last->size + size > sock->datagram_size)
+    {
+        if (sock->tx_size == UDP_BATCH_SIZE && sendQueued(sock) == -1)
+            return -1;
+        last = &sock->tx[sock->tx_size++];
+        last->addr_len = addr_len;
+        if (addr_len > 0)
+            memcpy(&last->addr, addr, addr_len);
+        last->size = 0;
+    }
+    uint8_t *dst = sock->tx_data + (size_t)(last - sock->tx) * sock->datagram_size + last->size;
+    if (header_size > 0)
+        memcpy(dst, header, header_size);
+    if (body_size > 0)
+        memcpy(dst + header_size, body, body_size);
+    last->size += size;
+    return 0;
+}
+
+static int queuePacket(redilon_UdpSocket *sock, redilon_Packet *packet, struct sockaddr *addr, socklen_t addr_len)
+{
+    // a batch body already is a list of frames, same as a datagram
+    if (packet->op_code == REDILON_BATCH_OP_CODE)
+        return queueFrames(sock, NULL, 0, packet->buffer->stream, packet->buffer->size, addr, addr_len);
+    uint8_t header[FRAME_HEADER_SIZE];
+    memcpy(header, &packet->op_code, sizeof(uint8_t));
+    memcpy(header + sizeof(uint8_t), &packet->buffer->size, sizeof(uint32_t));
+    return queueFrames(sock, header, FRAME_HEADER_SIZE, packet->buffer->stream, packet->buffer->size, addr, addr_len);
+}
+
+static int allocateReceive(redilon_UdpSocket *sock)
+{
+    // a datagram bigger than its slot would be truncated, with GRO a slot holds several of them
+    sock->rx_slot_size = sock->gro ? GRO_BUFFER_SIZE : MAX_DATAGRAM_SIZE;
+    sock->rx_data = budgetAlloc((size_t)UDP_BATCH_SIZE * sock->rx_slot_size);
+    if (sock->rx_data == NULL)
+        return -1;
+    for (int i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        sock->rx_iovs[i].iov_base = sock->rx_data + (size_t)i * sock->rx_slot_size;
+        sock->rx_iovs[i].iov_len = sock->rx_slot_size;
+    }
+    return 0;
+}
+
+/**
+ * @returns the size of the datagrams the kernel coalesced into the message, or the message size if it didn't.
+ */
+static uint32_t getSegmentSize(struct msghdr *msg, uint32_t size)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int segment_size;
+            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(int));
+            return segment_size > 0 ? segment_size : size;
+        }
+    return size;
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * @returns the socket being read in this thread if `fd` belongs to it, `NULL` otherwise.
+ */
+redilon_UdpSocket *getCurrentUdpSocket(int fd)
+{
+    if (currentSocket == NULL || currentSocket->fd != fd)
+        return NULL;
+    return currentSocket;
+}
+
+/**
+ * Queues a reply to the sender of the datagram being dispatched, it is sent once the batch has been dispatched.
+ *
+ * @returns `-1` on error
+ */
+int queueUdpReply(redilon_UdpSocket *sock, redilon_Packet *packet)
+{
+    return queuePacket(sock, packet, (struct sockaddr *)sock->peer, sock->peer_len);
+}
+
+/**
+ *
+ * ============ lib functions ============
+ *
+ **/
+
+/**
+ * Creates a udp socket bound to `port`. There are no connections: each datagram holds one or more packets,
+ * in the same frame format as the streams, and may come from any peer.
+ *
+ * @param datagram_size max payload of the datagrams sent through it, `0` defaults to 1400 bytes so they are not fragmented
+ * on ethernet. A packet bigger than this can't be sent.
+ * @returns the socket or `NULL` on error.
+ */
+redilon_UdpSocket *redilon_createUdpServer(char *port, uint32_t datagram_size)
+{
+    int fd = openUdpSocket(NULL, port, 1);
+    if (fd == -1)
+        return NULL;
+    redilon_UdpSocket *sock = createUdpSocket(fd, datagram_size);
+    if (sock == NULL)
+        close(fd);
+    return sock;
+}
+
+/**
+ * Creates a udp socket connected to `host`, the packets sent with a NULL address go to it and only its datagrams
+ * are received.
+ *
+ * @returns the socket or `NULL` on error.
+ */
+redilon_UdpSocket *redilon_connectToUdpServer(char *host, char *port, uint32_t datagram_size)
+{
+    int fd = openUdpSocket(host, port, 0);
+    if (fd == -1)
+        return NULL;
+    redilon_UdpSocket *sock = createUdpSocket(fd, datagram_size);
+    if (sock == NULL)
+        close(fd);
+    return sock;
+}
+
+/**
+ * @returns the file descriptor of the socket, to poll it. It is also the `client_fd` that the handlers receive.
+ */
+int redilon_getUdpSocketFd(redilon_UdpSocket *sock)
+{
+    return sock->fd;
+}
+
+/**
+ * Waits for datagrams and calls `requestHandler` with each of their packets. Takes up to 64 datagrams with a single
+ * recvmmsg(2), the ones that are already there when the first one arrives.
+ *
+ * Calling `redilon_sendToClient` with the `client_fd` the handler receives replies to the sender of the datagram,
+ * the replies are sent together once every packet has been handled. `redilon_getPeerAddress` returns the sender.
+ *
+ * A malformed datagram is dropped from the bad packet on, the rest are still handled.
+ *
+ * @returns the amount of datagrams read or `-1` on error.
+ */
+int redilon_readDatagrams(redilon_UdpSocket *sock, redilon_Handler requestHandler, void *args)
+{
+    if (sock->rx_data == NULL && allocateReceive(sock) == -1)
+        return -1;
+    for (int i = 0; i < UDP_BATCH_SIZE; i++)
+    {
+        struct msghdr *msg = &sock->rx_msgs[i].msg_hdr;
+        msg->msg_name = &sock->rx_addrs[i];
+        msg->msg_namelen = sizeof(struct sockaddr_storage);
+        msg->msg_iov = &sock->rx_iovs[i];
+        msg->msg_iovlen = 1;
+        msg->msg_control = sock->gro ? sock->rx_control[i] : NULL;
+        msg->msg_controllen = sock->gro ? sizeof(sock->rx_control[i]) : 0;
+        msg->msg_flags = 0;
+    }
+    int received;
+    while ((received = recvmmsg(sock->fd, sock->rx_msgs, UDP_BATCH_SIZE, MSG_WAITFORONE, NULL)) == -1 && errno == EINTR)
+        ;
+    if (received == -1)
+        return -1;
+
+    redilon_UdpSocket *previous = currentSocket;
+    currentSocket = sock;
+    for (int i = 0; i < received; i++)
+    {
+        struct msghdr *msg = &sock->rx_msgs[i].msg_hdr;
+        uint32_t size = sock->rx_msgs[i].msg_len;
+        // it didn't fit in the slot, its last frame is cut
+        if (msg->msg_flags & MSG_TRUNC)
+            continue;
+        sock->peer = &sock->rx_addrs[i];
+        sock->peer_len = msg->msg_namelen;
+        uint32_t segment_size = getSegmentSize(msg, size);
+        uint8_t *data = sock->rx_iovs[i].iov_base;
+        // each of the datagrams coalesced by GRO starts with a frame of its own
+        for (uint32_t offset = 0; offset < size; offset += segment_size)
+        {
+            uint32_t datagram_size = size - offset < segment_size ? size - offset : segment_size;
+            dispatchBatch(sock->fd, data + offset, datagram_size, requestHandler, args);
+        }
+    }
+    sock->peer = NULL;
+    sock->peer_len = 0;
+    currentSocket = previous;
+
+    if (sock->tx_size > 0 && sendQueued(sock) == -1)
+        return -1;
+    return received;
+}
+
+/**
+ * @returns the address of the sender of the datagram being handled, `NULL` outside of the handlers of
+ * `redilon_readDatagrams`. It is only valid until the handler returns.
+ */
+struct sockaddr *redilon_getPeerAddress(socklen_t *addr_len)
+{
+    if (currentSocket == NULL || currentSocket->peer == NULL)
+        return NULL;
+    if (addr_len != NULL)
+        *addr_len = currentSocket->peer_len;
+    return (struct sockaddr *)currentSocket->peer;
+}
+
+/**
+ * Queues a packet to `addr`, packets to the same peer are packed into the same datagram while they fit. The queued
+ * datagrams are sent with a single sendmmsg(2) once 64 of them are queued, or with `redilon_flushDatagrams`.
+ * A batch is sent as its packets.
+ *
+ * @param addr `NULL` for the peer of a connected socket.
+ * @returns `0` or `-1` on error, `EMSGSIZE` if the packet doesn't fit in a datagram.
+ */
+int redilon_sendDatagram(redilon_UdpSocket *sock, redilon_Packet *packet, struct sockaddr *addr, socklen_t addr_len)
+{
+    return queuePacket(sock, packet, addr, addr == NULL ? 0 : addr_len);
+}
+
+/**
+ * Sends the datagrams queued with `redilon_sendDatagram`.
+ *
+ * @returns `-1` on error, the datagrams that were not sent are dropped.
+ */
+int redilon_flushDatagrams(redilon_UdpSocket *sock)
+{
+    if (sock->tx_size == 0)
+        return 0;
+    return sendQueued(sock);
+}
+
+/**
+ * Sends what's queued and closes the socket.
+ */
+void redilon_closeUdpSocket(redilon_UdpSocket *sock)
+{
+    redilon_flushDatagrams(sock);
+    close(sock->fd);
+    memFree(sock->rx_data);
+    memFree(sock->tx_data);
+    memFree(sock);
+}
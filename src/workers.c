@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include "stdlib.h"
+#include "errno.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "./redilon.h"
+#include "./internal.h"
+
+// job whose handler is running in the current thread, lets the send and close functions post completions
+static __thread WorkerJob *currentJob = NULL;
+
+// private fns
+static int64_t nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void freeJobs(WorkerJob *job)
+{
+    while (job != NULL)
+    {
+        WorkerJob *next = job->next;
+        memFree(job->body);
+        memFree(job->capture.frame);
+        memFree(job);
+        job = next;
+    }
+}
+
+/**
+ * @returns a completion of the job connection (or any other) to be filled and pushed, or `NULL` if there is no memory.
+ */
+static Completion *createJobCompletion(WorkerJob *job, enum CompletionKind kind, int fd)
+{
+    // only the connection of the job is guarded against fd reuse, we don't know the id of the others
+    return createCompletion(kind, fd, fd == job->fd ? job->conn_id : 0);
+}
+
+/**
+ * Hands the replies captured from the job handler to the loop, to be cached.
+ */
+static void postCapture(WorkerJob *job)
+{
+    if (job->capture.frame == NULL || job->capture.failed)
+        return;
+    Completion *completion = createCompletion(COMPLETION_CACHE, job->fd, job->conn_id);
+    if (completion == NULL)
+        return;
+    job->capture.frame->refs = 1;
+    completion->data = job->capture.frame;
+    completion->size = job->capture.size;
+    job->capture.frame = NULL;
+    // the request is the key, the job doesn't need it anymore
+    completion->key = job->body;
+    completion->key_size = job->body_size;
+    job->body = NULL;
+    completion->op_code = job->op_code;
+    completion->ttl_ms = job->cache_ttl_ms;
+    completion->cache_generation = job->cache_generation;
+    pushCompletion(job->loop, completion);
+}
+
+/**
+ * Answers the job frame with a busy frame instead of calling the handler.
+ */
+static void postBusy(WorkerJob *job)
+{
+    uint8_t *frame = memAlloc(BUSY_FRAME_SIZE);
+    // the client gets no reply, as if the frame had been lost
+    if (frame == NULL)
+        return;
+    // not a reply worth caching
+    job->cache_ttl_ms = 0;
+    size_t size = writeBusyFrame(frame, job->op_code);
+    if (postData(job, job->fd, frame, size) == -1)
+        memFree(frame);
+}
+
+/**
+ * Calls the handler of the job, unless the worker queue is shedding.
+ */
+static void runJob(Worker *worker, WorkerJob *job)
+{
+    redilon_AsyncServerConf *conf = job->loop->conf;
+    if (job->rejected)
+    {
+        postBusy(job);
+        return;
+    }
+    if (conf->shed_target_us > 0)
+    {
+        int64_t now = nowUs();
+        if (shouldShed(&worker->shed, now - job->offloaded_at, now, conf))
+        {
+            postBusy(job);
+            atomic_fetch_sub(&job->loop->in_flight, 1);
+            return;
+        }
+    }
+
+    redilon_Buffer buffer;
+    buffer.size = job->body_size;
+    buffer.offset = 0;
+    buffer.capacity = job->body_size;
+    buffer.index = NULL;
+    buffer.allocated = NULL;
+    buffer.stream = job->body;
+    uint64_t trace_start = TRACE_START();
+    currentJob = job;
+    conf->requestHandler(job->fd, job->op_code, &buffer, conf->handlersArgs);
+    currentJob = NULL;
+    TRACE_END("handler", trace_start, job->fd, job->op_code);
+    atomic_fetch_sub(&job->loop->in_flight, 1);
+    if (job->cache_ttl_ms > 0)
+        postCapture(job);
+}
+
+/**
+ * Queues a job to the worker of its connection.
+ */
+static void queueJob(AsyncLoop *loop, Connection *conn, WorkerJob *job)
+{
+    // the same worker runs every frame of a connection, so its handlers run and reply in order
+    Worker *worker = &loop->workers[conn->fd % loop->workers_size];
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail == NULL)
+    {
+        worker->head = job;
+        pthread_cond_signal(&worker->ready);
+    }
+    else
+        worker->tail->next = job;
+    worker->tail = job;
+    pthread_mutex_unlock(&worker->lock);
+    conn->in_flight++;
+}
+
+static void *runWorker(void *_worker)
+{
+    Worker *worker = _worker;
+    for (;;)
+    {
+        pthread_mutex_lock(&worker->lock);
+        while (worker->head == NULL && !worker->stop)
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        if (worker->head == NULL)
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return NULL;
+        }
+        WorkerJob *job = worker->head;
+        worker->head = job->next;
+        if (worker->head == NULL)
+            worker->tail = NULL;
+        pthread_mutex_unlock(&worker->lock);
+
+        TRACE_END("worker queue", job->queued_at, job->fd, job->op_code);
+        runJob(worker, job);
+
+        // the loop keeps routing the frames of the connection here until it gets this
+        Completion *done = createJobCompletion(job, COMPLETION_DONE, job->fd);
+        // without it, the connection stays pinned to this worker, which is still correct
+        if (done != NULL)
+            pushCompletion(job->loop, done);
+        memFree(job->body);
+        memFree(job->capture.frame);
+        memFree(job);
+    }
+}
+
+/**
+ *
+ * ============ internal functions ============
+ *
+ **/
+
+/**
+ * Starts the worker threads of the loop.
+ *
+ * @returns `-1` on error, no worker is left running.
+ */
+int startWorkers(AsyncLoop *loop, int size)
+{
+    loop->workers = memCalloc(size, sizeof(Worker));
+    if (loop->workers == NULL)
+        return -1;
+    redilon_AsyncServerConf *conf = loop->conf;
+    for (int i = 0; i < size; i++)
+    {
+        Worker *worker = &loop->workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        // each worker gets one of the cpus, round robin
+        int *cpu = conf->worker_cpus_size > 0 ? &conf->worker_cpus[i % conf->worker_cpus_size] : NULL;
+        int res = cpu != NULL && setAttrCpus(&attr, cpu, 1) == -1 ? -1 : 0;
+        worker->stack_size = res == 0 ? reserveStack(&attr) : 0;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        if (res == -1 || worker->stack_size == 0 || pthread_create(&worker->thread, &attr, runWorker, worker) != 0)
+        {
+            pthread_attr_destroy(&attr);
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->ready);
+            if (worker->stack_size > 0)
+                releaseStack(worker->stack_size);
+            stopWorkers(loop);
+            errno = res == -1 ? EINVAL : worker->stack_size == 0 ? ENOMEM : EAGAIN;
+            return -1;
+        }
+        pthread_attr_destroy(&attr);
+        loop->workers_size++;
+    }
+    return 0;
+}
+
+/**
+ * Lets the workers finish the jobs they have queued and joins them. Their completions are left in the loop queue.
+ */
+void stopWorkers(AsyncLoop *loop)
+{
+    for (int i = 0; i < loop->workers_size; i++)
+    {
+        Worker *worker = &loop->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = 1;
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    for (int i = 0; i < loop->workers_size; i++)
+    {
+        Worker *worker = &loop->workers[i];
+        pthread_join(worker->thread, NULL);
+        releaseStack(worker->stack_size);
+        freeJobs(worker->head);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->ready);
+    }
+    memFree(loop->workers);
+    loop->workers = NULL;
+    loop->workers_size = 0;
+}
+
+/**
+ * Queues a frame to the worker of the connection. The job takes ownership of `body`.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int offloadFrame(AsyncLoop *loop, Connection *conn, uint8_t op_code, void *body, uint32_t body_size, uint32_t cache_ttl_ms)
+{
+    WorkerJob *job = memCalloc(1, sizeof(WorkerJob));
+    if (job == NULL)
+        return -1;
+    job->next = NULL;
+    job->loop = loop;
+    job->fd = conn->fd;
+    job->conn_id = conn->id;
+    job->op_code = op_code;
+    job->body = body;
+    job->body_size = body_size;
+    job->queued_at = TRACE_START();
+    job->cache_ttl_ms = cache_ttl_ms;
+    job->cache_generation = loop->cache.generation;
+    job->offloaded_at = loop->conf->shed_target_us > 0 ? nowUs() : 0;
+    atomic_fetch_add(&loop->in_flight, 1);
+    queueJob(loop, conn, job);
+    return 0;
+}
+
+/**
+ * Queues a busy reply to a frame over `max_in_flight` to the worker of the connection, behind its other frames.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int offloadRejected(AsyncLoop *loop, Connection *conn, uint8_t op_code)
+{
+    WorkerJob *job = memCalloc(1, sizeof(WorkerJob));
+    if (job == NULL)
+        return -1;
+    job->loop = loop;
+    job->fd = conn->fd;
+    job->conn_id = conn->id;
+    job->op_code = op_code;
+    job->queued_at = TRACE_START();
+    job->rejected = 1;
+    queueJob(loop, conn, job);
+    return 0;
+}
+
+/**
+ * @returns a completion to be filled and pushed or `NULL` if there is no memory.
+ */
+Completion *createCompletion(enum CompletionKind kind, int fd, uint64_t conn_id)
+{
+    Completion *completion = memCalloc(1, sizeof(Completion));
+    if (completion == NULL)
+        return NULL;
+    completion->kind = kind;
+    completion->fd = fd;
+    completion->conn_id = conn_id;
+    completion->file_fd = -1;
+    return completion;
+}
+
+/**
+ * Hands `completion` to the loop, safe to call from any thread. The loop is only woken up if nobody did it
+ * since it last took the completions.
+ */
+void pushCompletion(AsyncLoop *loop, Completion *completion)
+{
+    pushMpscQueue(&loop->completions, &completion->node);
+    uint64_t value = 1;
+    if (!atomic_exchange(&loop->wake_pending, 1))
+        while (write(loop->wake_fd, &value, sizeof(value)) == -1 && errno == EINTR)
+            ;
+}
+
+/**
+ * Only the loop thread can call it.
+ *
+ * @returns the oldest completion or `NULL` if there are none.
+ */
+Completion *popCompletion(AsyncLoop *loop)
+{
+    // `node` is the first member
+    return (Completion *)popMpscQueue(&loop->completions);
+}
+
+void freeCompletion(Completion *completion)
+{
+    if (completion->file_fd != -1)
+        close(completion->file_fd);
+    memFree(completion->data);
+    memFree(completion->topic);
+    memFree(completion->key);
+    memFree(completion);
+}
+
+/**
+ * @returns the job whose handler is running in this thread or `NULL` if this is not a worker.
+ */
+WorkerJob *getCurrentWorkerJob()
+{
+    return currentJob;
+}
+
+/**
+ * Posts data to be queued to `fd` by the loop. Takes ownership of `data`.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int postData(WorkerJob *job, int fd, void *data, size_t size)
+{
+    Completion *completion = createJobCompletion(job, COMPLETION_DATA, fd);
+    if (completion == NULL)
+        return -1;
+    if (job->cache_ttl_ms > 0 && fd == job->fd)
+        captureReply(&job->capture, data, size);
+    completion->data = data;
+    completion->size = size;
+    pushCompletion(job->loop, completion);
+    return 0;
+}
+
+/**
+ * Posts a file frame to be queued to `fd` by the loop. Takes ownership of `header` and `file_fd`.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int postFile(WorkerJob *job, int fd, void *header, size_t header_size, int file_fd, off_t offset, size_t size)
+{
+    Completion *completion = createJobCompletion(job, COMPLETION_FILE, fd);
+    if (completion == NULL)
+        return -1;
+    job->capture.failed |= fd == job->fd;
+    completion->data = header;
+    completion->size = header_size;
+    completion->file_fd = file_fd;
+    completion->file_offset = offset;
+    completion->file_size = size;
+    pushCompletion(job->loop, completion);
+    return 0;
+}
+
+/**
+ * Asks the loop to close `fd` once what was posted before has been written.
+ *
+ * @returns `-1` if there is no memory.
+ */
+int postClose(WorkerJob *job, int fd)
+{
+    Completion *completion = createJobCompletion(job, COMPLETION_CLOSE, fd);
+    if (completion == NULL)
+        return -1;
+    job->capture.failed |= fd == job->fd;
+    pushCompletion(job->loop, completion);
+    return 0;
+}